@@ -5,10 +5,30 @@
 
 #include <sys/conf.h>
 #include <sys/uio.h>
+#include <sys/fcntl.h>
 #include <sys/malloc.h>
 #include <sys/ioccom.h>
+#include <sys/lock.h>
+#include <sys/mutex.h>
+#include <sys/sx.h>
+#include <sys/sysctl.h>
+#include <sys/counter.h>
+#include <sys/time.h>
+#include <sys/proc.h>
+#include <sys/rwlock.h>
+#include <sys/selinfo.h>
+#include <sys/event.h>
+#include <sys/poll.h>
+#include <machine/atomic.h>
+
+#include <vm/vm.h>
+#include <vm/pmap.h>
+#include <vm/vm_object.h>
+#include <vm/vm_page.h>
+#include <vm/vm_pager.h>
 
 #include "echo.h"
+#include "echo_ring.h"
 
 /* Needed only if want it to be extern. */
 //MALLOC_DECLARE(M_ECHO);
@@ -16,43 +36,332 @@ static MALLOC_DEFINE(M_ECHO, "echo_buffer", "buffer for echo driver");
 
 /* Forward declarations. */
 /*
- * No need to define open/close,
- * use default implementation
+ * No need to define close, use default implementation
 
-static d_open_t		echo_open;
 static d_close_t	echo_close;
 */
+static d_open_t		echo_open;
 static d_read_t		echo_read;
 static d_write_t	echo_write;
 static d_ioctl_t	echo_ioctl;
+static d_mmap_single_t	echo_mmap_single;
+static d_poll_t		echo_poll;
+static d_kqfilter_t	echo_kqfilter;
 
 static struct cdevsw echo_cdevsw = {
 	.d_version = 	D_VERSION,
-	//.d_open =	echo_open,
+	.d_open =	echo_open,
 	//.d_close =	echo_close,
 	.d_read =	echo_read,
 	.d_write = 	echo_write,
 	.d_ioctl =	echo_ioctl,
+	.d_mmap_single = echo_mmap_single,
+	.d_poll =	echo_poll,
+	.d_kqfilter =	echo_kqfilter,
 	.d_name =	"echo"
 };
 
 typedef struct echo {
 	int buffer_size;
-	char *buffer;
-	int length;
+	char **pages;		/* buffer storage, PAGE_SIZE chunks */
+	int npages;
+	struct echo_mmap_hdr *hdr;	/* control page, message length */
+	struct mtx map_mtx;	/* 'pages' vs. the mmap fault handler */
+	int mapped;		/* live pager object, see echo_mmap_single() */
+	int mode;		/* ECHO_MODE_MESSAGE or ECHO_MODE_FIFO */
+	struct echo_ring ring;	/* FIFO mode indices into buffer */
+	int dying;
+	struct sx lock;		/* exclusive for resize/clear/mode only */
+	struct sx rd_lock;	/* serializes FIFO readers */
+	struct sx wr_lock;	/* serializes FIFO writers */
+	struct mtx wait_mtx;	/* sleep interlock for FIFO mode */
+	int rd_waiting;
+	int wr_waiting;
+	struct selinfo rsel;	/* poll/kqueue readers, knlist on wait_mtx */
+	struct selinfo wsel;	/* poll/kqueue writers */
+	int polled;		/* sticky, rsel/wsel may have waiters */
+	struct cdev *dev;
+	struct sysctl_ctx_list sysctl;
 } echo_t;
 
-static echo_t *echo_message;
-static struct cdev *echo_dev;
+/*
+ * Independent instances, /dev/echo0 .. /dev/echoN-1, each with its own
+ * buffer and locks so unrelated clients never share state. /dev/echo is
+ * an alias for unit 0.
+ */
+#define ECHO_MAX_UNITS	64
+
+static echo_t **echo_units;
+
+static SYSCTL_NODE(_hw, OID_AUTO, echo, CTLFLAG_RW | CTLFLAG_MPSAFE, 0,
+    "echo driver");
+
+static int echo_nunits = 4;
+SYSCTL_INT(_hw_echo, OID_AUTO, units, CTLFLAG_RDTUN, &echo_nunits, 0,
+    "number of /dev/echoN instances");
+
+static int echo_max_buffer_size = 16 * 1024 * 1024;
+SYSCTL_INT(_hw_echo, OID_AUTO, max_buffer_size, CTLFLAG_RWTUN,
+    &echo_max_buffer_size, 0, "largest buffer ECHO_SET_BUFFER_SIZE accepts");
+
+/*
+ * Driver-wide statistics, summed over all units. counter(9) keeps them
+ * per-CPU so updating them costs no shared cache line; readers sum the
+ * CPUs when the sysctl is read.
+ */
+static struct echo_stats {
+	counter_u64_t bytes_in;
+	counter_u64_t bytes_out;
+	counter_u64_t reads;
+	counter_u64_t writes;
+	counter_u64_t short_reads;
+	counter_u64_t resizes;
+	counter_u64_t uiomove_failures;
+	counter_u64_t latency[ECHO_LAT_BUCKETS];
+} echo_stats;
+
+#define ECHO_NSTATS	(sizeof(struct echo_stats) / sizeof(counter_u64_t))
+
+static SYSCTL_NODE(_hw_echo, OID_AUTO, stats, CTLFLAG_RD | CTLFLAG_MPSAFE, 0,
+    "echo driver statistics");
+
+/*
+ * The counters are allocated at MOD_LOAD and freed at MOD_UNLOAD, which
+ * runs before the linker deregisters a module's static sysctls. Their
+ * oids live on a context of their own instead, freed before them.
+ */
+static struct sysctl_ctx_list echo_stats_ctx;
+
+static void
+echo_stats_init(void)
+{
+	struct sysctl_oid_list *children;
+
+	COUNTER_ARRAY_ALLOC((counter_u64_t *)&echo_stats, ECHO_NSTATS,
+	    M_WAITOK);
+	sysctl_ctx_init(&echo_stats_ctx);
+	children = SYSCTL_STATIC_CHILDREN(_hw_echo_stats);
+	SYSCTL_ADD_COUNTER_U64(&echo_stats_ctx, children, OID_AUTO,
+	    "bytes_in", CTLFLAG_RD, &echo_stats.bytes_in,
+	    "bytes written to the driver");
+	SYSCTL_ADD_COUNTER_U64(&echo_stats_ctx, children, OID_AUTO,
+	    "bytes_out", CTLFLAG_RD, &echo_stats.bytes_out,
+	    "bytes read from the driver");
+	SYSCTL_ADD_COUNTER_U64(&echo_stats_ctx, children, OID_AUTO, "reads",
+	    CTLFLAG_RD, &echo_stats.reads, "read calls");
+	SYSCTL_ADD_COUNTER_U64(&echo_stats_ctx, children, OID_AUTO, "writes",
+	    CTLFLAG_RD, &echo_stats.writes, "write calls");
+	SYSCTL_ADD_COUNTER_U64(&echo_stats_ctx, children, OID_AUTO,
+	    "short_reads", CTLFLAG_RD, &echo_stats.short_reads,
+	    "reads that returned less than requested");
+	SYSCTL_ADD_COUNTER_U64(&echo_stats_ctx, children, OID_AUTO,
+	    "resizes", CTLFLAG_RD, &echo_stats.resizes,
+	    "successful buffer resizes");
+	SYSCTL_ADD_COUNTER_U64(&echo_stats_ctx, children, OID_AUTO,
+	    "uiomove_failures", CTLFLAG_RD, &echo_stats.uiomove_failures,
+	    "failed copies to or from user space");
+	SYSCTL_ADD_COUNTER_U64_ARRAY(&echo_stats_ctx, children, OID_AUTO,
+	    "latency", CTLFLAG_RD, &echo_stats.latency[0], ECHO_LAT_BUCKETS,
+	    "read/write latency, bucket i counts [2^(i-1), 2^i) "
+	    "microseconds");
+}
+
+static void
+echo_stats_fini(void)
+{
+
+	sysctl_ctx_free(&echo_stats_ctx);
+	COUNTER_ARRAY_FREE((counter_u64_t *)&echo_stats, ECHO_NSTATS);
+}
 
 /*
+ * Account one read or write that moved 'bytes' and started at 'start'.
+ * Sleeping in FIFO mode counts towards the latency.
+ */
+static void
+echo_account(counter_u64_t calls, counter_u64_t bytes, ssize_t n,
+    sbintime_t start)
+{
+	int us = sbttous(sbinuptime() - start);
+
+	counter_u64_add(calls, 1);
+	counter_u64_add(bytes, n);
+	counter_u64_add(echo_stats.latency[MIN(fls(us), ECHO_LAT_BUCKETS - 1)],
+	    1);
+}
+
+/*
+ * The buffer is a vector of PAGE_SIZE chunks rather than one contiguous
+ * allocation. Growing it allocates new pages and a larger pointer array,
+ * existing data never moves; shrinking only lowers buffer_size and keeps
+ * the pages until unload. malloc(9) returns naturally aligned memory for
+ * power-of-two sizes, so each chunk is a whole page.
+ */
+static char *
+echo_buf_ptr(echo_t *sc, size_t off)
+{
+	return (sc->pages[off / PAGE_SIZE] + off % PAGE_SIZE);
+}
+
+/*
+ * uiomove() to or from bytes [off, off + n) of the buffer.
+ */
+static int
+echo_buf_uiomove(echo_t *sc, size_t off, size_t n, struct uio *uio)
+{
+	int error = 0;
+	size_t len;
+
+	while (n > 0 && error == 0) {
+		len = MIN(n, PAGE_SIZE - off % PAGE_SIZE);
+		error = uiomove(echo_buf_ptr(sc, off), len, uio);
+		off += len;
+		n -= len;
+	}
+	if (error != 0)
+		counter_u64_add(echo_stats.uiomove_failures, 1);
+
+	return (error);
+}
+
+static void
+echo_buf_grow(echo_t *sc, int size)
+{
+	char **pages, **old;
+	int i, npages = howmany(size, PAGE_SIZE);
+
+	if (npages <= sc->npages)
+		return;
+
+	pages = malloc(npages * sizeof(char *), M_ECHO, M_WAITOK);
+	for (i = 0; i < sc->npages; i++)
+		pages[i] = sc->pages[i];
+	for (; i < npages; i++)
+		pages[i] = malloc(PAGE_SIZE, M_ECHO, M_WAITOK | M_ZERO);
+
+	/* The fault handler can't take 'lock'. */
+	mtx_lock(&sc->map_mtx);
+	old = sc->pages;
+	sc->pages = pages;
+	sc->npages = npages;
+	mtx_unlock(&sc->map_mtx);
+	free(old, M_ECHO);
+}
+
+/*
+ * memset() bytes [off, off + n) of the buffer.
+ */
+static void
+echo_buf_set(echo_t *sc, int off, int c, int n)
+{
+	int len;
+
+	while (n > 0) {
+		len = MIN(n, PAGE_SIZE - off % PAGE_SIZE);
+		memset(echo_buf_ptr(sc, off), c, len);
+		off += len;
+		n -= len;
+	}
+}
+
+/*
+ * Fill bytes [off, off + n) of the buffer with copies of 'pat'.
+ */
+static void
+echo_buf_pattern(echo_t *sc, int off, const char *pat, int patlen, int n)
+{
+	char *p;
+	int i, len;
+
+	while (n > 0) {
+		len = MIN(n, PAGE_SIZE - off % PAGE_SIZE);
+		p = echo_buf_ptr(sc, off);
+		for (i = 0; i < len; i++)
+			p[i] = pat[(off + i) % patlen];
+		off += len;
+		n -= len;
+	}
+}
+
+static void
+echo_buf_zero(echo_t *sc)
+{
+	int i;
+
+	for (i = 0; i < howmany(sc->buffer_size, PAGE_SIZE); i++)
+		memset(sc->pages[i], '\0', PAGE_SIZE);
+}
+
+/*
+ * The message length lives in the header page, where an in-place
+ * producer may have set it to anything.
+ */
+static int
+echo_msg_length(echo_t *sc)
+{
+	return (MIN(sc->hdr->length, (uint32_t)sc->buffer_size - 1));
+}
+
+/*
+ * Bracket a change of the message, see struct echo_mmap_hdr.
+ */
+static void
+echo_hdr_begin(echo_t *sc)
+{
+	atomic_store_int(&sc->hdr->gen, (sc->hdr->gen + 1) | 1);
+	atomic_thread_fence_rel();
+}
+
+static void
+echo_hdr_end(echo_t *sc)
+{
+	atomic_store_rel_int(&sc->hdr->gen, sc->hdr->gen + 1);
+}
+
+static void
+echo_buf_free(echo_t *sc)
+{
+	int i;
+
+	for (i = 0; i < sc->npages; i++)
+		free(sc->pages[i], M_ECHO);
+	free(sc->pages, M_ECHO);
+}
+
+/*
+ * Per-descriptor state. devfs does not pass O_APPEND down to d_write,
+ * so it is remembered here, and message-mode readiness needs to know
+ * which message this descriptor has already read.
+ */
+struct echo_fd {
+	echo_t *sc;
+	int append;
+	u_int seen_gen;		/* hdr->gen at the last message read */
+};
+
+static void
+echo_fd_dtor(void *data)
+{
+	free(data, M_ECHO);
+}
+
 static int
 echo_open(struct cdev *dev, int oflags, int devtype, struct thread *td)
 {
-	uprintf("Opening echo device.\n");
-	return (0);
+	struct echo_fd *fd;
+	int error;
+
+	fd = malloc(sizeof(*fd), M_ECHO, M_WAITOK | M_ZERO);
+	fd->sc = dev->si_drv1;
+	fd->append = (oflags & O_APPEND) != 0;
+	error = devfs_set_cdevpriv(fd, echo_fd_dtor);
+	if (error != 0)
+		free(fd, M_ECHO);
+
+	return (error);
 }
 
+/*
 static int
 echo_close(struct cdev *dev, int fflags, int devtype, struct thread *td)
 {
@@ -61,6 +370,167 @@ echo_close(struct cdev *dev, int fflags, int devtype, struct thread *td)
 }
 */
 
+/*
+ * FIFO mode: the buffer is a ring, writers append at the head and
+ * readers consume from the tail. A reader sleeps while the ring is
+ * empty, a writer while it is full, unless the descriptor is
+ * non-blocking.
+ *
+ * The common one-writer/one-reader case runs without a shared lock:
+ * the ring indices are published with acquire/release atomics (see
+ * echo_ring.c). wr_lock and rd_lock only serialize several writers or
+ * several readers among themselves, and 'lock' is held shared so that
+ * resize, clear and mode changes (which take it exclusive) cannot pull
+ * the buffer out from under an in-flight uiomove().
+ *
+ * Sleeping uses wait_mtx as the interlock. The sleeper announces itself
+ * in rd_waiting/wr_waiting, which is also its wait channel, and then
+ * re-checks the ring; the other side moves its index and then checks the
+ * flag, so a full fence on both sides guarantees that one of them
+ * notices the other. The waker only
+ * touches wait_mtx when somebody is actually asleep, or once poll(2) or
+ * kqueue(2) has been used on the unit, which follows the same protocol
+ * with the sticky 'polled' flag.
+ */
+static int
+echo_fifo_wait(echo_t *sc, int writer)
+{
+	struct echo_ring *r = &sc->ring;
+	int *waiting = writer ? &sc->wr_waiting : &sc->rd_waiting;
+	int error = 0;
+
+	sx_sunlock(&sc->lock);
+	mtx_lock(&sc->wait_mtx);
+	atomic_store_int(waiting, 1);
+	atomic_thread_fence_seq_cst();
+	if ((writer ? echo_ring_free(r) : echo_ring_used(r)) == 0 &&
+	    !sc->dying)
+		error = mtx_sleep(waiting, &sc->wait_mtx, PCATCH,
+		    writer ? "echowr" : "echord", 0);
+	atomic_store_int(waiting, 0);
+	mtx_unlock(&sc->wait_mtx);
+	sx_slock(&sc->lock);
+
+	return (error);
+}
+
+/*
+ * Wake up the other side: readers after a write, writers after a read.
+ * Called with wait_mtx held.
+ */
+static void
+echo_notify_locked(echo_t *sc, int writer)
+{
+	struct selinfo *sel = writer ? &sc->rsel : &sc->wsel;
+
+	wakeup(writer ? &sc->rd_waiting : &sc->wr_waiting);
+	selwakeup(sel);
+	KNOTE_LOCKED(&sel->si_note, 0);
+}
+
+static void
+echo_fifo_wakeup(echo_t *sc, int writer)
+{
+	int *waiting = writer ? &sc->rd_waiting : &sc->wr_waiting;
+
+	atomic_thread_fence_seq_cst();
+	if (atomic_load_int(waiting) == 0 &&
+	    atomic_load_int(&sc->polled) == 0)
+		return;
+
+	mtx_lock(&sc->wait_mtx);
+	echo_notify_locked(sc, writer);
+	mtx_unlock(&sc->wait_mtx);
+}
+
+/*
+ * Wake up everybody, used when the ring is reset under the exclusive lock.
+ */
+static void
+echo_fifo_wakeup_all(echo_t *sc)
+{
+	mtx_lock(&sc->wait_mtx);
+	echo_notify_locked(sc, 0);
+	echo_notify_locked(sc, 1);
+	mtx_unlock(&sc->wait_mtx);
+}
+
+/*
+ * Take rd_lock or wr_lock. The holder may be asleep in echo_fifo_wait()
+ * for as long as the ring stays empty or full, so a non-blocking caller
+ * must not wait for it and a blocking one must stay interruptible.
+ */
+static int
+echo_fifo_lock(struct sx *sx, int ioflag)
+{
+	if (ioflag & IO_NDELAY)
+		return (sx_try_xlock(sx) ? 0 : EWOULDBLOCK);
+	return (sx_xlock_sig(sx));
+}
+
+static int
+echo_fifo_write(echo_t *sc, struct uio *uio, int ioflag)
+{
+	struct echo_ring *r = &sc->ring;
+	unsigned int off, n;
+	int error = 0;
+
+	while (uio->uio_resid > 0) {
+		while (echo_ring_free(r) == 0) {
+			if (sc->dying)
+				return (ENXIO);
+			if (sc->mode != ECHO_MODE_FIFO)
+				return (EIO);
+			if (ioflag & IO_NDELAY)
+				return (EWOULDBLOCK);
+			error = echo_fifo_wait(sc, 1);
+			if (error != 0)
+				return (error);
+		}
+
+		n = MIN(echo_ring_wspan(r, &off), uio->uio_resid);
+		error = echo_buf_uiomove(sc, off, n, uio);
+		if (error != 0)
+			return (error);
+		echo_ring_produce(r, n);
+		echo_fifo_wakeup(sc, 1);
+	}
+
+	return (error);
+}
+
+static int
+echo_fifo_read(echo_t *sc, struct uio *uio, int ioflag)
+{
+	struct echo_ring *r = &sc->ring;
+	unsigned int off, n;
+	int error = 0;
+
+	while (echo_ring_used(r) == 0) {
+		if (sc->dying)
+			return (ENXIO);
+		if (sc->mode != ECHO_MODE_FIFO)
+			return (0);
+		if (ioflag & IO_NDELAY)
+			return (EWOULDBLOCK);
+		error = echo_fifo_wait(sc, 0);
+		if (error != 0)
+			return (error);
+	}
+
+	/* Return whatever is there, at most two spans if it wraps. */
+	while (uio->uio_resid > 0 && echo_ring_used(r) > 0) {
+		n = MIN(echo_ring_rspan(r, &off), uio->uio_resid);
+		error = echo_buf_uiomove(sc, off, n, uio);
+		if (error != 0)
+			break;
+		echo_ring_consume(r, n);
+	}
+	echo_fifo_wakeup(sc, 0);
+
+	return (error);
+}
+
 /*
  * uio->uio_resid  - number of bytes remaining to be transfered
  * uio->uio_offset - offset into the data
@@ -68,62 +538,205 @@ echo_close(struct cdev *dev, int fflags, int devtype, struct thread *td)
  * uiomove() decrements resid (by one) and increments offset (by one)
  * 	     for each byte copied. Multiple calls is ok.
  */
+/*
+ * Message mode: the data lands at the file offset, or at the end of
+ * the message for O_APPEND. A write at offset 0 replaces the message,
+ * anything else extends it, and a gap left by writing past the end
+ * reads back as zeros. All iovecs of a writev() are copied in the same
+ * pass under one lock hold; if the copy faults half-way the message
+ * keeps whatever made it in. Called with 'lock' held exclusive.
+ */
 static int
-echo_write(struct cdev *dev, struct uio *uio, int ioflag)
+echo_msg_write(echo_t *sc, struct uio *uio, int ioflag)
 {
+	struct echo_fd *fd;
+	ssize_t resid = uio->uio_resid;
 	int error = 0;
 	int amount;
-	int left = echo_message->buffer_size - 1 - uio->uio_offset;
+	int length;
+	int off;
+
+	if (devfs_get_cdevpriv((void **)&fd) == 0 && fd->append)
+		ioflag |= IO_APPEND;
 
-	amount = MIN(uio->uio_resid, left > 0 ? left : 0);
+	length = echo_msg_length(sc);
+	if (ioflag & IO_APPEND)
+		uio->uio_offset = length;
+	if (uio->uio_offset < 0 || uio->uio_offset >= sc->buffer_size - 1)
+		goto out;
+	off = uio->uio_offset;
+	amount = MIN(uio->uio_resid, sc->buffer_size - 1 - off);
 	if (amount == 0)
-		return (error);
+		goto out;
 
-	error = uiomove(echo_message->buffer, amount, uio);
-	if (error != 0) {
+	echo_hdr_begin(sc);
+	if (off > length)
+		echo_buf_set(sc, length, '\0', off - length);
+	error = echo_buf_uiomove(sc, off, amount, uio);
+	if (error != 0)
 		uprintf("Write failed.\n");
-		return (error);
-	}
-
-	echo_message->buffer[amount] = '\0';
-	echo_message->length = amount;
 
+	if (uio->uio_resid < resid) {
+		if (off == 0 && !(ioflag & IO_APPEND))
+			length = uio->uio_offset;
+		else
+			length = MAX(length, uio->uio_offset);
+	}
+	*echo_buf_ptr(sc, length) = '\0';
+	sc->hdr->length = length;
+	echo_hdr_end(sc);
+	echo_fifo_wakeup(sc, 1);
+out:
 	return (error);
 }
 
+/*
+ * Reads at or past the end of the message, or at a negative offset,
+ * return EOF. Called with 'lock' held shared.
+ */
 static int
-echo_read(struct cdev *dev, struct uio *uio, int ioflag)
+echo_msg_read(echo_t *sc, struct uio *uio, int ioflag)
 {
+	struct echo_fd *fd;
 	int error = 0;
-	int amount;
-	int left = echo_message->length - uio->uio_offset;
-
-	amount = MIN(uio->uio_resid, left > 0 ? left : 0);
+	off_t length;
+	size_t amount;
 
-	error = uiomove(echo_message->buffer + uio->uio_offset, amount, uio);
+	length = echo_msg_length(sc);
+	if (uio->uio_offset >= 0 && uio->uio_offset < length) {
+		amount = MIN((size_t)uio->uio_resid,
+		    (size_t)(length - uio->uio_offset));
+		error = echo_buf_uiomove(sc, uio->uio_offset, amount, uio);
+	}
 	if (error != 0)
 		uprintf("Read failed.\n");
+	else if (devfs_get_cdevpriv((void **)&fd) == 0)
+		atomic_store_int(&fd->seen_gen, sc->hdr->gen);
+
+	return (error);
+}
+
+static void
+echo_io_unlock(echo_t *sc, int writer, int mode)
+{
+	if (mode == ECHO_MODE_FIFO) {
+		sx_sunlock(&sc->lock);
+		sx_xunlock(writer ? &sc->wr_lock : &sc->rd_lock);
+	} else if (writer) {
+		sx_xunlock(&sc->lock);
+	} else {
+		sx_sunlock(&sc->lock);
+	}
+}
+
+/*
+ * Take the locks a read or write needs in the unit's mode: rd_lock or
+ * wr_lock and 'lock' shared for the FIFO, 'lock' alone for the message,
+ * exclusive to write it. The mode can only change under 'lock'
+ * exclusive, so it is checked again once the locks are held, and they
+ * are retaken if it moved in between. *modep is the mode they are
+ * held for.
+ */
+static int
+echo_io_lock(echo_t *sc, int writer, int ioflag, int *modep)
+{
+	int error, mode;
+
+	for (;;) {
+		mode = atomic_load_int(&sc->mode);
+		if (mode == ECHO_MODE_FIFO) {
+			error = echo_fifo_lock(writer ? &sc->wr_lock :
+			    &sc->rd_lock, ioflag);
+			if (error != 0)
+				return (error);
+			sx_slock(&sc->lock);
+		} else if (writer) {
+			sx_xlock(&sc->lock);
+		} else {
+			sx_slock(&sc->lock);
+		}
+		if (sc->mode == mode)
+			break;
+		echo_io_unlock(sc, writer, mode);
+	}
+	*modep = mode;
+
+	return (0);
+}
+
+static int
+echo_write(struct cdev *dev, struct uio *uio, int ioflag)
+{
+	echo_t *sc = dev->si_drv1;
+	sbintime_t start = sbinuptime();
+	ssize_t resid = uio->uio_resid;
+	int error, mode;
+
+	error = echo_io_lock(sc, 1, ioflag, &mode);
+	if (error == 0) {
+		/* dofilewrite() turns a partial EWOULDBLOCK into success. */
+		if (mode == ECHO_MODE_FIFO)
+			error = echo_fifo_write(sc, uio, ioflag);
+		else
+			error = echo_msg_write(sc, uio, ioflag);
+		echo_io_unlock(sc, 1, mode);
+	}
+	echo_account(echo_stats.writes, echo_stats.bytes_in,
+	    resid - uio->uio_resid, start);
 
 	return (error);
 }
 
 static int
-echo_set_buffer_size(int size)
+echo_read(struct cdev *dev, struct uio *uio, int ioflag)
+{
+	echo_t *sc = dev->si_drv1;
+	sbintime_t start = sbinuptime();
+	ssize_t resid = uio->uio_resid;
+	int error, mode;
+
+	error = echo_io_lock(sc, 0, ioflag, &mode);
+	if (error == 0) {
+		if (mode == ECHO_MODE_FIFO)
+			error = echo_fifo_read(sc, uio, ioflag);
+		else
+			error = echo_msg_read(sc, uio, ioflag);
+		echo_io_unlock(sc, 0, mode);
+	}
+	echo_account(echo_stats.reads, echo_stats.bytes_out,
+	    resid - uio->uio_resid, start);
+	if (error == 0 && uio->uio_resid > 0)
+		counter_u64_add(echo_stats.short_reads, 1);
+
+	return (error);
+}
+
+static int
+echo_set_buffer_size(echo_t *sc, int size)
 {
 	int error = 0;
 
-	if (echo_message->buffer_size == size)
+	if (sc->buffer_size == size)
 		return (error);
 
-	if (size >= 128 && size <= 512) {
-		echo_message->buffer = realloc(echo_message->buffer, size,
-		    M_ECHO, M_WAITOK);
-		echo_message->buffer_size = size;
+	/* Can't move data around under the ring indices. */
+	if (sc->mode == ECHO_MODE_FIFO &&
+	    echo_ring_used(&sc->ring) != 0)
+		return (EBUSY);
+
+	if (size >= 128 && size <= echo_max_buffer_size) {
+		echo_buf_grow(sc, size);
+		echo_hdr_begin(sc);
+		sc->buffer_size = size;
+		sc->hdr->buffer_size = size;
 
-		if (echo_message->length >= size) {
-			echo_message->length = size - 1;
-			echo_message->buffer[size - 1] = '\0';
+		if (sc->hdr->length >= size) {
+			sc->hdr->length = size - 1;
+			*echo_buf_ptr(sc, size - 1) = '\0';
 		}
+		echo_hdr_end(sc);
+		echo_ring_init(&sc->ring, size);
+		counter_u64_add(echo_stats.resizes, 1);
 	} else {
 		error = EINVAL;
 	}
@@ -131,51 +744,645 @@ echo_set_buffer_size(int size)
 	return (error);
 }
 
+static int
+echo_set_mode(echo_t *sc, int mode)
+{
+	if (mode != ECHO_MODE_MESSAGE && mode != ECHO_MODE_FIFO)
+		return (EINVAL);
+
+	echo_hdr_begin(sc);
+	atomic_store_int(&sc->mode, mode);	/* read unlocked by echo_io_lock() */
+	sc->hdr->mode = mode;
+	sc->hdr->length = 0;
+	echo_hdr_end(sc);
+	echo_ring_init(&sc->ring, sc->buffer_size);
+	echo_fifo_wakeup_all(sc);
+
+	return (0);
+}
+
+static void
+echo_clear(echo_t *sc)
+{
+	echo_hdr_begin(sc);
+	echo_buf_zero(sc);
+	sc->hdr->length = 0;
+	echo_hdr_end(sc);
+	echo_ring_init(&sc->ring, sc->buffer_size);
+	echo_fifo_wakeup_all(sc);
+}
+
+/*
+ * Replace the message with 'pat' repeated over the whole buffer.
+ */
+static int
+echo_fill(echo_t *sc, const char *pat, int patlen)
+{
+	int length = sc->buffer_size - 1;
+
+	if (sc->mode == ECHO_MODE_FIFO)
+		return (EBUSY);
+
+	echo_hdr_begin(sc);
+	echo_buf_pattern(sc, 0, pat, patlen, length);
+	*echo_buf_ptr(sc, length) = '\0';
+	sc->hdr->length = length;
+	echo_hdr_end(sc);
+	echo_fifo_wakeup(sc, 1);
+
+	return (0);
+}
+
+static void
+echo_stats_fetch(echo_t *sc, struct echo_stats_snap *snap)
+{
+	int i;
+
+	snap->bytes_in = counter_u64_fetch(echo_stats.bytes_in);
+	snap->bytes_out = counter_u64_fetch(echo_stats.bytes_out);
+	snap->reads = counter_u64_fetch(echo_stats.reads);
+	snap->writes = counter_u64_fetch(echo_stats.writes);
+	snap->short_reads = counter_u64_fetch(echo_stats.short_reads);
+	snap->resizes = counter_u64_fetch(echo_stats.resizes);
+	snap->uiomove_failures =
+	    counter_u64_fetch(echo_stats.uiomove_failures);
+	for (i = 0; i < ECHO_LAT_BUCKETS; i++)
+		snap->latency[i] = counter_u64_fetch(echo_stats.latency[i]);
+	snap->buffer_size = sc->buffer_size;
+	snap->length = sc->mode == ECHO_MODE_FIFO ?
+	    echo_ring_used(&sc->ring) : echo_msg_length(sc);
+	snap->mode = sc->mode;
+}
+
+/*
+ * Per-command kernel copy of the pattern going in or the snapshot
+ * going out, so that no copyin/copyout happens under the unit lock.
+ */
+union echo_cmd_data {
+	char pat[ECHO_FILL_MAX];
+	struct echo_stats_snap snap;
+};
+
+static int
+echo_cmd_exec(echo_t *sc, struct echo_cmd *c, union echo_cmd_data *d)
+{
+	switch (c->op) {
+	case ECHO_CMD_CLEAR:
+		echo_clear(sc);
+		return (0);
+	case ECHO_CMD_RESIZE:
+		return (echo_set_buffer_size(sc, c->arg));
+	case ECHO_CMD_MODE:
+		return (echo_set_mode(sc, c->arg));
+	case ECHO_CMD_FILL:
+		return (echo_fill(sc, d->pat, c->arg));
+	case ECHO_CMD_STATS:
+		echo_stats_fetch(sc, &d->snap);
+		return (0);
+	default:
+		return (EINVAL);
+	}
+}
+
+static int
+echo_batch(echo_t *sc, struct echo_batch *b)
+{
+	struct echo_cmd *cmds;
+	union echo_cmd_data *data;
+	int error, i;
+
+	if (b->count == 0 || b->count > ECHO_BATCH_MAX)
+		return (EINVAL);
+
+	cmds = malloc(b->count * sizeof(*cmds), M_ECHO, M_WAITOK);
+	data = malloc(b->count * sizeof(*data), M_ECHO, M_WAITOK | M_ZERO);
+	error = copyin((void *)(uintptr_t)b->cmds, cmds,
+	    b->count * sizeof(*cmds));
+	for (i = 0; error == 0 && i < b->count; i++) {
+		if (cmds[i].op != ECHO_CMD_FILL)
+			continue;
+		if (cmds[i].arg == 0 || cmds[i].arg > ECHO_FILL_MAX)
+			error = EINVAL;
+		else
+			error = copyin((void *)(uintptr_t)cmds[i].ptr,
+			    data[i].pat, cmds[i].arg);
+	}
+	if (error != 0)
+		goto out;
+
+	sx_xlock(&sc->lock);
+	for (i = 0; i < b->count; i++) {
+		b->error = echo_cmd_exec(sc, &cmds[i], &data[i]);
+		if (b->error != 0)
+			break;
+	}
+	sx_xunlock(&sc->lock);
+	b->done = i;
+
+	for (i = 0; i < b->done && error == 0; i++)
+		if (cmds[i].op == ECHO_CMD_STATS)
+			error = copyout(&data[i].snap,
+			    (void *)(uintptr_t)cmds[i].ptr, sizeof(data[i].snap));
+out:
+	free(data, M_ECHO);
+	free(cmds, M_ECHO);
+
+	return (error);
+}
+
 static int
 echo_ioctl(struct cdev *cdev, u_long cmd, caddr_t data, int fflag,
     struct thread *td)
 {
+	echo_t *sc = cdev->si_drv1;
 	int  error = 0;
 
+	/* Does its own locking around user copies. */
+	if (cmd == ECHO_BATCH)
+		return (echo_batch(sc, (struct echo_batch *)data));
+
+	sx_xlock(&sc->lock);
 	switch (cmd) {
 	case ECHO_CLEAR_BUFFER:
-		memset(echo_message->buffer, '\0',
-		    echo_message->buffer_size);
-		echo_message->length = 0;
+		echo_clear(sc);
 		uprintf("Buffer cleared.\n");
 		break;
 	case ECHO_SET_BUFFER_SIZE:
-		error = echo_set_buffer_size(*(int *)data);
+		error = echo_set_buffer_size(sc, *(int *)data);
 		if (error == 0)
 			uprintf("Buffer resized.\n");
 		break;
+	case ECHO_SET_MODE:
+		error = echo_set_mode(sc, *(int *)data);
+		break;
 	default:
 		error = ENOTTY;
 		break;
 	}
+	sx_xunlock(&sc->lock);
+
+	return (error);
+}
+
+/*
+ * The same controls as sysctls, hw.echo.N.buffer_size and
+ * hw.echo.N.mode. hw.echo.buffer_size is unit 0.
+ */
+static int
+echo_sysctl_buffer_size(SYSCTL_HANDLER_ARGS)
+{
+	echo_t *sc = arg1;
+	int error;
+	int size = sc->buffer_size;
+
+	error = sysctl_handle_int(oidp, &size, 0, req);
+	if (error || req->newptr == NULL)
+		return (error);
+
+	sx_xlock(&sc->lock);
+	error = echo_set_buffer_size(sc, size);
+	sx_xunlock(&sc->lock);
+
+	return (error);
+}
+
+static int
+echo_sysctl_mode(SYSCTL_HANDLER_ARGS)
+{
+	echo_t *sc = arg1;
+	int error;
+	int mode = sc->mode;
+
+	error = sysctl_handle_int(oidp, &mode, 0, req);
+	if (error || req->newptr == NULL || mode == sc->mode)
+		return (error);
+
+	sx_xlock(&sc->lock);
+	error = echo_set_mode(sc, mode);
+	sx_xunlock(&sc->lock);
+
+	return (error);
+}
+
+static void
+echo_sysctl_init(echo_t *sc, int unit)
+{
+	struct sysctl_oid *poid;
+	char name[16];
+
+	sysctl_ctx_init(&sc->sysctl);
+	snprintf(name, sizeof(name), "%d", unit);
+	poid = SYSCTL_ADD_NODE(&sc->sysctl, SYSCTL_STATIC_CHILDREN(_hw_echo),
+	    OID_AUTO, name, CTLFLAG_RW | CTLFLAG_MPSAFE, 0, "echo unit");
+	SYSCTL_ADD_PROC(&sc->sysctl, SYSCTL_CHILDREN(poid), OID_AUTO,
+	    "buffer_size", CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_MPSAFE, sc, 0,
+	    echo_sysctl_buffer_size, "I", "echo buffer size");
+	SYSCTL_ADD_PROC(&sc->sysctl, SYSCTL_CHILDREN(poid), OID_AUTO,
+	    "mode", CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_MPSAFE, sc, 0,
+	    echo_sysctl_mode, "I", "0 message, 1 FIFO");
+	if (unit == 0)
+		SYSCTL_ADD_PROC(&sc->sysctl, SYSCTL_STATIC_CHILDREN(_hw_echo),
+		    OID_AUTO, "buffer_size",
+		    CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_MPSAFE, sc, 0,
+		    echo_sysctl_buffer_size, "I", "echo buffer size of unit 0");
+}
+
+/*
+ * mmap(2) goes through a device pager object, one per unit, whose
+ * handle is the softc. The object lives as long as any mapping of the
+ * unit does: its constructor and destructor count it in 'mapped', and
+ * unload is refused while it exists. Page 0 is the header, page k the
+ * (k - 1)th buffer page. Pages are never freed before unload, so a
+ * mapping stays valid across resizes; after growing, remap to see the
+ * new pages.
+ */
+static int	echo_pg_ctor(void *handle, vm_ooffset_t size, vm_prot_t prot,
+		    vm_ooffset_t foff, struct ucred *cred, u_short *color);
+static void	echo_pg_dtor(void *handle);
+static int	echo_pg_fault(vm_object_t object, vm_ooffset_t offset,
+		    int prot, vm_page_t *mres);
+
+static struct cdev_pager_ops echo_pg_ops = {
+	.cdev_pg_ctor =		echo_pg_ctor,
+	.cdev_pg_dtor =		echo_pg_dtor,
+	.cdev_pg_fault =	echo_pg_fault,
+};
+
+static int echo_unloading;	/* refuse new mappings */
+
+static int
+echo_pg_ctor(void *handle, vm_ooffset_t size, vm_prot_t prot,
+    vm_ooffset_t foff, struct ucred *cred, u_short *color)
+{
+	echo_t *sc = handle;
+
+	mtx_lock(&sc->map_mtx);
+	sc->mapped++;
+	mtx_unlock(&sc->map_mtx);
+	*color = 0;
+
+	return (0);
+}
+
+static void
+echo_pg_dtor(void *handle)
+{
+	echo_t *sc = handle;
+
+	mtx_lock(&sc->map_mtx);
+	sc->mapped--;
+	mtx_unlock(&sc->map_mtx);
+}
+
+static int
+echo_pg_fault(vm_object_t object, vm_ooffset_t offset, int prot,
+    vm_page_t *mres)
+{
+	echo_t *sc = object->handle;
+	vm_pindex_t pidx = OFF_TO_IDX(offset);
+	vm_paddr_t paddr;
+	vm_page_t page;
+
+	mtx_lock(&sc->map_mtx);
+	if (pidx > sc->npages) {
+		mtx_unlock(&sc->map_mtx);
+		return (VM_PAGER_FAIL);
+	}
+	paddr = vtophys(pidx == 0 ? (char *)sc->hdr : sc->pages[pidx - 1]);
+	mtx_unlock(&sc->map_mtx);
+
+	if (((*mres)->flags & PG_FICTITIOUS) != 0) {
+		page = *mres;
+		vm_page_updatefake(page, paddr, VM_MEMATTR_DEFAULT);
+	} else {
+		VM_OBJECT_WUNLOCK(object);
+		page = vm_page_getfake(paddr, VM_MEMATTR_DEFAULT);
+		VM_OBJECT_WLOCK(object);
+		vm_page_replace(page, object, (*mres)->pindex, *mres);
+		*mres = page;
+	}
+	vm_page_valid(page);
+
+	return (VM_PAGER_OK);
+}
+
+static int
+echo_mmap_single(struct cdev *cdev, vm_ooffset_t *offset, vm_size_t size,
+    struct vm_object **object, int nprot)
+{
+	echo_t *sc = cdev->si_drv1;
+	vm_object_t obj;
+	vm_size_t len;
+	int error = 0;
+
+	sx_slock(&sc->lock);
+	len = ptoa(howmany(sc->buffer_size, PAGE_SIZE) + 1);
+	if (echo_unloading) {
+		error = ENXIO;
+		goto out;
+	}
+	if (*offset < 0 || *offset + size > len) {
+		error = EINVAL;
+		goto out;
+	}
+
+	obj = cdev_pager_allocate(sc, OBJT_DEVICE, &echo_pg_ops, len, nprot,
+	    0, curthread->td_ucred);
+	if (obj == NULL) {
+		error = EINVAL;
+		goto out;
+	}
+
+	*object = obj;
+out:
+	sx_sunlock(&sc->lock);
 
 	return (error);
 }
 
+/*
+ * Readiness for poll(2) and kqueue(2). In FIFO mode a unit is readable
+ * while the ring holds data and writable while it has room. In message
+ * mode it is always writable, and readable for a descriptor only while
+ * it holds a message that descriptor has not read yet: a read records
+ * the generation in the descriptor, the next change moves hdr->gen
+ * away from it. Called with wait_mtx held.
+ */
+static int
+echo_readable(echo_t *sc, struct echo_fd *fd)
+{
+	if (sc->mode == ECHO_MODE_FIFO)
+		return (echo_ring_used(&sc->ring));
+	if (atomic_load_int(&fd->seen_gen) == sc->hdr->gen)
+		return (0);
+	return (echo_msg_length(sc));
+}
+
+static int
+echo_writable(echo_t *sc)
+{
+	if (sc->mode == ECHO_MODE_FIFO)
+		return (echo_ring_free(&sc->ring));
+	return (sc->buffer_size - 1);
+}
+
+static int
+echo_poll(struct cdev *dev, int events, struct thread *td)
+{
+	echo_t *sc = dev->si_drv1;
+	struct echo_fd *fd;
+	int revents = 0;
+
+	if (devfs_get_cdevpriv((void **)&fd) != 0)
+		return (POLLNVAL);
+
+	mtx_lock(&sc->wait_mtx);
+	atomic_store_int(&sc->polled, 1);
+	atomic_thread_fence_seq_cst();
+	if (sc->dying)
+		revents |= POLLHUP;
+	if ((events & (POLLIN | POLLRDNORM)) &&
+	    (echo_readable(sc, fd) > 0 || sc->dying))
+		revents |= events & (POLLIN | POLLRDNORM);
+	if ((events & (POLLOUT | POLLWRNORM)) && echo_writable(sc) > 0 &&
+	    !sc->dying)
+		revents |= events & (POLLOUT | POLLWRNORM);
+	if (revents == 0) {
+		if (events & (POLLIN | POLLRDNORM))
+			selrecord(td, &sc->rsel);
+		if (events & (POLLOUT | POLLWRNORM))
+			selrecord(td, &sc->wsel);
+	}
+	mtx_unlock(&sc->wait_mtx);
+
+	return (revents);
+}
+
+static void
+echo_kqdetach_read(struct knote *kn)
+{
+	struct echo_fd *fd = kn->kn_hook;
+	echo_t *sc = fd->sc;
+
+	knlist_remove(&sc->rsel.si_note, kn, 0);
+}
+
+static void
+echo_kqdetach_write(struct knote *kn)
+{
+	struct echo_fd *fd = kn->kn_hook;
+	echo_t *sc = fd->sc;
+
+	knlist_remove(&sc->wsel.si_note, kn, 0);
+}
+
+static int
+echo_kqevent_read(struct knote *kn, long hint)
+{
+	struct echo_fd *fd = kn->kn_hook;
+	echo_t *sc = fd->sc;
+
+	if (sc->dying) {
+		kn->kn_flags |= EV_EOF;
+		return (1);
+	}
+	kn->kn_data = echo_readable(sc, fd);
+
+	return (kn->kn_data > 0);
+}
+
+static int
+echo_kqevent_write(struct knote *kn, long hint)
+{
+	struct echo_fd *fd = kn->kn_hook;
+	echo_t *sc = fd->sc;
+
+	if (sc->dying) {
+		kn->kn_flags |= EV_EOF;
+		return (1);
+	}
+	kn->kn_data = echo_writable(sc);
+
+	return (kn->kn_data > 0);
+}
+
+static struct filterops echo_rfiltops = {
+	.f_isfd =	1,
+	.f_detach =	echo_kqdetach_read,
+	.f_event =	echo_kqevent_read,
+};
+
+static struct filterops echo_wfiltops = {
+	.f_isfd =	1,
+	.f_detach =	echo_kqdetach_write,
+	.f_event =	echo_kqevent_write,
+};
+
+static int
+echo_kqfilter(struct cdev *dev, struct knote *kn)
+{
+	echo_t *sc = dev->si_drv1;
+	struct echo_fd *fd;
+	struct selinfo *sel;
+	int error;
+
+	/* The knote goes away at close(2), before the descriptor data. */
+	error = devfs_get_cdevpriv((void **)&fd);
+	if (error != 0)
+		return (error);
+
+	switch (kn->kn_filter) {
+	case EVFILT_READ:
+		kn->kn_fop = &echo_rfiltops;
+		sel = &sc->rsel;
+		break;
+	case EVFILT_WRITE:
+		kn->kn_fop = &echo_wfiltops;
+		sel = &sc->wsel;
+		break;
+	default:
+		return (EINVAL);
+	}
+
+	/* echo_destroy() has cleared the knlists or is about to. */
+	mtx_lock(&sc->wait_mtx);
+	if (sc->dying) {
+		mtx_unlock(&sc->wait_mtx);
+		return (ENXIO);
+	}
+	kn->kn_hook = fd;
+	atomic_store_int(&sc->polled, 1);
+	knlist_add(&sel->si_note, kn, 1);
+	mtx_unlock(&sc->wait_mtx);
+
+	return (0);
+}
+
+static void
+echo_destroy(echo_t *sc)
+{
+	sysctl_ctx_free(&sc->sysctl);
+
+	/* Kick sleeping readers and writers out of the driver. */
+	sx_xlock(&sc->lock);
+	sc->dying = 1;
+	echo_fifo_wakeup_all(sc);
+	sx_xunlock(&sc->lock);
+	/*
+	 * The knotes hook the echo_fd that destroy_dev() frees along with
+	 * the cdevpriv data, so they go first; with 'dying' set
+	 * echo_kqfilter() adds no new ones.
+	 */
+	knlist_clear(&sc->rsel.si_note, 0);
+	knlist_clear(&sc->wsel.si_note, 0);
+	if (sc->dev != NULL)	/* a failed echo_create() has none */
+		destroy_dev(sc->dev);
+	seldrain(&sc->rsel);
+	seldrain(&sc->wsel);
+	knlist_destroy(&sc->rsel.si_note);
+	knlist_destroy(&sc->wsel.si_note);
+	mtx_destroy(&sc->wait_mtx);
+	mtx_destroy(&sc->map_mtx);
+	sx_destroy(&sc->wr_lock);
+	sx_destroy(&sc->rd_lock);
+	sx_destroy(&sc->lock);
+	echo_buf_free(sc);
+	free(sc->hdr, M_ECHO);
+	free(sc, M_ECHO);
+}
+
+static int
+echo_create(int unit, echo_t **scp)
+{
+	struct make_dev_args args;
+	echo_t *sc;
+	int error;
+
+	sc = malloc(sizeof(echo_t), M_ECHO, M_WAITOK | M_ZERO);
+	mtx_init(&sc->map_mtx, "echo map", NULL, MTX_DEF);
+	sc->buffer_size = 256;
+	echo_buf_grow(sc, sc->buffer_size);
+	sc->hdr = malloc(PAGE_SIZE, M_ECHO, M_WAITOK | M_ZERO);
+	sc->hdr->buffer_size = sc->buffer_size;
+	echo_ring_init(&sc->ring, sc->buffer_size);
+	sx_init(&sc->lock, "echo buffer lock");
+	sx_init(&sc->rd_lock, "echo reader lock");
+	sx_init(&sc->wr_lock, "echo writer lock");
+	mtx_init(&sc->wait_mtx, "echo wait", NULL, MTX_DEF);
+	knlist_init_mtx(&sc->rsel.si_note, &sc->wait_mtx);
+	knlist_init_mtx(&sc->wsel.si_note, &sc->wait_mtx);
+	echo_sysctl_init(sc, unit);
+	/*
+	 * si_drv1 has to be set before the node appears, or an open(2)
+	 * racing with the load finds no softc.
+	 */
+	make_dev_args_init(&args);
+	args.mda_flags = MAKEDEV_WAITOK;
+	args.mda_devsw = &echo_cdevsw;
+	args.mda_uid = UID_ROOT;
+	args.mda_gid = GID_WHEEL;
+	args.mda_mode = 0600;
+	args.mda_unit = unit;
+	args.mda_si_drv1 = sc;
+	error = make_dev_s(&args, &sc->dev, "echo%d", unit);
+	if (error != 0) {
+		echo_destroy(sc);
+		return (error);
+	}
+
+	*scp = sc;
+	return (0);
+}
+
 static int
 echo_modevent(module_t mod __unused, int event, void *arg __unused)
 {
 	int error = 0;
+	int busy, i;
 
 	switch (event) {
 	case MOD_LOAD:
-		echo_message = malloc(sizeof(echo_t), M_ECHO, M_WAITOK);
-		echo_message->buffer_size = 256;
-		echo_message->buffer = malloc(echo_message->buffer_size,
-		    M_ECHO, M_WAITOK);
-		echo_dev = make_dev(&echo_cdevsw, 0, UID_ROOT, GID_WHEEL,
-		    0600, "echo");
+		echo_stats_init();
+		echo_nunits = MAX(1, MIN(echo_nunits, ECHO_MAX_UNITS));
+		echo_units = malloc(echo_nunits * sizeof(echo_t *), M_ECHO,
+		    M_WAITOK | M_ZERO);
+		for (i = 0; i < echo_nunits; i++) {
+			error = echo_create(i, &echo_units[i]);
+			if (error != 0)
+				break;
+		}
+		if (error != 0) {
+			while (i-- > 0)
+				echo_destroy(echo_units[i]);
+			free(echo_units, M_ECHO);
+			echo_stats_fini();
+			break;
+		}
+		make_dev_alias(echo_units[0]->dev, "echo");
 		uprintf("Echo driver loaded.\n");
 		break;
 	case MOD_UNLOAD:
-		destroy_dev(echo_dev);
-		free(echo_message->buffer, M_ECHO);
-		free(echo_message, M_ECHO);
+		/*
+		 * The pages can't go while a process maps them. Stop new
+		 * mappings, wait out echo_mmap_single() calls already past
+		 * the check, then look for live pager objects.
+		 */
+		echo_unloading = 1;
+		for (i = 0; i < echo_nunits; i++) {
+			sx_xlock(&echo_units[i]->lock);
+			sx_xunlock(&echo_units[i]->lock);
+			mtx_lock(&echo_units[i]->map_mtx);
+			busy = echo_units[i]->mapped != 0;
+			mtx_unlock(&echo_units[i]->map_mtx);
+			if (busy) {
+				echo_unloading = 0;
+				return (EBUSY);
+			}
+		}
+		for (i = 0; i < echo_nunits; i++)
+			echo_destroy(echo_units[i]);
+		free(echo_units, M_ECHO);
+		echo_stats_fini();
 		uprintf("Echo driver unloaded.\n");
 		break;
 	default:
@@ -1,4 +1,79 @@
 #pragma once
 
+#include <sys/types.h>
+
 #define ECHO_CLEAR_BUFFER       _IO('E', 1)
 #define ECHO_SET_BUFFER_SIZE    _IOW('E', 2, int)
+#define ECHO_SET_MODE           _IOW('E', 3, int)
+#define ECHO_BATCH              _IOWR('E', 4, struct echo_batch)
+
+/* ECHO_SET_MODE arguments. */
+#define ECHO_MODE_MESSAGE       0       /* writes store a message at the offset */
+#define ECHO_MODE_FIFO          1       /* ring buffer, reads consume data */
+
+/*
+ * ECHO_BATCH runs up to ECHO_BATCH_MAX commands in order under one
+ * hold of the unit lock, so no read or write sees an intermediate
+ * state. It stops at the first failing command: 'done' tells how many
+ * commands completed and 'error' holds the errno of the one that
+ * failed. The ioctl itself fails only if the batch is malformed.
+ */
+#define ECHO_CMD_CLEAR          1       /* like ECHO_CLEAR_BUFFER */
+#define ECHO_CMD_RESIZE         2       /* like ECHO_SET_BUFFER_SIZE, 'arg' */
+#define ECHO_CMD_MODE           3       /* like ECHO_SET_MODE, 'arg' */
+#define ECHO_CMD_FILL           4       /* repeat 'arg' bytes at 'ptr' */
+#define ECHO_CMD_STATS          5       /* struct echo_stats_snap to 'ptr' */
+
+#define ECHO_BATCH_MAX          64
+#define ECHO_FILL_MAX           64      /* longest fill pattern */
+#define ECHO_LAT_BUCKETS        16
+
+struct echo_cmd {
+	uint32_t	op;
+	uint32_t	arg;
+	uint64_t	ptr;		/* user pointer */
+};
+
+struct echo_batch {
+	uint64_t	cmds;		/* user pointer to struct echo_cmd[] */
+	uint32_t	count;
+	uint32_t	done;		/* out */
+	uint32_t	error;		/* out */
+	uint32_t	pad;
+};
+
+/*
+ * Driver-wide counters as in hw.echo.stats, and the state of the unit
+ * at the time of the snapshot. 'length' is the message length, or the
+ * bytes queued in FIFO mode.
+ */
+struct echo_stats_snap {
+	uint64_t	bytes_in;
+	uint64_t	bytes_out;
+	uint64_t	reads;
+	uint64_t	writes;
+	uint64_t	short_reads;
+	uint64_t	resizes;
+	uint64_t	uiomove_failures;
+	uint64_t	latency[ECHO_LAT_BUCKETS];
+	uint32_t	buffer_size;
+	uint32_t	length;
+	uint32_t	mode;
+	uint32_t	pad;
+};
+
+/*
+ * mmap(2) of /dev/echoN: the first page holds this header, the buffer
+ * follows at offset getpagesize(). In message mode 'gen' is odd while
+ * the message is being changed and 'length' is valid once it is even
+ * again, so a consumer copies the message and retries if 'gen' moved.
+ * A producer writing in place bumps 'gen' to odd, stores the data and
+ * 'length', then bumps 'gen' again. In-place producers must not be
+ * mixed with write(2) on the same unit.
+ */
+struct echo_mmap_hdr {
+	volatile uint32_t	gen;
+	uint32_t		length;		/* message length */
+	uint32_t		buffer_size;	/* bytes mapped after the header */
+	uint32_t		mode;
+};
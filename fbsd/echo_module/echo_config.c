@@ -4,98 +4,246 @@
 #include <err.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "echo.h"
 
-static enum {UNSET, CLEAR, SETSIZE} action = UNSET;
+static struct echo_cmd cmds[ECHO_BATCH_MAX];
+static struct echo_stats_snap snaps[ECHO_BATCH_MAX];
+static int ncmds;
 
 
 /*
- * The usage statement: echo_config -c | -s size
+ * The usage statement:
+ *     echo_config [-u unit] [-c] [-s size] [-m message|fifo] [-f pattern]
+ *         [-S] [-b size,count]
  */
 
 static void
 usage()
 {
-	/*
-	 * Arguments for this program are "either-or". That is,
-	 * 'echo_config -c' and 'echo_config -s size' are valid;
-	 * however, 'echo_config -c -s size' is invalid.
-	 */
-
-	fprintf(stderr, "usage: echo_config -c | -s size\n");
+	fprintf(stderr, "usage: echo_config [-u unit] [-c] [-s size] "
+	    "[-m message|fifo] [-f pattern]\n"
+	    "                   [-S] [-b size,count]\n");
 	exit(1);
 }
 
+static struct echo_cmd *
+add_cmd(uint32_t op)
+{
+	if (ncmds == ECHO_BATCH_MAX)
+		errx(1, "too many commands");
+	cmds[ncmds].op = op;
+	return (&cmds[ncmds++]);
+}
+
+static void
+print_stats(const struct echo_stats_snap *s)
+{
+	int i;
+
+	printf("buffer_size %u length %u mode %s\n", s->buffer_size,
+	    s->length, s->mode == ECHO_MODE_FIFO ? "fifo" : "message");
+	printf("bytes_in %ju bytes_out %ju reads %ju writes %ju\n",
+	    (uintmax_t)s->bytes_in, (uintmax_t)s->bytes_out,
+	    (uintmax_t)s->reads, (uintmax_t)s->writes);
+	printf("short_reads %ju resizes %ju uiomove_failures %ju\n",
+	    (uintmax_t)s->short_reads, (uintmax_t)s->resizes,
+	    (uintmax_t)s->uiomove_failures);
+	printf("latency (us):");
+	for (i = 0; i < ECHO_LAT_BUCKETS; i++)
+		printf(" %ju", (uintmax_t)s->latency[i]);
+	printf("\n");
+}
+
 /*
- * This program clears or resizes the memory buffer
- * found in /dev/echo.
+ * Write and read back 'size' bytes 'count' times and report the
+ * throughput. Each write has to fit in one go: a message must leave
+ * room for the terminating NUL, and in FIFO mode the ring (the largest
+ * power of two in the buffer) must have room next to what is queued,
+ * or the write would block forever with nobody to read.
+ */
+static void
+bench(int fd, const char *path, int size, int count)
+{
+	struct echo_stats_snap snap;
+	struct echo_batch batch;
+	struct echo_cmd cmd;
+	struct timespec t0, t1;
+	double secs;
+	char *buf;
+	ssize_t n;
+	unsigned int room;
+	int i;
+
+	cmd.op = ECHO_CMD_STATS;
+	cmd.arg = 0;
+	cmd.ptr = (uintptr_t)&snap;
+	batch.cmds = (uintptr_t)&cmd;
+	batch.count = 1;
+	if (ioctl(fd, ECHO_BATCH, &batch) < 0)
+		err(1, "ioctl(%s)", path);
+	if (batch.done != 1)
+		errc(1, batch.error, "%s", path);
+
+	if (snap.mode == ECHO_MODE_FIFO) {
+		room = snap.buffer_size;
+		while (room & (room - 1))
+			room &= room - 1;
+		room -= snap.length;
+	} else {
+		room = snap.buffer_size - 1;
+	}
+	if ((unsigned int)size > room)
+		errx(1, "%s: size %d does not fit, at most %u bytes", path,
+		    size, room);
+
+	buf = malloc(size);
+	if (buf == NULL)
+		err(1, "malloc");
+	memset(buf, 'e', size);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < count; i++) {
+		n = pwrite(fd, buf, size, 0);
+		if (n < 0)
+			err(1, "write(%s)", path);
+		if (n != size)
+			errx(1, "write(%s): short write, %zd of %d bytes", path,
+			    n, size);
+		n = pread(fd, buf, size, 0);
+		if (n < 0)
+			err(1, "read(%s)", path);
+		if (n != size)
+			errx(1, "read(%s): short read, %zd of %d bytes", path,
+			    n, size);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	printf("%d x %d bytes in %.3f s: %.0f round trips/s, %.1f MB/s\n",
+	    count, size, secs, count / secs,
+	    2.0 * size * count / secs / (1024 * 1024));
+	free(buf);
+}
+
+/*
+ * This program clears, resizes or fills the memory buffer found in
+ * /dev/echo, switches it between message and FIFO mode, and prints
+ * the driver statistics. All commands given are sent as one batch and
+ * run in command-line order. -b runs a throughput benchmark after the
+ * batch.
  */
 
 int
 main(int argc, char *argv[])
 {
-	int ch, fd, i, size;
-	char *p;
+	struct echo_batch batch;
+	struct echo_cmd *c;
+	int bsize = 0, bcount = 0;
+	int ch, fd, i, unit = -1;
+	char *p, path[PATH_MAX];
 
 	/*
-	 * Parse the command-line argument list to determine
-	 * the correct course of action.
+	 * Parse the command-line argument list to build the batch.
 	 *
 	 * -c:		clear the memory buffer
 	 * -s size	resize the memory buffer to size.
+	 * -m mode	'message' or 'fifo'.
+	 * -f pattern	fill the buffer with copies of pattern.
+	 * -S		print the statistics.
+	 * -b size,count	benchmark write/read round trips.
+	 * -u unit	operate on /dev/echo<unit> instead of /dev/echo.
 	 */
 
-	while ((ch = getopt(argc, argv, "cs:")) != -1) {
+	while ((ch = getopt(argc, argv, "b:cf:m:s:Su:")) != -1) {
 		switch (ch) {
+		case 'b':
+			bsize = (int)strtol(optarg, &p, 10);
+			if (*p != ',' || bsize <= 0)
+				errx(1, "illegal benchmark -- %s", optarg);
+			bcount = (int)strtol(p + 1, &p, 10);
+			if (*p || bcount <= 0)
+				errx(1, "illegal benchmark -- %s", optarg);
+			break;
 		case 'c':
-			if (action != UNSET)
-				usage();
-			action = CLEAR;
+			add_cmd(ECHO_CMD_CLEAR);
+			break;
+		case 'f':
+			if (strlen(optarg) == 0 ||
+			    strlen(optarg) > ECHO_FILL_MAX)
+				errx(1, "illegal pattern -- %s", optarg);
+			c = add_cmd(ECHO_CMD_FILL);
+			c->arg = strlen(optarg);
+			c->ptr = (uintptr_t)optarg;
+			break;
+		case 'm':
+			c = add_cmd(ECHO_CMD_MODE);
+			if (strcmp(optarg, "message") == 0)
+				c->arg = ECHO_MODE_MESSAGE;
+			else if (strcmp(optarg, "fifo") == 0)
+				c->arg = ECHO_MODE_FIFO;
+			else
+				errx(1, "illegal mode -- %s", optarg);
 			break;
 		case 's':
-			if (action != UNSET)
-				usage();
-			action = SETSIZE;
-			size = (int)strtol(optarg, &p, 10);
+			c = add_cmd(ECHO_CMD_RESIZE);
+			c->arg = (int)strtol(optarg, &p, 10);
 			if (*p)
 				errx(1, "illegal size -- %s", optarg);
 			break;
+		case 'S':
+			c = add_cmd(ECHO_CMD_STATS);
+			c->ptr = (uintptr_t)&snaps[ncmds - 1];
+			break;
+		case 'u':
+			unit = (int)strtol(optarg, &p, 10);
+			if (*p || unit < 0)
+				errx(1, "illegal unit -- %s", optarg);
+			break;
 		default:
 			usage();
 		}
 	}
 
-	/*
-	 * Perform the chosen action.
-	 */
-
-	if (action == CLEAR) {
-		fd = open("/dev/echo", O_RDWR);
-		if (fd < 0)
-			err(1, "open(/dev/echo)");
+	if (ncmds == 0 && bcount == 0)
+		usage();
 
-		i = ioctl(fd, ECHO_CLEAR_BUFFER, NULL);
-		if (i < 0)
-			err(1, "ioctl(/dev/echo)");
+	if (unit < 0)
+		snprintf(path, sizeof(path), "/dev/echo");
+	else
+		snprintf(path, sizeof(path), "/dev/echo%d", unit);
 
-		close(fd);
-	} else if (action == SETSIZE) {
-		fd = open("/dev/echo", O_RDWR);
-		if (fd < 0)
-			err(1, "open(/dev/echo)");
+	fd = open(path, O_RDWR);
+	if (fd < 0)
+		err(1, "open(%s)", path);
 
-		i = ioctl(fd, ECHO_SET_BUFFER_SIZE, &size);
-		if (i < 0)
-			err(1, "ioctl(/dev/echo)");
+	/*
+	 * Perform the chosen actions.
+	 */
 
-		close(fd);
-	} else {
-		usage();
+	if (ncmds > 0) {
+		batch.cmds = (uintptr_t)cmds;
+		batch.count = ncmds;
+		if (ioctl(fd, ECHO_BATCH, &batch) < 0)
+			err(1, "ioctl(%s)", path);
+		for (i = 0; i < batch.done; i++)
+			if (cmds[i].op == ECHO_CMD_STATS)
+				print_stats(&snaps[i]);
+		if (batch.done < batch.count)
+			errc(1, batch.error, "%s: command %u", path,
+			    batch.done + 1);
 	}
 
+	if (bcount > 0)
+		bench(fd, path, bsize, bcount);
+
+	close(fd);
+
 	return (0);
 }
@@ -0,0 +1,83 @@
+#ifdef _KERNEL
+#include <sys/types.h>
+#include <machine/atomic.h>
+
+#define	load_acq(p)		atomic_load_acq_int(p)
+#define	store_rel(p, v)		atomic_store_rel_int(p, v)
+#else
+#define	load_acq(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define	store_rel(p, v)		__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#endif
+
+#include "echo_ring.h"
+
+/*
+ * The ring uses the largest power of two that fits in 'size'.
+ * Not safe against concurrent producers or consumers.
+ */
+void
+echo_ring_init(struct echo_ring *r, unsigned int size)
+{
+	while (size & (size - 1))
+		size &= size - 1;
+
+	r->size = size;
+	r->head = 0;
+	r->tail = 0;
+}
+
+unsigned int
+echo_ring_used(struct echo_ring *r)
+{
+	unsigned int tail = load_acq(&r->tail);
+
+	return (load_acq(&r->head) - tail);
+}
+
+unsigned int
+echo_ring_free(struct echo_ring *r)
+{
+	return (r->size - echo_ring_used(r));
+}
+
+/*
+ * Contiguous free space starting at *off. Producer side.
+ */
+unsigned int
+echo_ring_wspan(struct echo_ring *r, unsigned int *off)
+{
+	unsigned int free = r->size - (r->head - load_acq(&r->tail));
+
+	*off = r->head & (r->size - 1);
+	return (free < r->size - *off ? free : r->size - *off);
+}
+
+/*
+ * Contiguous data starting at *off. Consumer side.
+ */
+unsigned int
+echo_ring_rspan(struct echo_ring *r, unsigned int *off)
+{
+	unsigned int used = load_acq(&r->head) - r->tail;
+
+	*off = r->tail & (r->size - 1);
+	return (used < r->size - *off ? used : r->size - *off);
+}
+
+/*
+ * Publish n bytes copied into the span returned by echo_ring_wspan().
+ */
+void
+echo_ring_produce(struct echo_ring *r, unsigned int n)
+{
+	store_rel(&r->head, r->head + n);
+}
+
+/*
+ * Release n bytes copied out of the span returned by echo_ring_rspan().
+ */
+void
+echo_ring_consume(struct echo_ring *r, unsigned int n)
+{
+	store_rel(&r->tail, r->tail + n);
+}
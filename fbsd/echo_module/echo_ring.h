@@ -0,0 +1,35 @@
+#pragma once
+
+#define ECHO_RING_ALIGN	64	/* keep the indices on separate cache lines */
+
+/*
+ * Index bookkeeping for a power-of-two ring buffer.
+ *
+ * 'head' and 'tail' run freely and are masked only when turned into
+ * offsets, so head - tail is always the fill level, even across
+ * wraparound of the unsigned counters. The ring does not own any
+ * storage: the span functions return where the caller should copy
+ * (at most two spans per transfer), and produce/consume advance the
+ * indices afterwards. No kernel headers are needed, so the same code
+ * builds in userland.
+ *
+ * One producer and one consumer may run concurrently without a lock:
+ * each side only stores its own index, with release semantics after
+ * the data has been copied, and loads the other side's index with
+ * acquire semantics before touching the data it covers.
+ */
+struct echo_ring {
+	unsigned int	size;		/* power of two */
+	volatile unsigned int	head	/* next byte to write */
+	    __attribute__((__aligned__(ECHO_RING_ALIGN)));
+	volatile unsigned int	tail	/* next byte to read */
+	    __attribute__((__aligned__(ECHO_RING_ALIGN)));
+};
+
+void		echo_ring_init(struct echo_ring *r, unsigned int size);
+unsigned int	echo_ring_used(struct echo_ring *r);
+unsigned int	echo_ring_free(struct echo_ring *r);
+unsigned int	echo_ring_wspan(struct echo_ring *r, unsigned int *off);
+unsigned int	echo_ring_rspan(struct echo_ring *r, unsigned int *off);
+void		echo_ring_produce(struct echo_ring *r, unsigned int n);
+void		echo_ring_consume(struct echo_ring *r, unsigned int n);
@@ -0,0 +1,216 @@
+/*
+ * Throughput of echo.c itself, built against the kernel shim.
+ *
+ * Each client thread writes a short message at offset 0 and reads it
+ * back, in a loop. With -u the clients share /dev/echo0 and serialize
+ * on its unit lock; otherwise each one has a unit of its own, which is
+ * what hw.echo.units is for. Reports operations (write + read) per
+ * second for 1, 2, 4, ... clients.
+ *
+ * With -s, one client moves single transfers of 4 KiB to 16 MiB
+ * through echo0 instead and reports the write and read bandwidth, and
+ * the time ECHO_SET_BUFFER_SIZE takes to grow the buffer to fit the
+ * transfer from 4 KiB. A message keeps a NUL after it, so the buffer is
+ * one byte larger than the transfer.
+ *
+ *	echo_bench [-u] [-c max_clients] [-n ops_per_client]
+ *	echo_bench -s [-t total_mb]
+ */
+#include <sys/ioccom.h>
+#include <err.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shim.h"
+#include "echo.h"
+
+SHIM_MODULE_DECLARE(echo);
+
+#define	MSG_LEN		64
+#define	XFER_MIN	(4 * 1024)
+#define	XFER_MAX	(16 * 1024 * 1024)
+
+struct client {
+	pthread_t	td;
+	int		unit;
+	long		ops;
+	int		error;
+};
+
+static void *
+client_loop(void *arg)
+{
+	struct client *c = arg;
+	struct shim_file *fp;
+	char name[16], msg[MSG_LEN], buf[MSG_LEN];
+	size_t done;
+	long i;
+
+	snprintf(name, sizeof(name), "echo%d", c->unit);
+	if ((c->error = shim_open(name, O_RDWR, &fp)) != 0)
+		return (NULL);
+	memset(msg, 'a' + c->unit % 26, sizeof(msg));
+	for (i = 0; i < c->ops; i++) {
+		shim_lseek(fp, 0);
+		if ((c->error = shim_write(fp, msg, sizeof(msg), &done)) != 0)
+			break;
+		shim_lseek(fp, 0);
+		if ((c->error = shim_read(fp, buf, sizeof(buf), &done)) != 0)
+			break;
+	}
+	shim_close(fp);
+	return (NULL);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static double
+run(int nclients, int shared, long ops)
+{
+	struct client *c;
+	double t;
+	int i;
+
+	if ((c = calloc(nclients, sizeof(*c))) == NULL)
+		err(1, "calloc");
+	t = now();
+	for (i = 0; i < nclients; i++) {
+		c[i].unit = shared ? 0 : i;
+		c[i].ops = ops;
+		if (pthread_create(&c[i].td, NULL, client_loop, &c[i]) != 0)
+			errx(1, "pthread_create");
+	}
+	for (i = 0; i < nclients; i++)
+		pthread_join(c[i].td, NULL);
+	t = now() - t;
+	for (i = 0; i < nclients; i++) {
+		if (c[i].error != 0)
+			errx(1, "client %d: %s", i, strerror(c[i].error));
+	}
+	free(c);
+	return (nclients * ops * 2 / t);
+}
+
+static void
+xfer(size_t size, size_t total)
+{
+	struct shim_file *fp;
+	unsigned char *buf;
+	double t, tgrow, tw = 0, tr = 0;
+	size_t done, i, rounds;
+	int error, v;
+
+	if ((buf = malloc(size)) == NULL)
+		err(1, "malloc");
+	for (i = 0; i < size; i++)
+		buf[i] = (unsigned char)(i * 131 + 7);
+	rounds = total / size > 0 ? total / size : 1;
+	if ((error = shim_open("echo0", O_RDWR, &fp)) != 0)
+		errx(1, "echo0: %s", strerror(error));
+
+	v = XFER_MIN;
+	if ((error = shim_ioctl(fp, ECHO_SET_BUFFER_SIZE, &v)) != 0)
+		errx(1, "ECHO_SET_BUFFER_SIZE: %s", strerror(error));
+	v = (int)size + 1;
+	t = now();
+	if ((error = shim_ioctl(fp, ECHO_SET_BUFFER_SIZE, &v)) != 0)
+		errx(1, "ECHO_SET_BUFFER_SIZE: %s", strerror(error));
+	tgrow = now() - t;
+
+	for (i = 0; i < rounds; i++) {
+		shim_lseek(fp, 0);
+		t = now();
+		error = shim_write(fp, buf, size, &done);
+		tw += now() - t;
+		if (error != 0 || done != size)
+			errx(1, "write %zu: %s", size, strerror(error));
+		shim_lseek(fp, 0);
+		t = now();
+		error = shim_read(fp, buf, size, &done);
+		tr += now() - t;
+		if (error != 0 || done != size)
+			errx(1, "read %zu: %s", size, strerror(error));
+	}
+	printf("%10zu %10.0f %10.0f %12.1f\n", size,
+	    rounds * size / tw / 1e6, rounds * size / tr / 1e6, tgrow * 1e6);
+
+	shim_close(fp);
+	free(buf);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "usage: echo_bench [-u] [-c max_clients] [-n ops_per_client]\n"
+	    "       echo_bench -s [-t total_mb]\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t size, total = 256;
+	long ops = 100000;
+	int ch, error, n, maxclients = 8, shared = 0, sizes = 0;
+
+	while ((ch = getopt(argc, argv, "c:n:st:u")) != -1) {
+		switch (ch) {
+		case 'c':
+			maxclients = strtol(optarg, NULL, 0);
+			break;
+		case 'n':
+			ops = strtol(optarg, NULL, 0);
+			break;
+		case 's':
+			sizes = 1;
+			break;
+		case 't':
+			total = strtoul(optarg, NULL, 0);
+			break;
+		case 'u':
+			shared = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (maxclients < 1 || maxclients > 64 || ops < 1 || total == 0)
+		usage();
+	total *= 1024 * 1024;
+
+	if ((error = shim_tunable_int("hw.echo.units", maxclients)) != 0 ||
+	    (error = shim_tunable_int("hw.echo.max_buffer_size",
+	    XFER_MAX + 1)) != 0 ||
+	    (error = shim_module_event(SHIM_MODULE(echo), MOD_LOAD)) != 0)
+		errx(1, "load: %s", strerror(error));
+
+	if (sizes) {
+		printf("%10s %10s %10s %12s   (%zu MB per size)\n", "size",
+		    "write MB/s", "read MB/s", "grow us", total >> 20);
+		for (size = XFER_MIN; size <= XFER_MAX; size *= 4)
+			xfer(size, total);
+	} else {
+		printf("%8s %12s   (%s, %d-byte messages)\n", "clients",
+		    "ops/s", shared ? "one shared unit" : "one unit per client",
+		    MSG_LEN);
+		for (n = 1; n <= maxclients; n *= 2)
+			printf("%8d %12.0f\n", n, run(n, shared, ops));
+	}
+
+	if ((error = shim_module_event(SHIM_MODULE(echo), MOD_UNLOAD)) != 0)
+		errx(1, "unload: %s", strerror(error));
+	return (0);
+}
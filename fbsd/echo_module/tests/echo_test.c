@@ -0,0 +1,843 @@
+/*
+ * Drives echo.c through the userland kernel shim (fbsd/shim): module
+ * load and unload, message and FIFO mode I/O, the ioctl, batch and
+ * sysctl controls, poll/kqueue readiness and the mmap pager.
+ */
+#include <sys/ioccom.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "shim.h"
+#include "echo.h"
+
+SHIM_MODULE_DECLARE(echo);
+
+#define	PAGE	4096
+
+static int failures;
+
+#define	CHECK(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		failures++;						\
+	}								\
+} while (0)
+
+#define	CHECK_ERR(expr, err) do {					\
+	int _e = (expr);						\
+	if (_e != (err)) {						\
+		fprintf(stderr, "%s:%d: %s = %d, expected %d\n",	\
+		    __FILE__, __LINE__, #expr, _e, (err));		\
+		failures++;						\
+	}								\
+} while (0)
+
+static struct shim_file *
+xopen(const char *name, int oflags)
+{
+	struct shim_file *fp;
+	int error;
+
+	error = shim_open(name, oflags, &fp);
+	if (error != 0) {
+		fprintf(stderr, "open %s: %s\n", name, strerror(error));
+		exit(1);
+	}
+	return (fp);
+}
+
+/* Read the whole message from offset 0 into buf, NUL-terminated. */
+static size_t
+read_msg(struct shim_file *fp, char *buf, size_t len)
+{
+	size_t done = 0;
+
+	shim_lseek(fp, 0);
+	CHECK_ERR(shim_read(fp, buf, len - 1, &done), 0);
+	buf[done] = '\0';
+	return (done);
+}
+
+static void
+write_str(struct shim_file *fp, off_t off, const char *s)
+{
+	size_t done;
+
+	shim_lseek(fp, off);
+	CHECK_ERR(shim_write(fp, s, strlen(s), &done), 0);
+	CHECK(done == strlen(s));
+}
+
+static int
+sysctl_int(const char *name)
+{
+	size_t len = sizeof(int);
+	int v = -1;
+
+	CHECK_ERR(shim_sysctl(name, &v, &len, NULL, 0), 0);
+	return (v);
+}
+
+/*
+ * Reloads the module, so it runs last: unlike kldload(8), the shim
+ * keeps the driver's static data from one load to the next.
+ */
+static void
+test_units(void)
+{
+	CHECK_ERR(shim_tunable_int("hw.echo.units", 1000), 0);
+	CHECK_ERR(shim_module_event(SHIM_MODULE(echo), MOD_LOAD), 0);
+	CHECK(shim_dev_exists("echo"));
+	CHECK(shim_dev_exists("echo0"));
+	CHECK(shim_dev_exists("echo63"));
+	CHECK(!shim_dev_exists("echo64"));
+	CHECK(sysctl_int("hw.echo.units") == 64);
+	CHECK_ERR(shim_module_event(SHIM_MODULE(echo), MOD_UNLOAD), 0);
+	CHECK(!shim_dev_exists("echo0"));
+
+	CHECK_ERR(shim_tunable_int("hw.echo.units", 0), 0);
+	CHECK_ERR(shim_module_event(SHIM_MODULE(echo), MOD_LOAD), 0);
+	CHECK(shim_dev_exists("echo0"));
+	CHECK(!shim_dev_exists("echo1"));
+	CHECK_ERR(shim_module_event(SHIM_MODULE(echo), MOD_UNLOAD), 0);
+	CHECK(shim_malloc_inuse("echo_buffer") == 0);
+}
+
+static void
+test_message(void)
+{
+	struct shim_file *a, *b, *app;
+	struct iovec iov[3];
+	char ab[] = "ab", none[] = "", cd[] = "cd";
+	char buf[512];
+	size_t done;
+	int i;
+
+	a = xopen("echo0", O_RDWR);
+	b = xopen("echo", O_RDWR);		/* alias of echo0 */
+	app = xopen("echo0", O_WRONLY | O_APPEND);
+
+	write_str(a, 0, "hello");
+	CHECK(read_msg(b, buf, sizeof(buf)) == 5);
+	CHECK(strcmp(buf, "hello") == 0);
+
+	/* A write at offset 0 replaces the message. */
+	write_str(a, 0, "hi");
+	CHECK(read_msg(b, buf, sizeof(buf)) == 2 && strcmp(buf, "hi") == 0);
+
+	/* Writing elsewhere extends it, a gap reads back as zeros. */
+	write_str(a, 4, "xy");
+	CHECK(read_msg(b, buf, sizeof(buf)) == 6);
+	CHECK(memcmp(buf, "hi\0\0xy", 6) == 0);
+
+	/* O_APPEND lands at the end whatever the offset. */
+	write_str(app, 0, "z");
+	CHECK(read_msg(b, buf, sizeof(buf)) == 7);
+	CHECK(memcmp(buf, "hi\0\0xyz", 7) == 0);
+
+	/* Reading from an offset, and past the end. */
+	shim_lseek(b, 4);
+	CHECK_ERR(shim_read(b, buf, sizeof(buf), &done), 0);
+	CHECK(done == 3 && memcmp(buf, "xyz", 3) == 0);
+	CHECK_ERR(shim_read(b, buf, sizeof(buf), &done), 0);
+	CHECK(done == 0);
+
+	/* Offsets that don't fit in an int are past the end, not wrapped. */
+	shim_lseek(b, 0xffffffff);
+	CHECK_ERR(shim_read(b, buf, sizeof(buf), &done), 0);
+	CHECK(done == 0);
+	shim_lseek(b, (off_t)1 << 32);
+	CHECK_ERR(shim_read(b, buf, sizeof(buf), &done), 0);
+	CHECK(done == 0);
+	shim_lseek(b, -1);
+	CHECK_ERR(shim_read(b, buf, sizeof(buf), &done), 0);
+	CHECK(done == 0);
+
+	/* All iovecs of a writev() go in one pass. */
+	iov[0].iov_base = ab;
+	iov[0].iov_len = 2;
+	iov[1].iov_base = none;
+	iov[1].iov_len = 0;
+	iov[2].iov_base = cd;
+	iov[2].iov_len = 2;
+	shim_lseek(a, 0);
+	CHECK_ERR(shim_writev(a, iov, 3, &done), 0);
+	CHECK(done == 4);
+	CHECK(read_msg(b, buf, sizeof(buf)) == 4 && strcmp(buf, "abcd") == 0);
+
+	/* And a readv() fills them in order. */
+	memset(buf, 0, sizeof(buf));
+	iov[0].iov_base = buf;
+	iov[0].iov_len = 1;
+	iov[1].iov_base = buf + 10;
+	iov[1].iov_len = 0;
+	iov[2].iov_base = buf + 20;
+	iov[2].iov_len = 100;
+	shim_lseek(b, 0);
+	CHECK_ERR(shim_readv(b, iov, 3, &done), 0);
+	CHECK(done == 4);
+	CHECK(buf[0] == 'a' && buf[10] == '\0' && strcmp(buf + 20, "bcd") == 0);
+	shim_lseek(b, 2);
+	CHECK_ERR(shim_readv(b, iov, 3, &done), 0);
+	CHECK(done == 2 && buf[0] == 'c' && buf[20] == 'd');
+
+	/* A faulting user buffer fails the copy. */
+	shim_lseek(a, 0);
+	CHECK_ERR(shim_write(a, NULL, 4, &done), EFAULT);
+
+	/* Boundaries: 256 byte buffer, at most 255 bytes of message. */
+	for (i = 0; i < (int)sizeof(buf); i++)
+		buf[i] = 'a' + i % 26;
+	shim_lseek(a, 0);
+	CHECK_ERR(shim_write(a, buf, 256, &done), 0);
+	CHECK(done == 255);
+	shim_lseek(a, 255);
+	CHECK_ERR(shim_write(a, buf, 1, &done), 0);
+	CHECK(done == 0);
+	shim_lseek(a, 254);
+	CHECK_ERR(shim_write(a, "Q", 1, &done), 0);
+	CHECK(done == 1);
+	CHECK(read_msg(b, buf, sizeof(buf)) == 255 && buf[254] == 'Q');
+
+	shim_close(app);
+	shim_close(b);
+	shim_close(a);
+}
+
+static void
+test_controls(void)
+{
+	struct shim_file *fp;
+	struct echo_stats_snap snap;
+	struct echo_cmd cmds[4];
+	struct echo_batch batch;
+	char buf[8192];
+	size_t len;
+	int v;
+
+	fp = xopen("echo1", O_RDWR);
+	write_str(fp, 0, "data");
+
+	v = 64;
+	CHECK_ERR(shim_ioctl(fp, ECHO_SET_BUFFER_SIZE, &v), EINVAL);
+	v = 4096;
+	CHECK_ERR(shim_ioctl(fp, ECHO_SET_BUFFER_SIZE, &v), 0);
+	CHECK(sysctl_int("hw.echo.1.buffer_size") == 4096);
+	CHECK(read_msg(fp, buf, sizeof(buf)) == 4);
+
+	/* hw.echo.buffer_size is unit 0. */
+	v = 1024;
+	CHECK_ERR(shim_sysctl("hw.echo.buffer_size", NULL, NULL, &v,
+	    sizeof(v)), 0);
+	CHECK(sysctl_int("hw.echo.0.buffer_size") == 1024);
+	CHECK(sysctl_int("hw.echo.1.buffer_size") == 4096);
+	v = 1 << 30;
+	CHECK_ERR(shim_sysctl("hw.echo.0.buffer_size", NULL, NULL, &v,
+	    sizeof(v)), EINVAL);
+	CHECK_ERR(shim_sysctl("hw.echo.units", NULL, NULL, &v, sizeof(v)),
+	    EPERM);
+
+	CHECK_ERR(shim_ioctl(fp, ECHO_CLEAR_BUFFER, NULL), 0);
+	CHECK(read_msg(fp, buf, sizeof(buf)) == 0);
+	CHECK_ERR(shim_ioctl(fp, _IO('E', 99), NULL), ENOTTY);
+
+	/* Resize, fill and a snapshot in one batch. */
+	memset(cmds, 0, sizeof(cmds));
+	cmds[0].op = ECHO_CMD_RESIZE;
+	cmds[0].arg = 300;
+	cmds[1].op = ECHO_CMD_FILL;
+	cmds[1].arg = 3;
+	cmds[1].ptr = (uintptr_t)"abc";
+	cmds[2].op = ECHO_CMD_STATS;
+	cmds[2].ptr = (uintptr_t)&snap;
+	memset(&batch, 0, sizeof(batch));
+	batch.cmds = (uintptr_t)cmds;
+	batch.count = 3;
+	CHECK_ERR(shim_ioctl(fp, ECHO_BATCH, &batch), 0);
+	CHECK(batch.done == 3 && batch.error == 0);
+	CHECK(snap.buffer_size == 300 && snap.length == 299);
+	CHECK(snap.mode == ECHO_MODE_MESSAGE && snap.resizes >= 2);
+	CHECK(read_msg(fp, buf, sizeof(buf)) == 299);
+	CHECK(memcmp(buf, "abcabc", 6) == 0 && buf[298] == "abc"[298 % 3]);
+
+	/* The batch stops at the first failing command. */
+	cmds[0].op = ECHO_CMD_CLEAR;
+	cmds[1].op = ECHO_CMD_MODE;
+	cmds[1].arg = 7;
+	cmds[2].op = ECHO_CMD_CLEAR;
+	batch.count = 3;
+	CHECK_ERR(shim_ioctl(fp, ECHO_BATCH, &batch), 0);
+	CHECK(batch.done == 1 && batch.error == EINVAL);
+
+	/* Malformed batches fail as a whole. */
+	batch.count = 0;
+	CHECK_ERR(shim_ioctl(fp, ECHO_BATCH, &batch), EINVAL);
+	batch.count = ECHO_BATCH_MAX + 1;
+	CHECK_ERR(shim_ioctl(fp, ECHO_BATCH, &batch), EINVAL);
+	cmds[0].op = ECHO_CMD_FILL;
+	cmds[0].arg = 3;
+	cmds[0].ptr = 0;
+	batch.count = 1;
+	CHECK_ERR(shim_ioctl(fp, ECHO_BATCH, &batch), EFAULT);
+	batch.cmds = 0;
+	CHECK_ERR(shim_ioctl(fp, ECHO_BATCH, &batch), EFAULT);
+
+	/* hw.echo.stats */
+	len = sizeof(snap.bytes_in);
+	CHECK_ERR(shim_sysctl("hw.echo.stats.bytes_in", &snap.bytes_in, &len,
+	    NULL, 0), 0);
+	CHECK(len == sizeof(uint64_t) && snap.bytes_in > 0);
+	len = sizeof(snap.latency);
+	CHECK_ERR(shim_sysctl("hw.echo.stats.latency", snap.latency, &len,
+	    NULL, 0), 0);
+	CHECK(len == sizeof(snap.latency) && snap.latency[0] +
+	    snap.latency[1] > 0);
+
+	v = 256;
+	CHECK_ERR(shim_ioctl(fp, ECHO_SET_BUFFER_SIZE, &v), 0);
+	shim_close(fp);
+}
+
+static void
+test_fifo(void)
+{
+	struct shim_file *fp, *nb;
+	char in[1024], out[1024];
+	size_t done;
+	int i, v;
+
+	fp = xopen("echo2", O_RDWR);
+	nb = xopen("echo2", O_RDWR | O_NONBLOCK);
+	v = ECHO_MODE_FIFO;
+	CHECK_ERR(shim_ioctl(fp, ECHO_SET_MODE, &v), 0);
+	CHECK(sysctl_int("hw.echo.2.mode") == ECHO_MODE_FIFO);
+
+	CHECK_ERR(shim_read(nb, out, sizeof(out), &done), EWOULDBLOCK);
+	for (i = 0; i < (int)sizeof(in); i++)
+		in[i] = i * 7;
+
+	CHECK_ERR(shim_write(fp, in, 100, &done), 0);
+	CHECK(done == 100);
+	CHECK_ERR(shim_read(fp, out, sizeof(out), &done), 0);
+	CHECK(done == 100 && memcmp(in, out, 100) == 0);
+
+	/* 256 byte ring: a partial non-blocking write succeeds. */
+	CHECK_ERR(shim_write(nb, in, 300, &done), 0);
+	CHECK(done == 256);
+	CHECK_ERR(shim_write(nb, in, 1, &done), EWOULDBLOCK);
+	v = 4096;
+	CHECK_ERR(shim_ioctl(fp, ECHO_SET_BUFFER_SIZE, &v), EBUSY);
+	CHECK_ERR(shim_read(nb, out, 10, &done), 0);
+	CHECK(done == 10 && memcmp(in, out, 10) == 0);
+	CHECK_ERR(shim_write(nb, in + 256, 10, &done), 0);
+	CHECK(done == 10);
+	/* The data now wraps around the end of the ring. */
+	CHECK_ERR(shim_read(nb, out, sizeof(out), &done), 0);
+	CHECK(done == 256 && memcmp(in + 10, out, 256) == 0);
+
+	/* Back to message mode. */
+	v = ECHO_MODE_MESSAGE;
+	CHECK_ERR(shim_ioctl(fp, ECHO_SET_MODE, &v), 0);
+	shim_close(nb);
+	shim_close(fp);
+}
+
+struct stream {
+	const char	*name;
+	size_t		total;
+	size_t		chunk;
+	int		bad;
+};
+
+static void *
+fifo_writer(void *arg)
+{
+	struct stream *s = arg;
+	struct shim_file *fp = xopen(s->name, O_WRONLY);
+	unsigned char buf[997];
+	size_t pos = 0, n, done, i;
+
+	while (pos < s->total) {
+		n = s->total - pos < s->chunk ? s->total - pos : s->chunk;
+		if (n > sizeof(buf))
+			n = sizeof(buf);
+		for (i = 0; i < n; i++)
+			buf[i] = (pos + i) % 251;
+		if (shim_write(fp, buf, n, &done) != 0 || done != n)
+			s->bad = 1;
+		pos += done;
+		if (s->bad)
+			break;
+	}
+	shim_close(fp);
+	return (NULL);
+}
+
+/* A blocking writer and reader on one unit, every byte checked. */
+static void
+test_fifo_threads(void)
+{
+	struct stream s = { "echo3", 1 << 20, 300, 0 };
+	struct shim_file *fp;
+	unsigned char buf[4096];
+	size_t pos = 0, done, i;
+	pthread_t td;
+	int v;
+
+	fp = xopen("echo3", O_RDWR);
+	v = ECHO_MODE_FIFO;
+	CHECK_ERR(shim_ioctl(fp, ECHO_SET_MODE, &v), 0);
+	pthread_create(&td, NULL, fifo_writer, &s);
+	while (pos < s.total) {
+		if (shim_read(fp, buf, sizeof(buf), &done) != 0 || done == 0) {
+			CHECK(!"fifo read failed");
+			break;
+		}
+		for (i = 0; i < done; i++)
+			if (buf[i] != (pos + i) % 251)
+				s.bad = 1;
+		pos += done;
+	}
+	pthread_join(td, NULL);
+	CHECK(!s.bad);
+	CHECK(pos == s.total);
+	v = ECHO_MODE_MESSAGE;
+	CHECK_ERR(shim_ioctl(fp, ECHO_SET_MODE, &v), 0);
+	shim_close(fp);
+}
+
+struct blocked {
+	struct shim_file *fp;
+	int		error;
+	size_t		done;
+	char		c;
+};
+
+static void *
+fifo_blocked_reader(void *arg)
+{
+	struct blocked *b = arg;
+
+	b->error = shim_read(b->fp, &b->c, 1, &b->done);
+	return (NULL);
+}
+
+/*
+ * A reader asleep on the empty ring holds rd_lock. A non-blocking
+ * reader gets EWOULDBLOCK instead of queueing up behind it.
+ */
+static void
+test_fifo_queued(void)
+{
+	struct shim_file *fp, *nb;
+	struct blocked b;
+	pthread_t td;
+	size_t done;
+	char c;
+	int v;
+
+	fp = xopen("echo3", O_RDWR);
+	nb = xopen("echo3", O_RDWR | O_NONBLOCK);
+	v = ECHO_MODE_FIFO;
+	CHECK_ERR(shim_ioctl(fp, ECHO_SET_MODE, &v), 0);
+
+	b.fp = fp;
+	b.error = -1;
+	pthread_create(&td, NULL, fifo_blocked_reader, &b);
+	usleep(100000);
+	alarm(5);		/* a reader stuck on rd_lock never returns */
+	CHECK_ERR(shim_read(nb, &c, 1, &done), EWOULDBLOCK);
+	alarm(0);
+
+	CHECK_ERR(shim_write(nb, "x", 1, &done), 0);
+	pthread_join(td, NULL);
+	CHECK(b.error == 0 && b.done == 1 && b.c == 'x');
+
+	v = ECHO_MODE_MESSAGE;
+	CHECK_ERR(shim_ioctl(fp, ECHO_SET_MODE, &v), 0);
+	shim_close(nb);
+	shim_close(fp);
+}
+
+static void *
+mode_flipper(void *arg)
+{
+	struct shim_file *fp = xopen("echo1", O_RDWR);
+	int *bad = arg;
+	int i, v;
+
+	for (i = 0; i < 2000; i++) {
+		v = i % 2 == 0 ? ECHO_MODE_FIFO : ECHO_MODE_MESSAGE;
+		if (shim_ioctl(fp, ECHO_SET_MODE, &v) != 0)
+			(*bad)++;
+	}
+	shim_close(fp);
+	return (NULL);
+}
+
+/*
+ * Reads and writes racing with mode changes each run entirely in one
+ * mode or the other.
+ */
+static void
+test_mode_flips(void)
+{
+	struct shim_file *fp;
+	pthread_t td;
+	char buf[64];
+	size_t done;
+	int bad = 0, error, i, v;
+
+	fp = xopen("echo1", O_RDWR | O_NONBLOCK);
+	pthread_create(&td, NULL, mode_flipper, &bad);
+	for (i = 0; i < 2000; i++) {
+		shim_lseek(fp, 0);
+		error = shim_write(fp, "flip", 4, &done);
+		if (error != 0 && error != EWOULDBLOCK && error != EIO)
+			bad++;
+		shim_lseek(fp, 0);
+		error = shim_read(fp, buf, sizeof(buf), &done);
+		if (error != 0 && error != EWOULDBLOCK)
+			bad++;
+	}
+	pthread_join(td, NULL);
+	CHECK(bad == 0);
+
+	v = ECHO_MODE_MESSAGE;
+	CHECK_ERR(shim_ioctl(fp, ECHO_SET_MODE, &v), 0);
+	write_str(fp, 0, "ok");
+	CHECK(read_msg(fp, buf, sizeof(buf)) == 2 && strcmp(buf, "ok") == 0);
+	shim_close(fp);
+}
+
+/*
+ * A reader sleeping on an empty ring is woken up with ENXIO when the
+ * module unloads.
+ */
+static void *
+fifo_sleeper(void *arg)
+{
+	struct shim_file *fp = arg;
+	char c;
+	size_t done;
+
+	return ((void *)(intptr_t)shim_read(fp, &c, 1, &done));
+}
+
+static void
+test_readiness(void)
+{
+	struct shim_file *a, *b, *w;
+	struct knote *ka, *kb, *kw;
+	char buf[64];
+	int64_t data;
+	int v;
+
+	a = xopen("echo1", O_RDONLY);
+	b = xopen("echo1", O_RDONLY);
+	w = xopen("echo1", O_WRONLY);
+	CHECK_ERR(shim_kqueue_attach(a, EVFILT_READ, &ka), 0);
+	CHECK_ERR(shim_kqueue_attach(b, EVFILT_READ, &kb), 0);
+	CHECK_ERR(shim_kqueue_attach(w, EVFILT_WRITE, &kw), 0);
+	CHECK_ERR(shim_kqueue_attach(w, 42, &kw), EINVAL);
+
+	/* Message mode: always writable, readable once per message. */
+	CHECK(shim_poll(w, POLLOUT) == POLLOUT);
+	CHECK(shim_kqueue_ready(kw, &data) && data == 255);
+	write_str(w, 0, "msg");
+	CHECK(shim_kqueue_fired(ka) && shim_kqueue_fired(kb));
+	CHECK(shim_poll(a, POLLIN) == POLLIN);
+	CHECK(shim_poll(b, POLLIN | POLLRDNORM) == (POLLIN | POLLRDNORM));
+	read_msg(a, buf, sizeof(buf));
+	CHECK(shim_poll(a, POLLIN) == 0);
+	CHECK(!shim_kqueue_ready(ka, NULL));
+	CHECK(shim_poll(b, POLLIN) == POLLIN);
+	CHECK(shim_kqueue_ready(kb, &data) && data == 3);
+	read_msg(b, buf, sizeof(buf));
+	CHECK(shim_poll(b, POLLIN) == 0);
+	write_str(w, 0, "next");
+	CHECK(shim_poll(a, POLLIN) == POLLIN && shim_poll(b, POLLIN) == POLLIN);
+
+	/* FIFO mode: readable while there is data. */
+	v = ECHO_MODE_FIFO;
+	CHECK_ERR(shim_ioctl(w, ECHO_SET_MODE, &v), 0);
+	CHECK(shim_poll(a, POLLIN) == 0);
+	shim_kqueue_fired(ka);
+	write_str(w, 0, "fifo");
+	CHECK(shim_kqueue_fired(ka));
+	CHECK(shim_poll(a, POLLIN) == POLLIN);
+	CHECK(shim_kqueue_ready(ka, &data) && data == 4);
+	read_msg(b, buf, sizeof(buf));
+	CHECK(shim_poll(a, POLLIN) == 0);
+	v = ECHO_MODE_MESSAGE;
+	CHECK_ERR(shim_ioctl(w, ECHO_SET_MODE, &v), 0);
+
+	shim_kqueue_detach(kb);
+	shim_close(a);		/* detaches ka */
+	shim_close(b);
+	shim_close(w);
+}
+
+static void
+test_mmap(void)
+{
+	struct shim_file *fp;
+	struct vm_object *obj, *obj2;
+	struct echo_mmap_hdr *hdr;
+	char *page;
+	int v;
+
+	fp = xopen("echo0", O_RDWR);
+	v = 2 * PAGE + 1;
+	CHECK_ERR(shim_ioctl(fp, ECHO_SET_BUFFER_SIZE, &v), 0);
+	write_str(fp, 0, "mapped");
+	write_str(fp, PAGE, "second page");
+
+	CHECK_ERR(shim_mmap(fp, 0, 5 * PAGE, PROT_READ, &obj), EINVAL);
+	CHECK_ERR(shim_mmap(fp, 0, 4 * PAGE, PROT_READ, &obj), 0);
+	CHECK_ERR(shim_mmap(fp, 0, PAGE, PROT_READ, &obj2), 0);
+	CHECK(obj == obj2);
+
+	hdr = shim_mmap_fault(obj, 0);
+	CHECK(hdr != NULL && (hdr->gen & 1) == 0);
+	CHECK(hdr->buffer_size == 2 * PAGE + 1);
+	CHECK(hdr->length == PAGE + strlen("second page"));
+	page = shim_mmap_fault(obj, PAGE);
+	CHECK(page != NULL && strcmp(page, "mapped") == 0);
+	page = shim_mmap_fault(obj, 2 * PAGE + 100);
+	CHECK(page != NULL && strcmp(page, "second page") == 0);
+	/* Faulting again updates the fictitious page in place. */
+	CHECK(shim_mmap_fault(obj, 2 * PAGE) == page);
+	CHECK(shim_mmap_fault(obj, 5 * PAGE) == NULL);
+
+	/* Unload is refused until the last mapping goes. */
+	CHECK_ERR(shim_module_event(SHIM_MODULE(echo), MOD_UNLOAD), EBUSY);
+	shim_munmap(obj2);
+	CHECK_ERR(shim_module_event(SHIM_MODULE(echo), MOD_UNLOAD), EBUSY);
+	shim_munmap(obj);
+
+	v = 256;
+	CHECK_ERR(shim_ioctl(fp, ECHO_SET_BUFFER_SIZE, &v), 0);
+	shim_close(fp);
+}
+
+/*
+ * The consumer side of the echo_mmap_hdr protocol: copy the message
+ * and check 'gen' was even and unchanged around the copy. Returns the
+ * length, or -1 if the copy has to be retried. 'yield' lets a producer
+ * run in the middle, which on one CPU would not happen otherwise.
+ */
+static int
+mmap_try_copy(struct echo_mmap_hdr *hdr, const char *data, char *buf,
+    size_t len, int yield)
+{
+	uint32_t gen, n;
+
+	gen = __atomic_load_n(&hdr->gen, __ATOMIC_ACQUIRE);
+	if (gen & 1)
+		return (-1);
+	if (yield)
+		sched_yield();
+	n = hdr->length;
+	if (n >= len)
+		n = len - 1;
+	memcpy(buf, data, n);
+	buf[n] = '\0';
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&hdr->gen, __ATOMIC_RELAXED) != gen)
+		return (-1);
+	return ((int)n);
+}
+
+/* An in-place producer, as echo.h describes it, yielding half-way. */
+static void
+mmap_produce(struct echo_mmap_hdr *hdr, char *data, char c, uint32_t n)
+{
+
+	__atomic_store_n(&hdr->gen, hdr->gen + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memset(data, c, n / 2);
+	sched_yield();
+	memset(data + n / 2, c, n - n / 2);
+	hdr->length = n;
+	__atomic_store_n(&hdr->gen, hdr->gen + 1, __ATOMIC_RELEASE);
+}
+
+#define	GEN_ROUNDS	20000
+
+struct gen_race {
+	struct echo_mmap_hdr *hdr;
+	char		*data;
+	int		done;
+	long		copies;
+	long		retries;
+	int		torn;
+};
+
+/* 'A' messages are 100 bytes long and 'B' ones 3000. */
+static void *
+gen_producer(void *arg)
+{
+	struct gen_race *r = arg;
+	int i;
+
+	for (i = 0; i < GEN_ROUNDS; i++) {
+		mmap_produce(r->hdr, r->data, i & 1 ? 'B' : 'A',
+		    i & 1 ? 3000 : 100);
+		sched_yield();
+	}
+	__atomic_store_n(&r->done, 1, __ATOMIC_RELEASE);
+	return (NULL);
+}
+
+static void *
+gen_consumer(void *arg)
+{
+	struct gen_race *r = arg;
+	char buf[PAGE];
+	int i, n;
+
+	while (!__atomic_load_n(&r->done, __ATOMIC_ACQUIRE)) {
+		if ((n = mmap_try_copy(r->hdr, r->data, buf, sizeof(buf),
+		    (r->copies + r->retries) & 1)) < 0) {
+			r->retries++;
+			sched_yield();
+			continue;
+		}
+		r->copies++;
+		if (n != (buf[0] == 'A' ? 100 : 3000))
+			r->torn = 1;
+		for (i = 1; i < n; i++) {
+			if (buf[i] != buf[0])
+				r->torn = 1;
+		}
+	}
+	return (NULL);
+}
+
+static void
+test_mmap_gen(void)
+{
+	struct shim_file *fp;
+	struct vm_object *obj;
+	struct echo_mmap_hdr *hdr;
+	struct gen_race r;
+	pthread_t prod, cons;
+	char *data, buf[PAGE];
+	uint32_t gen;
+	int v;
+
+	fp = xopen("echo1", O_RDWR);
+	v = PAGE;
+	CHECK_ERR(shim_ioctl(fp, ECHO_SET_BUFFER_SIZE, &v), 0);
+	write_str(fp, 0, "kernel");
+	CHECK_ERR(shim_mmap(fp, 0, 2 * PAGE, PROT_READ | PROT_WRITE, &obj),
+	    0);
+	hdr = shim_mmap_fault(obj, 0);
+	data = shim_mmap_fault(obj, PAGE);
+	CHECK(hdr != NULL && data != NULL);
+	gen = hdr->gen;
+	CHECK((gen & 1) == 0);
+	CHECK(mmap_try_copy(hdr, data, buf, sizeof(buf), 0) == 6);
+	CHECK(strcmp(buf, "kernel") == 0);
+
+	/* write(2) moves 'gen' by one odd/even pair. */
+	write_str(fp, 0, "again");
+	CHECK(hdr->gen == gen + 2);
+
+	/* A consumer retries while the producer is mid-update... */
+	__atomic_store_n(&hdr->gen, hdr->gen + 1, __ATOMIC_RELAXED);
+	CHECK(mmap_try_copy(hdr, data, buf, sizeof(buf), 0) == -1);
+	memcpy(data, "in place", 8);
+	hdr->length = 8;
+	__atomic_store_n(&hdr->gen, hdr->gen + 1, __ATOMIC_RELEASE);
+	CHECK(mmap_try_copy(hdr, data, buf, sizeof(buf), 0) == 8);
+	CHECK(strcmp(buf, "in place") == 0);
+	/* ...and read(2) sees the message the producer published. */
+	CHECK(read_msg(fp, buf, sizeof(buf)) == 8);
+	CHECK(strcmp(buf, "in place") == 0);
+
+	/* Racing, a copy is either retried or a whole message. */
+	memset(&r, 0, sizeof(r));
+	r.hdr = hdr;
+	r.data = data;
+	mmap_produce(hdr, data, 'A', 100);
+	pthread_create(&cons, NULL, gen_consumer, &r);
+	pthread_create(&prod, NULL, gen_producer, &r);
+	pthread_join(prod, NULL);
+	pthread_join(cons, NULL);
+	CHECK(r.copies > 0 && r.retries > 0);
+	CHECK(!r.torn);
+	CHECK((hdr->gen & 1) == 0);
+
+	shim_munmap(obj);
+	CHECK_ERR(shim_ioctl(fp, ECHO_CLEAR_BUFFER, NULL), 0);
+	v = 256;
+	CHECK_ERR(shim_ioctl(fp, ECHO_SET_BUFFER_SIZE, &v), 0);
+	shim_close(fp);
+}
+
+static void
+test_unload(void)
+{
+	struct shim_file *fp, *open;
+	struct knote *kn;
+	pthread_t td;
+	void *ret;
+	size_t done;
+	int v;
+
+	fp = xopen("echo3", O_RDWR);
+	v = ECHO_MODE_FIFO;
+	CHECK_ERR(shim_ioctl(fp, ECHO_SET_MODE, &v), 0);
+	pthread_create(&td, NULL, fifo_sleeper, fp);
+
+	/* Descriptors still open across unload, one with a knote. */
+	open = xopen("echo0", O_RDWR);
+	CHECK_ERR(shim_kqueue_attach(open, EVFILT_READ, &kn), 0);
+
+	CHECK_ERR(shim_module_event(SHIM_MODULE(echo), MOD_UNLOAD), 0);
+	pthread_join(td, &ret);
+	CHECK((intptr_t)ret == ENXIO);
+	CHECK(shim_kqueue_ready(kn, NULL));
+	CHECK_ERR(shim_write(open, "x", 1, &done), ENXIO);
+	CHECK(shim_malloc_inuse("echo_buffer") == 0);
+	/* The counter oids go with the counters. */
+	CHECK_ERR(shim_sysctl("hw.echo.stats.reads", NULL, NULL, NULL, 0),
+	    ENOENT);
+	shim_close(open);
+	shim_close(fp);
+}
+
+int
+main(void)
+{
+	CHECK_ERR(shim_module_event(SHIM_MODULE(echo), MOD_LOAD), 0);
+	test_message();
+	test_controls();
+	test_fifo();
+	test_fifo_threads();
+	test_fifo_queued();
+	test_mode_flips();
+	test_readiness();
+	test_mmap();
+	test_mmap_gen();
+	test_unload();
+	test_units();
+
+	if (failures != 0) {
+		fprintf(stderr, "echo_test: %d failure(s)\n", failures);
+		return (1);
+	}
+	printf("echo_test: ok\n");
+	return (0);
+}
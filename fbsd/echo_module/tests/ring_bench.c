@@ -0,0 +1,176 @@
+/*
+ * SPSC throughput of the echo ring: one producer and one consumer
+ * thread move a byte stream through a shared ring using only the
+ * acquire/release indices, as echo_write_ring()/echo_read_ring() do
+ * in the driver. The consumer checks every byte it receives, so the
+ * benchmark doubles as a concurrency test of the ring.
+ *
+ *	ring_bench [-r ring_size] [-t total_mb] [size ...]
+ */
+#include <err.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "echo_ring.h"
+
+#define	PATTERN_LEN	4093	/* prime, so chunks do not line up with it */
+#define	MAX_MSG		(1024 * 1024)
+
+struct bench {
+	struct echo_ring ring;
+	unsigned char	*buf;
+	size_t		total;
+	unsigned int	msg;
+	int		bad;
+};
+
+static unsigned char pattern[PATTERN_LEN + MAX_MSG];
+
+/*
+ * Copy n bytes of the stream starting at stream position pos into or
+ * out of the ring, one or two spans at a time, spinning while the
+ * other side catches up.
+ */
+static void *
+producer(void *arg)
+{
+	struct bench *b = arg;
+	unsigned int off, n, want;
+	size_t pos = 0;
+
+	while (pos < b->total) {
+		want = b->total - pos < b->msg ? b->total - pos : b->msg;
+		while (want > 0) {
+			while ((n = echo_ring_wspan(&b->ring, &off)) == 0)
+				sched_yield();
+			if (n > want)
+				n = want;
+			memcpy(b->buf + off, pattern + pos % PATTERN_LEN, n);
+			echo_ring_produce(&b->ring, n);
+			pos += n;
+			want -= n;
+		}
+	}
+	return (NULL);
+}
+
+static void *
+consumer(void *arg)
+{
+	struct bench *b = arg;
+	unsigned int off, n, want;
+	size_t pos = 0;
+
+	while (pos < b->total) {
+		want = b->total - pos < b->msg ? b->total - pos : b->msg;
+		while (want > 0) {
+			while ((n = echo_ring_rspan(&b->ring, &off)) == 0)
+				sched_yield();
+			if (n > want)
+				n = want;
+			if (memcmp(b->buf + off, pattern + pos % PATTERN_LEN,
+			    n) != 0)
+				b->bad = 1;
+			echo_ring_consume(&b->ring, n);
+			pos += n;
+			want -= n;
+		}
+	}
+	return (NULL);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static int
+run(unsigned int ring_size, size_t total, unsigned int msg)
+{
+	struct bench b;
+	pthread_t prod, cons;
+	double t;
+
+	memset(&b, 0, sizeof(b));
+	echo_ring_init(&b.ring, ring_size);
+	if ((b.buf = malloc(b.ring.size)) == NULL)
+		err(1, "malloc");
+	b.total = total;
+	b.msg = msg;
+
+	t = now();
+	if (pthread_create(&cons, NULL, consumer, &b) != 0 ||
+	    pthread_create(&prod, NULL, producer, &b) != 0)
+		errx(1, "pthread_create");
+	pthread_join(prod, NULL);
+	pthread_join(cons, NULL);
+	t = now() - t;
+
+	printf("%10u %10.3f%s\n", msg, total / t / 1e9,
+	    b.bad ? "  DATA MISMATCH" : "");
+	free(b.buf);
+	return (b.bad);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "usage: ring_bench [-r ring_size] [-t total_mb] [size ...]\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const unsigned int sizes[] = {
+		16, 64, 256, 1024, 4096, 16384, 65536
+	};
+	unsigned int ring_size = 1024 * 1024, msg;
+	size_t total = 256;
+	int ch, i, bad = 0;
+
+	while ((ch = getopt(argc, argv, "r:t:")) != -1) {
+		switch (ch) {
+		case 'r':
+			ring_size = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			total = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (ring_size == 0 || total == 0)
+		usage();
+	total *= 1024 * 1024;
+
+	for (i = 0; i < (int)sizeof(pattern); i++)
+		pattern[i] = (unsigned char)(i % PATTERN_LEN * 131 + 7);
+
+	printf("%10s %10s   (ring %u bytes, %zu MB per size)\n",
+	    "msg_size", "GB/s", ring_size, total >> 20);
+	if (argc == 0) {
+		for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++)
+			bad |= run(ring_size, total, sizes[i]);
+	}
+	for (i = 0; i < argc; i++) {
+		msg = strtoul(argv[i], NULL, 0);
+		if (msg == 0 || msg > MAX_MSG)
+			usage();
+		bad |= run(ring_size, total, msg);
+	}
+	return (bad);
+}
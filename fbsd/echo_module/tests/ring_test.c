@@ -0,0 +1,180 @@
+/*
+ * Userland checks for the echo ring index arithmetic: power-of-two
+ * rounding, fill level, and the two-span split across wraparound,
+ * including wraparound of the free-running unsigned indices.
+ */
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "echo_ring.h"
+
+static int failures;
+
+#define	CHECK(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		failures++;						\
+	}								\
+} while (0)
+
+static void
+test_init(void)
+{
+	struct echo_ring r;
+
+	echo_ring_init(&r, 4096);
+	CHECK(r.size == 4096);
+	echo_ring_init(&r, 4095);
+	CHECK(r.size == 2048);
+	echo_ring_init(&r, 6000);
+	CHECK(r.size == 4096);
+	echo_ring_init(&r, 1);
+	CHECK(r.size == 1);
+	CHECK(echo_ring_used(&r) == 0);
+	CHECK(echo_ring_free(&r) == 1);
+}
+
+static void
+test_fill_level(void)
+{
+	struct echo_ring r;
+	unsigned int off, n;
+
+	echo_ring_init(&r, 16);
+	CHECK(echo_ring_used(&r) == 0);
+	CHECK(echo_ring_free(&r) == 16);
+
+	n = echo_ring_wspan(&r, &off);
+	CHECK(off == 0 && n == 16);
+	echo_ring_produce(&r, 10);
+	CHECK(echo_ring_used(&r) == 10);
+	CHECK(echo_ring_free(&r) == 6);
+
+	n = echo_ring_rspan(&r, &off);
+	CHECK(off == 0 && n == 10);
+	echo_ring_consume(&r, 4);
+	CHECK(echo_ring_used(&r) == 6);
+
+	/* Full ring: no write span, the whole ring readable. */
+	echo_ring_produce(&r, 4);
+	echo_ring_produce(&r, 6);
+	CHECK(echo_ring_free(&r) == 0);
+	n = echo_ring_wspan(&r, &off);
+	CHECK(n == 0);
+
+	/* Empty ring: no read span. */
+	echo_ring_consume(&r, 16);
+	CHECK(echo_ring_used(&r) == 0);
+	n = echo_ring_rspan(&r, &off);
+	CHECK(n == 0);
+}
+
+static void
+test_wrap_spans(void)
+{
+	struct echo_ring r;
+	unsigned int off, n;
+
+	echo_ring_init(&r, 16);
+	echo_ring_produce(&r, 12);
+	echo_ring_consume(&r, 12);
+
+	/* 4 bytes up to the end of the storage, then 8 from the start. */
+	n = echo_ring_wspan(&r, &off);
+	CHECK(off == 12 && n == 4);
+	echo_ring_produce(&r, n);
+	n = echo_ring_wspan(&r, &off);
+	CHECK(off == 0 && n == 12);
+	echo_ring_produce(&r, 8);
+	CHECK(echo_ring_used(&r) == 12);
+
+	n = echo_ring_rspan(&r, &off);
+	CHECK(off == 12 && n == 4);
+	echo_ring_consume(&r, n);
+	n = echo_ring_rspan(&r, &off);
+	CHECK(off == 0 && n == 8);
+	echo_ring_consume(&r, n);
+	CHECK(echo_ring_used(&r) == 0);
+}
+
+static void
+test_index_overflow(void)
+{
+	struct echo_ring r;
+	unsigned int off, n;
+
+	/* Start just below UINT_MAX so head wraps while tail does not. */
+	echo_ring_init(&r, 16);
+	r.head = r.tail = UINT_MAX - 5;
+
+	echo_ring_produce(&r, 10);
+	CHECK(r.head < r.tail);
+	CHECK(echo_ring_used(&r) == 10);
+	CHECK(echo_ring_free(&r) == 6);
+
+	n = echo_ring_rspan(&r, &off);
+	CHECK(off == ((UINT_MAX - 5) & 15) && n == 16 - off);
+	echo_ring_consume(&r, n);
+	n = echo_ring_rspan(&r, &off);
+	CHECK(off == 0 && n == 10 - (16 - ((UINT_MAX - 5) & 15)));
+	echo_ring_consume(&r, n);
+	CHECK(echo_ring_used(&r) == 0);
+	CHECK(echo_ring_free(&r) == 16);
+}
+
+/*
+ * Push a known byte sequence through the ring in odd-sized chunks
+ * so that every offset is crossed many times, and compare.
+ */
+static void
+test_stream(void)
+{
+	struct echo_ring r;
+	unsigned char buf[64];
+	unsigned int off, n, i, chunk;
+	unsigned int in = 0, out = 0, total = 100000;
+
+	echo_ring_init(&r, sizeof(buf));
+	r.head = r.tail = UINT_MAX - 1000;
+	for (chunk = 1; out < total; chunk = chunk % 37 + 1) {
+		while (in < total && (n = echo_ring_wspan(&r, &off)) > 0) {
+			if (n > chunk)
+				n = chunk;
+			for (i = 0; i < n; i++)
+				buf[off + i] = (unsigned char)(in + i);
+			echo_ring_produce(&r, n);
+			in += n;
+		}
+		n = echo_ring_rspan(&r, &off);
+		if (n > chunk + 3)
+			n = chunk + 3;
+		for (i = 0; i < n; i++) {
+			if (buf[off + i] != (unsigned char)(out + i)) {
+				CHECK(buf[off + i] == (unsigned char)(out + i));
+				return;
+			}
+		}
+		echo_ring_consume(&r, n);
+		out += n;
+		CHECK(echo_ring_used(&r) == in - out);
+	}
+}
+
+int
+main(void)
+{
+	test_init();
+	test_fill_level();
+	test_wrap_spans();
+	test_index_overflow();
+	test_stream();
+
+	if (failures != 0) {
+		fprintf(stderr, "ring_test: %d failure(s)\n", failures);
+		return (1);
+	}
+	printf("ring_test: ok\n");
+	return (0);
+}
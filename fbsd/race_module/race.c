@@ -7,22 +7,31 @@
 #include <sys/uio.h>
 #include <sys/malloc.h>
 #include <sys/ioccom.h>
-#include <sys/queue.h>
+#include <sys/sysctl.h>
+
+#include <vm/uma.h>
 
 #include "race_ioctl.h"
+#include "race_registry.h"
 
 MALLOC_DEFINE(M_RACE, "race", "race object");
 
-struct race_softc {
-	LIST_ENTRY(race_softc) list;
-	int unit;
-};
+static struct race_registry race_reg;
 
-static LIST_HEAD(, race_softc) race_list =
-    LIST_HEAD_INITIALIZER(&race_list);
+static uma_zone_t race_zone;		/* see race_registry.h */
+
+static SYSCTL_NODE(_hw, OID_AUTO, race, CTLFLAG_RD | CTLFLAG_MPSAFE, 0,
+    "race driver");
+SYSCTL_INT(_hw_race, OID_AUTO, units, CTLFLAG_RD, &race_reg.count, 0,
+    "attached units");
+SYSCTL_UMA_CUR(_hw_race, OID_AUTO, softc_cur, CTLFLAG_RD, &race_zone,
+    "race_softc items allocated from the zone");
 
 static struct race_softc *	race_new(void);
 static struct race_softc *	race_find(int unit);
+static int			race_list_page(struct race_list_page *lp);
+static int			race_attach_n(struct race_units *ru);
+static int			race_detach_n(struct race_units *ru);
 static void			race_destroy(struct race_softc *sc);
 static d_ioctl_t		race_ioctl;
 
@@ -40,10 +49,13 @@ race_ioctl(struct cdev *dev, u_long cmd, caddr_t data, int fflag,
 {
 	struct race_softc *sc;
 	int error = 0;
+	int unit;
 
 	switch (cmd) {
 	case RACE_IOC_ATTACH:
 		sc = race_new();
+		if (sc == NULL)
+			return (ENOMEM);
 		*(int *)data = sc->unit;
 		break;
 	case RACE_IOC_DETACH:
@@ -57,9 +69,18 @@ race_ioctl(struct cdev *dev, u_long cmd, caddr_t data, int fflag,
 		if (sc == NULL)
 			return (ENOENT);
 		break;
+	case RACE_IOC_ATTACH_N:
+		error = race_attach_n((struct race_units *)data);
+		break;
+	case RACE_IOC_DETACH_N:
+		error = race_detach_n((struct race_units *)data);
+		break;
+	case RACE_IOC_LIST_PAGE:
+		error = race_list_page((struct race_list_page *)data);
+		break;
 	case RACE_IOC_LIST:
 		uprintf("  UNIT\n");
-		LIST_FOREACH(sc, &race_list, list)
+		RACE_REGISTRY_FOREACH(&race_reg, unit, sc)
 			uprintf("  %d\n", sc->unit);
 		break;
 	default:
@@ -74,17 +95,12 @@ static struct race_softc *
 race_new(void)
 {
 	struct race_softc *sc;
-	int unit, max = -1;
 
-	LIST_FOREACH(sc, &race_list, list)
-		if (sc->unit > max)
-			max = sc->unit;
-	unit = max + 1;
-
-	sc = (struct race_softc *)malloc(sizeof(struct race_softc), M_RACE,
-	    M_WAITOK | M_ZERO);
-	sc->unit = unit;
-	LIST_INSERT_HEAD(&race_list, sc, list);
+	sc = uma_zalloc(race_zone, M_WAITOK | M_ZERO);
+	if (race_registry_insert(&race_reg, sc, M_WAITOK) != 0) {
+		uma_zfree(race_zone, sc);
+		return (NULL);
+	}
 
 	return (sc);
 }
@@ -94,18 +110,118 @@ race_find(int unit)
 {
 	struct race_softc *sc;
 
-	LIST_FOREACH(sc, &race_list, list)
-		if (sc->unit == unit)
-			break;
+	sc = race_registry_lookup(&race_reg, unit);
+	if (sc != NULL && atomic_load_acq_int(&sc->pending))
+		return (NULL);
 
 	return (sc);
 }
 
+/*
+ * Snapshot a page into a kernel buffer, then copy it out.
+ */
+static int
+race_list_page(struct race_list_page *lp)
+{
+	int *units;
+	int error;
+
+	if (lp->count <= 0 || lp->count > RACE_LIST_PAGE_MAX)
+		return (EINVAL);
+
+	units = malloc(lp->count * sizeof(int), M_RACE, M_WAITOK);
+	lp->count = race_registry_page(&race_reg, &lp->cursor, units,
+	    lp->count);
+	error = copyout(units, lp->units, lp->count * sizeof(int));
+	free(units, M_RACE);
+
+	return (error);
+}
+
+/*
+ * Allocate every softc up front, then insert them. Like everything
+ * else in this driver this takes no lock, so a concurrent ioctl can
+ * see the registry half updated. The new units are marked pending
+ * until their numbers have been copied out, and a failed copyout
+ * destroys them again.
+ */
+static int
+race_attach_n(struct race_units *ru)
+{
+	struct race_softc **scs;
+	int *units;
+	int error = 0, i, n;
+
+	if (ru->count <= 0 || ru->count > RACE_BATCH_MAX)
+		return (EINVAL);
+
+	scs = malloc(ru->count * sizeof(*scs), M_RACE, M_WAITOK);
+	units = malloc(ru->count * sizeof(int), M_RACE, M_WAITOK);
+	for (i = 0; i < ru->count; i++) {
+		scs[i] = uma_zalloc(race_zone, M_WAITOK | M_ZERO);
+		scs[i]->pending = 1;
+	}
+
+	for (n = 0; n < ru->count; n++) {
+		error = race_registry_insert(&race_reg, scs[n], M_WAITOK);
+		if (error != 0)
+			break;
+		units[n] = scs[n]->unit;
+	}
+
+	if (error == 0)
+		error = copyout(units, ru->units, n * sizeof(int));
+
+	for (i = 0; i < n; i++)
+		if (error == 0)
+			atomic_store_rel_int(&scs[i]->pending, 0);
+		else
+			race_destroy(scs[i]);
+	if (error != 0)
+		for (i = n; i < ru->count; i++)
+			uma_zfree(race_zone, scs[i]);
+
+	free(units, M_RACE);
+	free(scs, M_RACE);
+
+	return (error);
+}
+
+static int
+race_detach_n(struct race_units *ru)
+{
+	struct race_softc *sc;
+	int *units;
+	int error, i;
+
+	if (ru->count <= 0 || ru->count > RACE_BATCH_MAX)
+		return (EINVAL);
+
+	units = malloc(ru->count * sizeof(int), M_RACE, M_WAITOK);
+	error = copyin(ru->units, units, ru->count * sizeof(int));
+	if (error != 0)
+		goto out;
+
+	for (i = 0; i < ru->count && error == 0; i++)
+		if (race_find(units[i]) == NULL)
+			error = ENOENT;
+	for (i = 0; i < ru->count && error == 0; i++) {
+		/* Listed twice, already gone. */
+		sc = race_find(units[i]);
+		if (sc != NULL)
+			race_destroy(sc);
+	}
+out:
+	free(units, M_RACE);
+
+	return (error);
+}
+
 static void
 race_destroy(struct race_softc *sc)
 {
-	LIST_REMOVE(sc, list);
-	free(sc, M_RACE);
+	race_registry_remove(&race_reg, sc);
+	uma_zfree(race_zone, sc);
 }
 
 static int
@@ -115,12 +231,16 @@ race_modevent(module_t mod __unused, int event, void *arg __unused)
 
 	switch (event) {
 	case MOD_LOAD:
+		race_zone = uma_zcreate("race_softc", sizeof(struct race_softc),
+		    NULL, NULL, NULL, NULL, UMA_ALIGN_PTR, 0);
 		race_dev = make_dev(&race_cdevsw, 0, UID_ROOT, GID_WHEEL,
 		    0600, RACE_NAME);
 		uprintf("Race driver loaded.\n");
 		break;
 	case MOD_UNLOAD:
 		destroy_dev(race_dev);
+		race_registry_fini(&race_reg);
+		uma_zdestroy(race_zone);
 		uprintf("Race driver unloaded.\n");
 		break;
 	/*
@@ -129,7 +249,7 @@ race_modevent(module_t mod __unused, int event, void *arg __unused)
 	 * kldunload -f ignores this.
 	 */
 	case MOD_QUIESCE:
-		if (!LIST_EMPTY(&race_list))
+		if (race_reg.count != 0)
 			error = EBUSY;
 		break;
 	default:
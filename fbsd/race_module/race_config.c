@@ -1,6 +1,7 @@
 #include <sys/types.h>
 #include <sys/ioctl.h>
 
+#include <ctype.h>
 #include <err.h>
 #include <fcntl.h>
 #include <limits.h>
@@ -10,10 +11,12 @@
 #include "race_ioctl.h"
 
 static enum {UNSET, ATTACH, DETACH, QUERY, LIST} action = UNSET;
+static int json;
 
 
 /*
- * The usage statement: race_config -a | -d unit | -q unit | -l
+ * The usage statement:
+ *     race_config -a [count] | -d unit[,unit...] | -q unit | -l [-j]
  */
 
 static void
@@ -25,11 +28,64 @@ usage()
          * 'race_config -a -d unit' is invalid.
          */
 
-        fprintf(stderr, "usage: race_config -a | -d unit | -q unit | -l\n");
+        fprintf(stderr, "usage: race_config -a [count] | -d unit[,unit...] | "
+            "-q unit | -l [-j]\n");
         exit(1);
 }
 
 
+/*
+ * Print every unit, a page at a time, as a table or as JSON.
+ */
+
+static void
+list(int fd)
+{
+        struct race_list_page lp;
+        int i, n = 0, units[RACE_LIST_PAGE_MAX];
+
+        printf(json ? "{\"units\": [" : "  UNIT\n");
+
+        lp.cursor = 0;
+        while (lp.cursor >= 0) {
+                lp.count = RACE_LIST_PAGE_MAX;
+                lp.units = units;
+                if (ioctl(fd, RACE_IOC_LIST_PAGE, &lp) < 0)
+                        err(1, "ioctl(/dev/%s)", RACE_NAME);
+
+                for (i = 0; i < lp.count; i++, n++)
+                        if (json)
+                                printf("%s%d", n ? ", " : "", units[i]);
+                        else
+                                printf("  %d\n", units[i]);
+        }
+
+        if (json)
+                printf("]}\n");
+}
+
+
+/*
+ * Attach 'count' items, RACE_BATCH_MAX per ioctl.
+ */
+
+static void
+attach_n(int fd, int count)
+{
+        struct race_units ru;
+        int i, units[RACE_BATCH_MAX];
+
+        for (; count > 0; count -= ru.count) {
+                ru.count = count < RACE_BATCH_MAX ? count : RACE_BATCH_MAX;
+                ru.units = units;
+                if (ioctl(fd, RACE_IOC_ATTACH_N, &ru) < 0)
+                        err(1, "ioctl(/dev/%s)", RACE_NAME);
+                for (i = 0; i < ru.count; i++)
+                        printf("unit: %d\n", units[i]);
+        }
+}
+
+
 /*
  * This program manages the doubly linked list found in /dev/race. It
  * allows you to add or remove an item, query the existence of an item,
@@ -39,33 +95,50 @@ usage()
 int
 main(int argc, char *argv[])
 {
-        int ch, fd, i, unit;
-        char *p;
+        struct race_units ru;
+        int ch, count = 1, fd, i, n = 0, unit;
+        int units[RACE_BATCH_MAX];
+        char *p, *q;
 
         /*
          * Parse the command line argument list to determine
          * the correct course of action.
          *
-         *    -a:      add an item.
-         *    -d unit: detach an item.
+         *    -a:      add an item, or 'count' items at once.
+         *    -d unit: detach an item, or a comma-separated list at once.
          *    -q unit: query the existence of an item.
          *    -l:      list every item.
+         *    -j:      list as JSON.
          */
 
-        while ((ch = getopt(argc, argv, "ad:q:l")) != -1)
+        while ((ch = getopt(argc, argv, "ad:q:lj")) != -1)
                 switch (ch) {
                 case 'a':
                         if (action != UNSET)
                                 usage();
                         action = ATTACH;
+                        /* Optional operand, getopt(3) can't do that. */
+                        if (optind < argc && isdigit(*argv[optind])) {
+                                count = (int)strtol(argv[optind++], &p, 10);
+                                if (*p || count <= 0)
+                                        errx(1, "illegal count -- %s",
+                                            argv[optind - 1]);
+                        }
                         break;
                 case 'd':
                         if (action != UNSET)
                                 usage();
                         action = DETACH;
-                        unit = (int)strtol(optarg, &p, 10);
-                        if (*p)
-                                errx(1, "illegal unit -- %s", optarg);
+                        for (p = optarg; ; p = q + 1) {
+                                if (n == RACE_BATCH_MAX)
+                                        errx(1, "too many units");
+                                units[n++] = (int)strtol(p, &q, 10);
+                                if (q == p || (*q != ',' && *q != '\0'))
+                                        errx(1, "illegal unit -- %s", optarg);
+                                if (*q == '\0')
+                                        break;
+                        }
+                        unit = units[0];
                         break;
                 case 'q':
                         if (action != UNSET)
@@ -80,6 +153,9 @@ main(int argc, char *argv[])
                                 usage();
                         action = LIST;
                         break;
+                case 'j':
+                        json = 1;
+                        break;
                 default:
                         usage();
                 }
@@ -93,10 +169,14 @@ main(int argc, char *argv[])
                 if (fd < 0)
                         err(1, "open(/dev/%s)", RACE_NAME);
 
-                i = ioctl(fd, RACE_IOC_ATTACH, &unit);
-                if (i < 0)
-                        err(1, "ioctl(/dev/%s)", RACE_NAME);
-                printf("unit: %d\n", unit);
+                if (count > 1) {
+                        attach_n(fd, count);
+                } else {
+                        i = ioctl(fd, RACE_IOC_ATTACH, &unit);
+                        if (i < 0)
+                                err(1, "ioctl(/dev/%s)", RACE_NAME);
+                        printf("unit: %d\n", unit);
+                }
 
                 close (fd);
         } else if (action == DETACH) {
@@ -104,7 +184,13 @@ main(int argc, char *argv[])
                 if (fd < 0)
                         err(1, "open(/dev/%s)", RACE_NAME);
 
-                i = ioctl(fd, RACE_IOC_DETACH, &unit);
+                if (n > 1) {
+                        ru.count = n;
+                        ru.units = units;
+                        i = ioctl(fd, RACE_IOC_DETACH_N, &ru);
+                } else {
+                        i = ioctl(fd, RACE_IOC_DETACH, &unit);
+                }
                 if (i < 0)
                         err(1, "ioctl(/dev/%s)", RACE_NAME);
                 close (fd);
@@ -123,9 +209,7 @@ main(int argc, char *argv[])
                 if (fd < 0)
                         err(1, "open(/dev/%s)", RACE_NAME);
 
-                i = ioctl(fd, RACE_IOC_LIST, NULL);
-                if (i < 0)
-                        err(1, "ioctl(/dev/%s)", RACE_NAME);
+                list(fd);
 
                 close (fd);
         } else
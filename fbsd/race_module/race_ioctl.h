@@ -6,4 +6,36 @@
 #define RACE_IOC_DETACH		_IOW('R', 1, int)
 #define RACE_IOC_QUERY		_IOW('R', 2, int)
 #define RACE_IOC_LIST		_IO('R', 3)
+#define RACE_IOC_LIST_PAGE	_IOWR('R', 4, struct race_list_page)
+#define RACE_IOC_ATTACH_N	_IOW('R', 5, struct race_units)
+#define RACE_IOC_DETACH_N	_IOW('R', 6, struct race_units)
 
+/*
+ * One page of attached units, in ascending order. On input 'cursor' is
+ * the first unit to consider (0 to start) and 'count' the capacity of
+ * 'units'; on output 'count' is the number of units stored and
+ * 'cursor' where the next page starts, or -1 after the last page.
+ * Passing -1 back returns an empty page. Each page is a consistent
+ * snapshot.
+ */
+struct race_list_page {
+	int	cursor;
+	int	count;
+	int	*units;
+};
+
+#define RACE_LIST_PAGE_MAX	4096
+
+
+/*
+ * Attach or detach 'count' units at once. RACE_IOC_ATTACH_N stores the
+ * new unit numbers in 'units'; RACE_IOC_DETACH_N reads them from there
+ * and fails with ENOENT, detaching nothing, if any is not attached.
+ * Either way it is all or nothing.
+ */
+struct race_units {
+	int	count;
+	int	*units;
+};
+
+#define RACE_BATCH_MAX		4096
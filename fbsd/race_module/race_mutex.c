@@ -7,25 +7,35 @@
 #include <sys/uio.h>
 #include <sys/malloc.h>
 #include <sys/ioccom.h>
-#include <sys/queue.h>
+#include <sys/sysctl.h>
 #include <sys/lock.h>
 #include <sys/mutex.h>
 
+#include <vm/uma.h>
+
 #include "race_ioctl.h"
+#include "race_registry.h"
 
 MALLOC_DEFINE(M_RACE, "race", "race object");
 
-struct race_softc {
-	LIST_ENTRY(race_softc) list;
-	int unit;
-};
-
 static struct mtx race_mtx;
-static LIST_HEAD(, race_softc) race_list =
-    LIST_HEAD_INITIALIZER(&race_list);
+static struct race_registry race_reg;
+
+static uma_zone_t race_zone;		/* see race_registry.h */
 
+static SYSCTL_NODE(_hw, OID_AUTO, race, CTLFLAG_RD | CTLFLAG_MPSAFE, 0,
+    "race driver");
+SYSCTL_INT(_hw_race, OID_AUTO, units, CTLFLAG_RD, &race_reg.count, 0,
+    "attached units");
+SYSCTL_UMA_CUR(_hw_race, OID_AUTO, softc_cur, CTLFLAG_RD, &race_zone,
+    "race_softc items allocated from the zone");
+
+static int			race_reserve(int n);
 static struct race_softc *	race_new(void);
 static struct race_softc *	race_find(int unit);
+static int			race_list_page(struct race_list_page *lp);
+static int			race_attach_n(struct race_units *ru);
+static int			race_detach_n(struct race_units *ru);
 static void			race_destroy(struct race_softc *sc);
 static d_ioctl_t		race_ioctl;
 static d_ioctl_t		race_ioctl_mtx;
@@ -44,6 +54,11 @@ race_ioctl_mtx(struct cdev *dev, u_long cmd, caddr_t data, int fflag,
 {
 	int error;
 
+	/* These allocate before they take the lock. */
+	if (cmd == RACE_IOC_ATTACH || cmd == RACE_IOC_ATTACH_N ||
+	    cmd == RACE_IOC_DETACH_N || cmd == RACE_IOC_LIST_PAGE)
+		return (race_ioctl(dev, cmd, data, fflag, td));
+
 	mtx_lock(&race_mtx);
 	error = race_ioctl(dev, cmd, data, fflag, td);
 	mtx_unlock(&race_mtx);
@@ -57,10 +72,13 @@ race_ioctl(struct cdev *dev, u_long cmd, caddr_t data, int fflag,
 {
 	struct race_softc *sc;
 	int error = 0;
+	int unit;
 
 	switch (cmd) {
 	case RACE_IOC_ATTACH:
 		sc = race_new();
+		if (sc == NULL)
+			return (ENOMEM);
 		*(int *)data = sc->unit;
 		break;
 	case RACE_IOC_DETACH:
@@ -74,9 +92,18 @@ race_ioctl(struct cdev *dev, u_long cmd, caddr_t data, int fflag,
 		if (sc == NULL)
 			return (ENOENT);
 		break;
+	case RACE_IOC_ATTACH_N:
+		error = race_attach_n((struct race_units *)data);
+		break;
+	case RACE_IOC_DETACH_N:
+		error = race_detach_n((struct race_units *)data);
+		break;
+	case RACE_IOC_LIST_PAGE:
+		error = race_list_page((struct race_list_page *)data);
+		break;
 	case RACE_IOC_LIST:
 		uprintf("  UNIT\n");
-		LIST_FOREACH(sc, &race_list, list)
+		RACE_REGISTRY_FOREACH(&race_reg, unit, sc)
 			uprintf("  %d\n", sc->unit);
 		break;
 	default:
@@ -87,22 +114,49 @@ race_ioctl(struct cdev *dev, u_long cmd, caddr_t data, int fflag,
 	return (error);
 }
 
+/*
+ * Make room for 'n' more units. M_WAITOK may sleep, which is not ok
+ * while holding a mutex, so a larger table is allocated with the mutex
+ * dropped; another thread may have grown the registry meanwhile, hence
+ * the loop. Called and returns with race_mtx held.
+ */
+static int
+race_reserve(int n)
+{
+	struct race_spare sp;
+	int size;
+
+	mtx_assert(&race_mtx, MA_OWNED);
+	while ((size = race_registry_need(&race_reg, n)) != 0) {
+		if (size < 0)
+			return (ENOSPC);
+		mtx_unlock(&race_mtx);
+		race_spare_alloc(&sp, size, M_WAITOK);
+		mtx_lock(&race_mtx);
+		if (size > race_reg.size)
+			race_registry_install(&race_reg, &sp);
+		race_spare_free(&sp);
+	}
+
+	return (0);
+}
+
 static struct race_softc *
 race_new(void)
 {
 	struct race_softc *sc;
-	int unit, max = -1;
-
-	LIST_FOREACH(sc, &race_list, list)
-		if (sc->unit > max)
-			max = sc->unit;
-	unit = max + 1;
+	int error;
 
-	/* M_WAITOK causes sleep while holding mutex, this is not ok. */
-	sc = (struct race_softc *)malloc(sizeof(struct race_softc), M_RACE,
-	    M_WAITOK | M_ZERO);
-	sc->unit = unit;
-	LIST_INSERT_HEAD(&race_list, sc, list);
+	sc = uma_zalloc(race_zone, M_WAITOK | M_ZERO);
+	mtx_lock(&race_mtx);
+	error = race_reserve(1);
+	if (error == 0)
+		error = race_registry_insert(&race_reg, sc, M_NOWAIT);
+	mtx_unlock(&race_mtx);
+	if (error != 0) {
+		uma_zfree(race_zone, sc);
+		return (NULL);
+	}
 
 	return (sc);
 }
@@ -112,18 +166,128 @@ race_find(int unit)
 {
 	struct race_softc *sc;
 
-	LIST_FOREACH(sc, &race_list, list)
-		if (sc->unit == unit)
-			break;
+	sc = race_registry_lookup(&race_reg, unit);
+	if (sc != NULL && atomic_load_acq_int(&sc->pending))
+		return (NULL);
 
 	return (sc);
 }
 
+/*
+ * Snapshot a page into a kernel buffer under the lock, then copy it out
+ * unlocked.
+ */
+static int
+race_list_page(struct race_list_page *lp)
+{
+	int *units;
+	int error;
+
+	if (lp->count <= 0 || lp->count > RACE_LIST_PAGE_MAX)
+		return (EINVAL);
+
+	units = malloc(lp->count * sizeof(int), M_RACE, M_WAITOK);
+	mtx_lock(&race_mtx);
+	lp->count = race_registry_page(&race_reg, &lp->cursor, units,
+	    lp->count);
+	mtx_unlock(&race_mtx);
+	error = copyout(units, lp->units, lp->count * sizeof(int));
+	free(units, M_RACE);
+
+	return (error);
+}
+
+/*
+ * Allocate every softc up front, then insert them all in one critical
+ * section. The new units stay pending, invisible to race_find() and
+ * the listings, until their numbers have been copied out; so if that
+ * fails nobody else can have detached them and they are simply
+ * destroyed again.
+ */
+static int
+race_attach_n(struct race_units *ru)
+{
+	struct race_softc **scs;
+	int *units;
+	int error = 0, i, n;
+
+	if (ru->count <= 0 || ru->count > RACE_BATCH_MAX)
+		return (EINVAL);
+
+	scs = malloc(ru->count * sizeof(*scs), M_RACE, M_WAITOK);
+	units = malloc(ru->count * sizeof(int), M_RACE, M_WAITOK);
+	for (i = 0; i < ru->count; i++) {
+		scs[i] = uma_zalloc(race_zone, M_WAITOK | M_ZERO);
+		scs[i]->pending = 1;
+	}
+
+	mtx_lock(&race_mtx);
+	error = race_reserve(ru->count);
+	for (n = 0; n < ru->count && error == 0; n++) {
+		error = race_registry_insert(&race_reg, scs[n], M_NOWAIT);
+		if (error != 0)
+			break;
+		units[n] = scs[n]->unit;
+	}
+	mtx_unlock(&race_mtx);
+
+	if (error == 0)
+		error = copyout(units, ru->units, n * sizeof(int));
+
+	mtx_lock(&race_mtx);
+	for (i = 0; i < n; i++)
+		if (error == 0)
+			atomic_store_rel_int(&scs[i]->pending, 0);
+		else
+			race_destroy(scs[i]);
+	mtx_unlock(&race_mtx);
+	if (error != 0)
+		for (i = n; i < ru->count; i++)
+			uma_zfree(race_zone, scs[i]);
+
+	free(units, M_RACE);
+	free(scs, M_RACE);
+
+	return (error);
+}
+
+static int
+race_detach_n(struct race_units *ru)
+{
+	struct race_softc *sc;
+	int *units;
+	int error, i;
+
+	if (ru->count <= 0 || ru->count > RACE_BATCH_MAX)
+		return (EINVAL);
+
+	units = malloc(ru->count * sizeof(int), M_RACE, M_WAITOK);
+	error = copyin(ru->units, units, ru->count * sizeof(int));
+	if (error != 0)
+		goto out;
+
+	mtx_lock(&race_mtx);
+	for (i = 0; i < ru->count && error == 0; i++)
+		if (race_find(units[i]) == NULL)
+			error = ENOENT;
+	for (i = 0; i < ru->count && error == 0; i++) {
+		/* Listed twice, already gone. */
+		sc = race_find(units[i]);
+		if (sc != NULL)
+			race_destroy(sc);
+	}
+	mtx_unlock(&race_mtx);
+out:
+	free(units, M_RACE);
+
+	return (error);
+}
+
 static void
 race_destroy(struct race_softc *sc)
 {
-	LIST_REMOVE(sc, list);
-	free(sc, M_RACE);
+	race_registry_remove(&race_reg, sc);
+	uma_zfree(race_zone, sc);
 }
 
 static int
@@ -133,6 +297,8 @@ race_modevent(module_t mod __unused, int event, void *arg __unused)
 
 	switch (event) {
 	case MOD_LOAD:
+		race_zone = uma_zcreate("race_softc", sizeof(struct race_softc),
+		    NULL, NULL, NULL, NULL, UMA_ALIGN_PTR, 0);
 		mtx_init(&race_mtx, "race config lock", NULL, MTX_DEF);
 		race_dev = make_dev(&race_cdevsw, 0, UID_ROOT, GID_WHEEL,
 		    0600, RACE_NAME);
@@ -140,6 +306,8 @@ race_modevent(module_t mod __unused, int event, void *arg __unused)
 		break;
 	case MOD_UNLOAD:
 		destroy_dev(race_dev);
+		race_registry_fini(&race_reg);
+		uma_zdestroy(race_zone);
 		uprintf("Race driver unloaded.\n");
 		mtx_destroy(&race_mtx);
 		break;
@@ -149,7 +317,7 @@ race_modevent(module_t mod __unused, int event, void *arg __unused)
 	 * kldunload -f ignores this.
 	 */
 	case MOD_QUIESCE:
-		if (!LIST_EMPTY(&race_list))
+		if (race_reg.count != 0)
 			error = EBUSY;
 		break;
 	default:
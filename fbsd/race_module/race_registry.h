@@ -0,0 +1,238 @@
+#pragma once
+
+#include <sys/bitstring.h>
+#include <sys/epoch.h>
+#include <machine/atomic.h>
+
+/*
+ * Unit registry shared by the race drivers. Unit numbers come from a
+ * bitmap, lowest free first, so they are reused and stay dense; a table
+ * indexed by unit number finds a unit in O(1). Both grow by doubling
+ * and never shrink. The registry does no locking of its own, each
+ * driver serializes access as it sees fit.
+ *
+ * Updates must be serialized, but race_registry_lookup() may run
+ * concurrently with them: the table and its slots are published with
+ * release stores, and an outgrown table is freed only after the
+ * driver's 'sync' hook, if any, has let such readers drain.
+ */
+MALLOC_DECLARE(M_RACE);
+
+#define RACE_REGISTRY_MIN	64
+
+/*
+ * Each driver allocates softcs from a UMA zone of its own, whose per-CPU
+ * caches absorb attach/detach churn without going to the general
+ * allocator. hw.race.softc_cur shows the items in use; vmstat -z has the
+ * full zone statistics.
+ */
+struct race_softc {
+	int unit;
+	u_int pending;			/* RACE_IOC_ATTACH_N not done yet */
+	struct epoch_context epoch;	/* deferred free, race_sx.c */
+};
+
+struct race_table {
+	int size;
+	struct race_softc *slot[];	/* indexed by unit number */
+};
+
+struct race_registry {
+	bitstr_t *map;			/* allocated unit numbers */
+	struct race_table *table;
+	int size;			/* capacity of map and table */
+	int hint;			/* no free unit below this one */
+	int count;
+	void (*sync)(void);		/* wait for lock-free readers */
+};
+
+/*
+ * A table and bitmap allocated ahead of race_registry_install(), so a
+ * driver that can't sleep under its lock allocates them unlocked.
+ */
+struct race_spare {
+	bitstr_t *map;
+	struct race_table *table;
+	int size;
+};
+
+/*
+ * The size to grow to for 'n' more units: 0 if they fit already, -1 if
+ * the registry can't hold them.
+ */
+static __inline int
+race_registry_need(struct race_registry *r, int n)
+{
+	int size = r->size ? r->size : RACE_REGISTRY_MIN;
+
+	if (n > INT_MAX - r->count)
+		return (-1);
+	if (r->count + n <= r->size)
+		return (0);
+	while (size < r->count + n) {
+		if (size > INT_MAX / 2)
+			return (-1);
+		size *= 2;
+	}
+
+	return (size);
+}
+
+static __inline int
+race_spare_alloc(struct race_spare *sp, int size, int mflags)
+{
+	sp->size = size;
+	sp->map = bit_alloc(size, M_RACE, mflags);
+	sp->table = malloc(sizeof(*sp->table) +
+	    size * sizeof(sp->table->slot[0]), M_RACE, mflags | M_ZERO);
+	if (sp->map == NULL || sp->table == NULL) {
+		free(sp->map, M_RACE);
+		free(sp->table, M_RACE);
+		sp->map = NULL;
+		sp->table = NULL;
+		return (ENOMEM);
+	}
+	sp->table->size = size;
+
+	return (0);
+}
+
+/* Freeing a spare that was installed is a no-op. */
+static __inline void
+race_spare_free(struct race_spare *sp)
+{
+	free(sp->map, M_RACE);
+	free(sp->table, M_RACE);
+}
+
+/*
+ * Move the registry into a larger spare, which it takes over.
+ */
+static __inline void
+race_registry_install(struct race_registry *r, struct race_spare *sp)
+{
+	struct race_table *old = r->table;
+
+	KASSERT(sp->size > r->size, ("race_registry_install: shrinking"));
+	if (r->size > 0) {
+		memcpy(sp->map, r->map, bitstr_size(r->size));
+		memcpy(sp->table->slot, old->slot,
+		    r->size * sizeof(old->slot[0]));
+	}
+	free(r->map, M_RACE);
+	r->map = sp->map;
+	r->size = sp->size;
+	atomic_store_rel_ptr((volatile uintptr_t *)&r->table,
+	    (uintptr_t)sp->table);
+	sp->map = NULL;
+	sp->table = NULL;
+	if (old != NULL && r->sync != NULL)
+		r->sync();
+	free(old, M_RACE);
+}
+
+static __inline int
+race_registry_grow(struct race_registry *r, int mflags)
+{
+	struct race_spare sp;
+	int error, size;
+
+	if ((size = race_registry_need(r, 1)) <= 0)
+		return (size == 0 ? 0 : ENOSPC);
+	error = race_spare_alloc(&sp, size, mflags);
+	if (error != 0)
+		return (error);
+	race_registry_install(r, &sp);
+
+	return (0);
+}
+
+/*
+ * Give 'sc' the lowest free unit number.
+ */
+static __inline int
+race_registry_insert(struct race_registry *r, struct race_softc *sc,
+    int mflags)
+{
+	int error, unit;
+
+	if (r->count == r->size) {
+		error = race_registry_grow(r, mflags);
+		if (error != 0)
+			return (error);
+	}
+
+	bit_ffc_at(r->map, r->hint, r->size, &unit);
+	bit_set(r->map, unit);
+	sc->unit = unit;
+	atomic_store_rel_ptr((volatile uintptr_t *)&r->table->slot[unit],
+	    (uintptr_t)sc);
+	r->hint = unit + 1;
+	r->count++;
+
+	return (0);
+}
+
+static __inline struct race_softc *
+race_registry_lookup(struct race_registry *r, int unit)
+{
+	struct race_table *table;
+
+	table = (struct race_table *)atomic_load_acq_ptr(
+	    (volatile uintptr_t *)&r->table);
+	if (table == NULL || unit < 0 || unit >= table->size)
+		return (NULL);
+
+	return ((struct race_softc *)atomic_load_acq_ptr(
+	    (volatile uintptr_t *)&table->slot[unit]));
+}
+
+static __inline void
+race_registry_remove(struct race_registry *r, struct race_softc *sc)
+{
+	bit_clear(r->map, sc->unit);
+	atomic_store_rel_ptr((volatile uintptr_t *)&r->table->slot[sc->unit],
+	    (uintptr_t)NULL);
+	r->hint = MIN(r->hint, sc->unit);
+	r->count--;
+}
+
+/*
+ * Units in ascending order, skipping the free slots and pending units.
+ */
+#define RACE_REGISTRY_FOREACH(r, unit, sc)				\
+	for ((unit) = 0; (unit) < (r)->size; (unit)++)			\
+		if (((sc) = (r)->table->slot[(unit)]) != NULL &&	\
+		    !(sc)->pending)
+
+/*
+ * Store up to 'max' attached units, starting at '*cursor', in 'units'.
+ * Returns how many were stored and advances '*cursor' past them, or
+ * sets it to -1 if no units are left. A negative cursor gives an empty
+ * page.
+ */
+static __inline int
+race_registry_page(struct race_registry *r, int *cursor, int *units,
+    int max)
+{
+	int n = 0, unit;
+
+	/* Past the last page, stay there rather than start over. */
+	if (*cursor < 0)
+		return (0);
+
+	for (unit = *cursor; unit < r->size && n < max; unit++)
+		if (r->table->slot[unit] != NULL &&
+		    !r->table->slot[unit]->pending)
+			units[n++] = unit;
+	*cursor = unit < r->size ? unit : -1;
+
+	return (n);
+}
+
+static __inline void
+race_registry_fini(struct race_registry *r)
+{
+	free(r->map, M_RACE);
+	free(r->table, M_RACE);
+}
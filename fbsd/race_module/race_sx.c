@@ -7,25 +7,43 @@
 #include <sys/uio.h>
 #include <sys/malloc.h>
 #include <sys/ioccom.h>
-#include <sys/queue.h>
+#include <sys/sysctl.h>
 #include <sys/lock.h>
 #include <sys/sx.h>
+#include <sys/epoch.h>
+
+#include <vm/uma.h>
 
 #include "race_ioctl.h"
+#include "race_registry.h"
 
 MALLOC_DEFINE(M_RACE, "race", "race object");
 
-struct race_softc {
-	LIST_ENTRY(race_softc) list;
-	int unit;
-};
-
+/*
+ * Attach and detach take race_sx exclusive. Queries only look the unit
+ * up in the registry and run lock-free inside race_epoch; detached
+ * units and outgrown tables are freed once those readers are gone.
+ * RACE_IOC_LIST may sleep in uprintf(), which an epoch section must not,
+ * so it holds race_sx shared instead.
+ */
 static struct sx race_sx;
-static LIST_HEAD(, race_softc) race_list =
-    LIST_HEAD_INITIALIZER(&race_list);
+static epoch_t race_epoch;
+static struct race_registry race_reg;
+
+static uma_zone_t race_zone;		/* see race_registry.h */
+
+static SYSCTL_NODE(_hw, OID_AUTO, race, CTLFLAG_RD | CTLFLAG_MPSAFE, 0,
+    "race driver");
+SYSCTL_INT(_hw_race, OID_AUTO, units, CTLFLAG_RD, &race_reg.count, 0,
+    "attached units");
+SYSCTL_UMA_CUR(_hw_race, OID_AUTO, softc_cur, CTLFLAG_RD, &race_zone,
+    "race_softc items allocated from the zone");
 
 static struct race_softc *	race_new(void);
 static struct race_softc *	race_find(int unit);
+static int			race_list_page(struct race_list_page *lp);
+static int			race_attach_n(struct race_units *ru);
+static int			race_detach_n(struct race_units *ru);
 static void			race_destroy(struct race_softc *sc);
 static d_ioctl_t		race_ioctl;
 static d_ioctl_t		race_ioctl_mtx;
@@ -42,11 +60,32 @@ static int
 race_ioctl_mtx(struct cdev *dev, u_long cmd, caddr_t data, int fflag,
     struct thread *td)
 {
+	struct epoch_tracker et;
 	int error;
 
-	sx_xlock(&race_sx);
-	error = race_ioctl(dev, cmd, data, fflag, td);
-	sx_xunlock(&race_sx);
+	switch (cmd) {
+	case RACE_IOC_ATTACH_N:
+	case RACE_IOC_DETACH_N:
+	case RACE_IOC_LIST_PAGE:
+		/* These allocate first and take the lock themselves. */
+		error = race_ioctl(dev, cmd, data, fflag, td);
+		break;
+	case RACE_IOC_QUERY:
+		epoch_enter_preempt(race_epoch, &et);
+		error = race_ioctl(dev, cmd, data, fflag, td);
+		epoch_exit_preempt(race_epoch, &et);
+		break;
+	case RACE_IOC_LIST:
+		sx_slock(&race_sx);
+		error = race_ioctl(dev, cmd, data, fflag, td);
+		sx_sunlock(&race_sx);
+		break;
+	default:
+		sx_xlock(&race_sx);
+		error = race_ioctl(dev, cmd, data, fflag, td);
+		sx_xunlock(&race_sx);
+		break;
+	}
 
 	return (error);
 }
@@ -57,10 +96,13 @@ race_ioctl(struct cdev *dev, u_long cmd, caddr_t data, int fflag,
 {
 	struct race_softc *sc;
 	int error = 0;
+	int unit;
 
 	switch (cmd) {
 	case RACE_IOC_ATTACH:
 		sc = race_new();
+		if (sc == NULL)
+			return (ENOMEM);
 		*(int *)data = sc->unit;
 		break;
 	case RACE_IOC_DETACH:
@@ -74,9 +116,18 @@ race_ioctl(struct cdev *dev, u_long cmd, caddr_t data, int fflag,
 		if (sc == NULL)
 			return (ENOENT);
 		break;
+	case RACE_IOC_ATTACH_N:
+		error = race_attach_n((struct race_units *)data);
+		break;
+	case RACE_IOC_DETACH_N:
+		error = race_detach_n((struct race_units *)data);
+		break;
+	case RACE_IOC_LIST_PAGE:
+		error = race_list_page((struct race_list_page *)data);
+		break;
 	case RACE_IOC_LIST:
 		uprintf("  UNIT\n");
-		LIST_FOREACH(sc, &race_list, list)
+		RACE_REGISTRY_FOREACH(&race_reg, unit, sc)
 			uprintf("  %d\n", sc->unit);
 		break;
 	default:
@@ -91,18 +142,13 @@ static struct race_softc *
 race_new(void)
 {
 	struct race_softc *sc;
-	int unit, max = -1;
-
-	LIST_FOREACH(sc, &race_list, list)
-		if (sc->unit > max)
-			max = sc->unit;
-	unit = max + 1;
 
 	/* M_WAITOK is fine with sx lock, thread can sleep while holding sx. */
-	sc = (struct race_softc *)malloc(sizeof(struct race_softc), M_RACE,
-	    M_WAITOK | M_ZERO);
-	sc->unit = unit;
-	LIST_INSERT_HEAD(&race_list, sc, list);
+	sc = uma_zalloc(race_zone, M_WAITOK | M_ZERO);
+	if (race_registry_insert(&race_reg, sc, M_WAITOK) != 0) {
+		uma_zfree(race_zone, sc);
+		return (NULL);
+	}
 
 	return (sc);
 }
@@ -112,18 +158,142 @@ race_find(int unit)
 {
 	struct race_softc *sc;
 
-	LIST_FOREACH(sc, &race_list, list)
-		if (sc->unit == unit)
-			break;
+	sc = race_registry_lookup(&race_reg, unit);
+	if (sc != NULL && atomic_load_acq_int(&sc->pending))
+		return (NULL);
 
 	return (sc);
 }
 
+static void
+race_free(epoch_context_t ctx)
+{
+	struct race_softc *sc;
+
+	sc = __containerof(ctx, struct race_softc, epoch);
+	uma_zfree(race_zone, sc);
+}
+
+/*
+ * Snapshot a page into a kernel buffer under the lock, then copy it out
+ * unlocked.
+ */
+static int
+race_list_page(struct race_list_page *lp)
+{
+	int *units;
+	int error;
+
+	if (lp->count <= 0 || lp->count > RACE_LIST_PAGE_MAX)
+		return (EINVAL);
+
+	units = malloc(lp->count * sizeof(int), M_RACE, M_WAITOK);
+	sx_slock(&race_sx);
+	lp->count = race_registry_page(&race_reg, &lp->cursor, units,
+	    lp->count);
+	sx_sunlock(&race_sx);
+	error = copyout(units, lp->units, lp->count * sizeof(int));
+	free(units, M_RACE);
+
+	return (error);
+}
+
+/*
+ * Allocate every softc up front, then insert them all in one critical
+ * section. The new units stay pending, invisible to race_find() and
+ * the listings, until their numbers have been copied out; so if that
+ * fails nobody else can have detached them and they are simply
+ * destroyed again.
+ */
+static int
+race_attach_n(struct race_units *ru)
+{
+	struct race_softc **scs;
+	int *units;
+	int error = 0, i, n;
+
+	if (ru->count <= 0 || ru->count > RACE_BATCH_MAX)
+		return (EINVAL);
+
+	scs = malloc(ru->count * sizeof(*scs), M_RACE, M_WAITOK);
+	units = malloc(ru->count * sizeof(int), M_RACE, M_WAITOK);
+	for (i = 0; i < ru->count; i++) {
+		scs[i] = uma_zalloc(race_zone, M_WAITOK | M_ZERO);
+		scs[i]->pending = 1;
+	}
+
+	sx_xlock(&race_sx);
+	for (n = 0; n < ru->count; n++) {
+		error = race_registry_insert(&race_reg, scs[n], M_WAITOK);
+		if (error != 0)
+			break;
+		units[n] = scs[n]->unit;
+	}
+	sx_xunlock(&race_sx);
+
+	if (error == 0)
+		error = copyout(units, ru->units, n * sizeof(int));
+
+	sx_xlock(&race_sx);
+	for (i = 0; i < n; i++)
+		if (error == 0)
+			atomic_store_rel_int(&scs[i]->pending, 0);
+		else
+			race_destroy(scs[i]);
+	sx_xunlock(&race_sx);
+	if (error != 0)
+		for (i = n; i < ru->count; i++)
+			uma_zfree(race_zone, scs[i]);
+
+	free(units, M_RACE);
+	free(scs, M_RACE);
+
+	return (error);
+}
+
+static int
+race_detach_n(struct race_units *ru)
+{
+	struct race_softc *sc;
+	int *units;
+	int error, i;
+
+	if (ru->count <= 0 || ru->count > RACE_BATCH_MAX)
+		return (EINVAL);
+
+	units = malloc(ru->count * sizeof(int), M_RACE, M_WAITOK);
+	error = copyin(ru->units, units, ru->count * sizeof(int));
+	if (error != 0)
+		goto out;
+
+	sx_xlock(&race_sx);
+	for (i = 0; i < ru->count && error == 0; i++)
+		if (race_find(units[i]) == NULL)
+			error = ENOENT;
+	for (i = 0; i < ru->count && error == 0; i++) {
+		/* Listed twice, already gone. */
+		sc = race_find(units[i]);
+		if (sc != NULL)
+			race_destroy(sc);
+	}
+	sx_xunlock(&race_sx);
+out:
+	free(units, M_RACE);
+
+	return (error);
+}
+
 static void
 race_destroy(struct race_softc *sc)
 {
-	LIST_REMOVE(sc, list);
-	free(sc, M_RACE);
+	race_registry_remove(&race_reg, sc);
+	epoch_call(race_epoch, race_free, &sc->epoch);
+}
+
+static void
+race_sync(void)
+{
+	epoch_wait_preempt(race_epoch);
 }
 
 static int
@@ -133,13 +303,21 @@ race_modevent(module_t mod __unused, int event, void *arg __unused)
 
 	switch (event) {
 	case MOD_LOAD:
+		race_zone = uma_zcreate("race_softc", sizeof(struct race_softc),
+		    NULL, NULL, NULL, NULL, UMA_ALIGN_PTR, 0);
 		sx_init(&race_sx, "race config lock");
+		race_epoch = epoch_alloc("race", EPOCH_PREEMPT);
+		race_reg.sync = race_sync;
 		race_dev = make_dev(&race_cdevsw, 0, UID_ROOT, GID_WHEEL,
 		    0600, RACE_NAME);
 		uprintf("Race driver loaded.\n");
 		break;
 	case MOD_UNLOAD:
 		destroy_dev(race_dev);
+		epoch_drain_callbacks(race_epoch);
+		race_registry_fini(&race_reg);
+		uma_zdestroy(race_zone);
+		epoch_free(race_epoch);
 		uprintf("Race driver unloaded.\n");
 		sx_destroy(&race_sx);
 		break;
@@ -149,7 +327,7 @@ race_modevent(module_t mod __unused, int event, void *arg __unused)
 	 * kldunload -f ignores this.
 	 */
 	case MOD_QUIESCE:
-		if (!LIST_EMPTY(&race_list))
+		if (race_reg.count != 0)
 			error = EBUSY;
 		break;
 	default:
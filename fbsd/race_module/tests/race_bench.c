@@ -0,0 +1,268 @@
+/*
+ * Cost of the race driver's ioctls at growing registry sizes, for
+ * whichever of race.c, race_mutex.c or race_sx.c is linked in. For
+ * each size N: attach N units one by one, query each, list them all a
+ * page at a time with RACE_IOC_LIST_PAGE and once more through the
+ * uprintf() of RACE_IOC_LIST, detach them in batches. Reports ns per
+ * unit. The shim formats uprintf() output but drops it, so the last
+ * listing is a lower bound of what it costs on a terminal.
+ *
+ * With -t, attach max_units units instead and have 1, 2, 4, ... up to
+ * max_threads threads query them concurrently, each on its own
+ * descriptor. Reports queries per second, which is where the three
+ * locking schemes differ.
+ *
+ * With -c, 1, 2, 4, ... up to max_threads threads each attach and
+ * detach a unit in a loop, and the report is softc allocations per
+ * second from the UMA zone. race.c takes no locks, so run this against
+ * race_mutex.c or race_sx.c only.
+ *
+ * usage: race_bench [max_units]	(default 1000000)
+ *	  race_bench -t max_threads [max_units]	(default 10000)
+ *	  race_bench -c max_threads
+ */
+#include <sys/ioccom.h>
+#include <err.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shim.h"
+#include "race_ioctl.h"
+
+SHIM_MODULE_DECLARE(race);
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+static int page[RACE_LIST_PAGE_MAX];
+
+static void
+run(struct shim_file *fp, int n, int *units)
+{
+	struct race_list_page lp;
+	struct race_units ru;
+	double t0, t1, t2, t3, t4, t5;
+	int i, unit, listed;
+
+	t0 = now();
+	for (i = 0; i < n; i++) {
+		if (shim_ioctl(fp, RACE_IOC_ATTACH, &units[i]) != 0)
+			errx(1, "attach %d", i);
+	}
+	t1 = now();
+	for (i = 0; i < n; i++) {
+		unit = units[i];
+		if (shim_ioctl(fp, RACE_IOC_QUERY, &unit) != 0)
+			errx(1, "query %d", unit);
+	}
+	t2 = now();
+	listed = 0;
+	lp.cursor = 0;
+	while (lp.cursor >= 0) {
+		lp.count = RACE_LIST_PAGE_MAX;
+		lp.units = page;
+		if (shim_ioctl(fp, RACE_IOC_LIST_PAGE, &lp) != 0)
+			errx(1, "list at %d", lp.cursor);
+		listed += lp.count;
+	}
+	if (listed != n)
+		errx(1, "listed %d of %d units", listed, n);
+	t3 = now();
+	if (shim_ioctl(fp, RACE_IOC_LIST, NULL) != 0)
+		errx(1, "list");
+	t4 = now();
+	for (i = 0; i < n; i += ru.count) {
+		ru.count = n - i < RACE_BATCH_MAX ? n - i : RACE_BATCH_MAX;
+		ru.units = units + i;
+		if (shim_ioctl(fp, RACE_IOC_DETACH_N, &ru) != 0)
+			errx(1, "detach from %d", i);
+	}
+	t5 = now();
+
+	printf("%8d %10.1f %10.1f %10.1f %10.1f %10.1f\n", n,
+	    (t1 - t0) / n, (t2 - t1) / n, (t3 - t2) / n, (t4 - t3) / n,
+	    (t5 - t4) / n);
+}
+
+#define	QUERIES		1000000		/* per thread */
+
+struct querier {
+	pthread_t	td;
+	const int	*units;
+	int		n;
+	unsigned int	seed;
+};
+
+static void *
+query_loop(void *arg)
+{
+	struct querier *q = arg;
+	struct shim_file *fp;
+	int i, unit;
+
+	if (shim_open("race", O_RDWR, &fp) != 0)
+		errx(1, "open race failed");
+	for (i = 0; i < QUERIES; i++) {
+		unit = q->units[rand_r(&q->seed) % q->n];
+		if (shim_ioctl(fp, RACE_IOC_QUERY, &unit) != 0)
+			errx(1, "query %d", unit);
+	}
+	shim_close(fp);
+	return (NULL);
+}
+
+static void
+run_threads(struct shim_file *fp, int n, int *units, int maxthreads)
+{
+	struct querier *q;
+	struct race_units ru;
+	double t;
+	int i, nthreads;
+
+	for (i = 0; i < n; i++) {
+		if (shim_ioctl(fp, RACE_IOC_ATTACH, &units[i]) != 0)
+			errx(1, "attach %d", i);
+	}
+	if ((q = calloc(maxthreads, sizeof(*q))) == NULL)
+		err(1, "calloc");
+
+	printf("%8s %12s  (%d units)\n", "threads", "queries/s", n);
+	for (nthreads = 1; nthreads <= maxthreads; nthreads *= 2) {
+		t = now();
+		for (i = 0; i < nthreads; i++) {
+			q[i].units = units;
+			q[i].n = n;
+			q[i].seed = i + 1;
+			if (pthread_create(&q[i].td, NULL, query_loop,
+			    &q[i]) != 0)
+				errx(1, "pthread_create");
+		}
+		for (i = 0; i < nthreads; i++)
+			pthread_join(q[i].td, NULL);
+		t = now() - t;
+		printf("%8d %12.0f\n", nthreads,
+		    nthreads * 1e9 * QUERIES / t);
+	}
+
+	for (i = 0; i < n; i += ru.count) {
+		ru.count = n - i < RACE_BATCH_MAX ? n - i : RACE_BATCH_MAX;
+		ru.units = units + i;
+		if (shim_ioctl(fp, RACE_IOC_DETACH_N, &ru) != 0)
+			errx(1, "detach from %d", i);
+	}
+	free(q);
+}
+
+#define	CHURN		200000		/* attach/detach pairs per thread */
+
+static void *
+churn_loop(void *arg __attribute__((__unused__)))
+{
+	struct shim_file *fp;
+	int i, unit;
+
+	if (shim_open("race", O_RDWR, &fp) != 0)
+		errx(1, "open race failed");
+	for (i = 0; i < CHURN; i++) {
+		if (shim_ioctl(fp, RACE_IOC_ATTACH, &unit) != 0)
+			errx(1, "attach");
+		if (shim_ioctl(fp, RACE_IOC_DETACH, &unit) != 0)
+			errx(1, "detach %d", unit);
+	}
+	shim_close(fp);
+	return (NULL);
+}
+
+static void
+run_churn(int maxthreads)
+{
+	pthread_t *td;
+	double t;
+	int i, nthreads;
+
+	if ((td = calloc(maxthreads, sizeof(*td))) == NULL)
+		err(1, "calloc");
+	printf("%8s %12s\n", "threads", "allocs/s");
+	for (nthreads = 1; nthreads <= maxthreads; nthreads *= 2) {
+		t = now();
+		for (i = 0; i < nthreads; i++) {
+			if (pthread_create(&td[i], NULL, churn_loop,
+			    NULL) != 0)
+				errx(1, "pthread_create");
+		}
+		for (i = 0; i < nthreads; i++)
+			pthread_join(td[i], NULL);
+		t = now() - t;
+		printf("%8d %12.0f\n", nthreads, nthreads * 1e9 * CHURN / t);
+	}
+	free(td);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: race_bench [max_units]\n"
+	    "       race_bench -t max_threads [max_units]\n"
+	    "       race_bench -c max_threads\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct shim_file *fp;
+	int *units, ch, n, max, maxthreads = 0, churn = 0;
+
+	while ((ch = getopt(argc, argv, "c:t:")) != -1) {
+		switch (ch) {
+		case 'c':
+			churn = 1;
+			/* FALLTHROUGH */
+		case 't':
+			maxthreads = atoi(optarg);
+			if (maxthreads < 1)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	max = argc > 0 ? atoi(argv[0]) : maxthreads ? 10000 : 1000000;
+	if (max < 1)
+		usage();
+	if ((units = malloc(max * sizeof(int))) == NULL)
+		err(1, "malloc");
+	if (shim_module_event(SHIM_MODULE(race), MOD_LOAD) != 0)
+		errx(1, "load failed");
+	if (shim_open("race", O_RDWR, &fp) != 0)
+		errx(1, "open race failed");
+
+	if (churn) {
+		run_churn(maxthreads);
+	} else if (maxthreads > 0) {
+		run_threads(fp, max, units, maxthreads);
+	} else {
+		printf("%8s %10s %10s %10s %10s %10s  (ns/unit)\n",
+		    "units", "attach", "query", "list", "uprintf", "detach_n");
+		for (n = 1000; n <= max; n *= 10)
+			run(fp, n, units);
+	}
+
+	shim_close(fp);
+	if (shim_module_event(SHIM_MODULE(race), MOD_UNLOAD) != 0)
+		errx(1, "unload failed");
+	free(units);
+	return (0);
+}
@@ -0,0 +1,276 @@
+/*
+ * Drives one of the race drivers (race.c, race_mutex.c or race_sx.c,
+ * whichever is linked in) through the kernel shim (fbsd/shim) with
+ * its ioctls. -DRACE_LOCKED adds the concurrent part, which the
+ * unlocked race.c is not meant to survive.
+ */
+#include <sys/ioccom.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "shim.h"
+#include "race_ioctl.h"
+
+SHIM_MODULE_DECLARE(race);
+
+static int failures;
+
+#define	CHECK(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		failures++;						\
+	}								\
+} while (0)
+
+#define	CHECK_ERR(expr, err) do {					\
+	int _e = (expr);						\
+	if (_e != (err)) {						\
+		fprintf(stderr, "%s:%d: %s = %d, expected %d\n",	\
+		    __FILE__, __LINE__, #expr, _e, (err));		\
+		failures++;						\
+	}								\
+} while (0)
+
+static struct shim_file *fp;
+
+static int
+sysctl_int(const char *name)
+{
+	size_t len = sizeof(int);
+	int v = -1;
+
+	CHECK_ERR(shim_sysctl(name, &v, &len, NULL, 0), 0);
+	return (v);
+}
+
+/*
+ * race_sx.c frees a detached softc after an epoch grace period, so
+ * hw.race.softc_cur may lag behind for a moment.
+ */
+static int
+softc_cur_settles(int want)
+{
+	int i;
+
+	for (i = 0; i < 1000; i++) {
+		if (sysctl_int("hw.race.softc_cur") == want)
+			return (1);
+		usleep(1000);
+	}
+	return (0);
+}
+
+static int
+attach(void)
+{
+	int unit = -1;
+
+	CHECK_ERR(shim_ioctl(fp, RACE_IOC_ATTACH, &unit), 0);
+	return (unit);
+}
+
+/* All attached units, in order, through RACE_IOC_LIST_PAGE. */
+static int
+list(int *units, int max, int pagesize)
+{
+	struct race_list_page lp;
+	int n = 0;
+
+	lp.cursor = 0;
+	while (lp.cursor >= 0 && n < max) {
+		lp.count = pagesize < max - n ? pagesize : max - n;
+		lp.units = units + n;
+		CHECK_ERR(shim_ioctl(fp, RACE_IOC_LIST_PAGE, &lp), 0);
+		n += lp.count;
+	}
+	return (n);
+}
+
+static void
+test_single(void)
+{
+	int unit, i;
+
+	for (i = 0; i < 3; i++)
+		CHECK(attach() == i);
+	unit = 1;
+	CHECK_ERR(shim_ioctl(fp, RACE_IOC_QUERY, &unit), 0);
+	CHECK_ERR(shim_ioctl(fp, RACE_IOC_DETACH, &unit), 0);
+	CHECK_ERR(shim_ioctl(fp, RACE_IOC_QUERY, &unit), ENOENT);
+	CHECK_ERR(shim_ioctl(fp, RACE_IOC_DETACH, &unit), ENOENT);
+	unit = -1;
+	CHECK_ERR(shim_ioctl(fp, RACE_IOC_QUERY, &unit), ENOENT);
+	unit = 1 << 20;
+	CHECK_ERR(shim_ioctl(fp, RACE_IOC_QUERY, &unit), ENOENT);
+	CHECK(attach() == 1);
+	CHECK(sysctl_int("hw.race.units") == 3);
+	CHECK(softc_cur_settles(3));
+	CHECK_ERR(shim_ioctl(fp, RACE_IOC_LIST, NULL), 0);
+	CHECK_ERR(shim_ioctl(fp, _IO('R', 99), NULL), ENOTTY);
+
+	/* Unload is refused while units are attached. */
+	CHECK_ERR(shim_module_event(SHIM_MODULE(race), MOD_QUIESCE), EBUSY);
+	for (unit = 0; unit < 3; unit++)
+		CHECK_ERR(shim_ioctl(fp, RACE_IOC_DETACH, &unit), 0);
+	CHECK_ERR(shim_module_event(SHIM_MODULE(race), MOD_QUIESCE), 0);
+}
+
+static void
+test_batch(void)
+{
+	static int units[RACE_BATCH_MAX], listed[RACE_BATCH_MAX];
+	struct race_units ru;
+	struct race_list_page lp;
+	int i, n, keep[2];
+
+	ru.count = 1000;
+	ru.units = units;
+	CHECK_ERR(shim_ioctl(fp, RACE_IOC_ATTACH_N, &ru), 0);
+	for (i = 0; i < 1000; i++)
+		CHECK(units[i] == i);
+	CHECK(sysctl_int("hw.race.units") == 1000);
+
+	/* Pages of every size see the same units. */
+	CHECK(list(listed, RACE_BATCH_MAX, 7) == 1000);
+	CHECK(memcmp(units, listed, 1000 * sizeof(int)) == 0);
+	CHECK(list(listed, RACE_BATCH_MAX, RACE_LIST_PAGE_MAX) == 1000);
+	lp.cursor = -1;
+	lp.count = 10;
+	lp.units = listed;
+	CHECK_ERR(shim_ioctl(fp, RACE_IOC_LIST_PAGE, &lp), 0);
+	CHECK(lp.count == 0 && lp.cursor == -1);
+	lp.count = 0;
+	CHECK_ERR(shim_ioctl(fp, RACE_IOC_LIST_PAGE, &lp), EINVAL);
+	lp.count = RACE_LIST_PAGE_MAX + 1;
+	CHECK_ERR(shim_ioctl(fp, RACE_IOC_LIST_PAGE, &lp), EINVAL);
+	lp.cursor = 0;
+	lp.count = 10;
+	lp.units = NULL;
+	CHECK_ERR(shim_ioctl(fp, RACE_IOC_LIST_PAGE, &lp), EFAULT);
+
+	/* Detach is all or nothing. */
+	keep[0] = 10;
+	keep[1] = 5000;
+	ru.count = 2;
+	ru.units = keep;
+	CHECK_ERR(shim_ioctl(fp, RACE_IOC_DETACH_N, &ru), ENOENT);
+	CHECK(sysctl_int("hw.race.units") == 1000);
+	keep[1] = 10;
+	CHECK_ERR(shim_ioctl(fp, RACE_IOC_DETACH_N, &ru), 0);
+	CHECK(sysctl_int("hw.race.units") == 999);
+
+	/* A failed copyout leaves nothing attached. */
+	ru.count = 100;
+	ru.units = NULL;
+	CHECK_ERR(shim_ioctl(fp, RACE_IOC_ATTACH_N, &ru), EFAULT);
+	CHECK(sysctl_int("hw.race.units") == 999);
+	CHECK_ERR(shim_ioctl(fp, RACE_IOC_DETACH_N, &ru), EFAULT);
+
+	ru.count = 0;
+	CHECK_ERR(shim_ioctl(fp, RACE_IOC_ATTACH_N, &ru), EINVAL);
+	ru.count = RACE_BATCH_MAX + 1;
+	CHECK_ERR(shim_ioctl(fp, RACE_IOC_DETACH_N, &ru), EINVAL);
+
+	n = list(listed, RACE_BATCH_MAX, 100);
+	CHECK(n == 999);
+	ru.count = n;
+	ru.units = listed;
+	CHECK_ERR(shim_ioctl(fp, RACE_IOC_DETACH_N, &ru), 0);
+	CHECK(sysctl_int("hw.race.units") == 0);
+	CHECK(softc_cur_settles(0));
+}
+
+#ifdef RACE_LOCKED
+/*
+ * Queries of a stable set of units from several threads, while another
+ * thread attaches and detaches batches around them and the registry
+ * grows and its old tables are freed.
+ */
+#define	STABLE	500
+
+static int done;
+
+static void *
+querier(void *arg)
+{
+	struct shim_file *qfp;
+	unsigned int seed = (uintptr_t)arg;
+	long *bad = arg;
+	int unit;
+
+	*bad = 0;
+	if (shim_open("race", O_RDWR, &qfp) != 0) {
+		(*bad)++;
+		return (NULL);
+	}
+	while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+		unit = rand_r(&seed) % STABLE;
+		if (shim_ioctl(qfp, RACE_IOC_QUERY, &unit) != 0)
+			(*bad)++;
+	}
+	shim_close(qfp);
+	return (NULL);
+}
+
+static void
+test_concurrent(void)
+{
+	static int units[RACE_BATCH_MAX];
+	struct race_units ru;
+	pthread_t td[3];
+	long bad[3];
+	int i, round;
+
+	ru.count = STABLE;
+	ru.units = units;
+	CHECK_ERR(shim_ioctl(fp, RACE_IOC_ATTACH_N, &ru), 0);
+	for (i = 0; i < 3; i++)
+		pthread_create(&td[i], NULL, querier, &bad[i]);
+
+	for (round = 0; round < 20; round++) {
+		ru.count = RACE_BATCH_MAX;
+		CHECK_ERR(shim_ioctl(fp, RACE_IOC_ATTACH_N, &ru), 0);
+		CHECK_ERR(shim_ioctl(fp, RACE_IOC_DETACH_N, &ru), 0);
+	}
+
+	__atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < 3; i++) {
+		pthread_join(td[i], NULL);
+		CHECK(bad[i] == 0);
+	}
+	for (i = 0; i < STABLE; i++)
+		units[i] = i;
+	ru.count = STABLE;
+	CHECK_ERR(shim_ioctl(fp, RACE_IOC_DETACH_N, &ru), 0);
+}
+#endif
+
+int
+main(void)
+{
+	CHECK_ERR(shim_module_event(SHIM_MODULE(race), MOD_LOAD), 0);
+	if (shim_open("race", O_RDWR, &fp) != 0) {
+		fprintf(stderr, "open race failed\n");
+		return (1);
+	}
+	test_single();
+	test_batch();
+#ifdef RACE_LOCKED
+	test_concurrent();
+#endif
+	shim_close(fp);
+	CHECK_ERR(shim_module_event(SHIM_MODULE(race), MOD_UNLOAD), 0);
+	CHECK(shim_malloc_inuse("race") == 0);
+
+	if (failures != 0) {
+		fprintf(stderr, "race_test: %d failure(s)\n", failures);
+		return (1);
+	}
+	printf("race_test: ok\n");
+	return (0);
+}
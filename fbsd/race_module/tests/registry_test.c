@@ -0,0 +1,320 @@
+/*
+ * Unit test of race_registry.h on top of the kernel shim (fbsd/shim):
+ * unit numbering and reuse, growth, lookups, paging, allocation
+ * failures, growth through a preallocated spare, and lock-free lookups
+ * racing with growth under an epoch.
+ * Built as kernel code, so malloc() and free() are malloc(9) here.
+ */
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/malloc.h>
+#include <sys/epoch.h>
+
+#include "race_registry.h"
+
+MALLOC_DEFINE(M_RACE, "race", "race object");
+
+static int failures;
+
+#define	CHECK(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		failures++;						\
+	}								\
+} while (0)
+
+static int syncs;
+
+static void
+count_sync(void)
+{
+	syncs++;
+}
+
+static struct race_softc *
+add(struct race_registry *r)
+{
+	struct race_softc *sc;
+
+	sc = malloc(sizeof(*sc), M_RACE, M_WAITOK | M_ZERO);
+	CHECK(race_registry_insert(r, sc, M_WAITOK) == 0);
+	return (sc);
+}
+
+static void
+del(struct race_registry *r, int unit)
+{
+	struct race_softc *sc = race_registry_lookup(r, unit);
+
+	CHECK(sc != NULL && sc->unit == unit);
+	if (sc == NULL)
+		return;
+	race_registry_remove(r, sc);
+	free(sc, M_RACE);
+}
+
+static void
+clear(struct race_registry *r)
+{
+	struct race_softc *sc;
+	int unit;
+
+	for (unit = 0; unit < r->size; unit++)
+		if ((sc = r->table->slot[unit]) != NULL)
+			del(r, unit);
+	CHECK(r->count == 0);
+	race_registry_fini(r);
+	memset(r, 0, sizeof(*r));
+}
+
+static void
+test_numbering(void)
+{
+	struct race_registry r = { .sync = count_sync };
+	int i;
+
+	CHECK(race_registry_lookup(&r, 0) == NULL);
+	for (i = 0; i < 3; i++)
+		CHECK(add(&r)->unit == i);
+	CHECK(r.count == 3 && r.size == RACE_REGISTRY_MIN);
+	CHECK(syncs == 0);
+
+	/* Lowest free number first. */
+	del(&r, 1);
+	CHECK(race_registry_lookup(&r, 1) == NULL);
+	CHECK(add(&r)->unit == 1);
+	del(&r, 2);
+	del(&r, 0);
+	CHECK(add(&r)->unit == 0);
+	CHECK(add(&r)->unit == 2);
+	CHECK(add(&r)->unit == 3);
+
+	CHECK(race_registry_lookup(&r, -1) == NULL);
+	CHECK(race_registry_lookup(&r, r.size) == NULL);
+	CHECK(race_registry_lookup(&r, 1 << 30) == NULL);
+	clear(&r);
+}
+
+static void
+test_growth(void)
+{
+	struct race_registry r = { .sync = count_sync };
+	struct race_softc *sc;
+	int i;
+
+	syncs = 0;
+	for (i = 0; i < 200; i++)
+		CHECK(add(&r)->unit == i);
+	CHECK(r.size == 256 && r.count == 200);
+	/* 64 -> 128 -> 256, the first table has nothing to wait for. */
+	CHECK(syncs == 2);
+	for (i = 0; i < 200; i++) {
+		sc = race_registry_lookup(&r, i);
+		CHECK(sc != NULL && sc->unit == i);
+	}
+
+	/* Holes below the hint are found again after growing. */
+	del(&r, 5);
+	del(&r, 150);
+	CHECK(add(&r)->unit == 5);
+	CHECK(add(&r)->unit == 150);
+	CHECK(add(&r)->unit == 200);
+	clear(&r);
+}
+
+static void
+test_page(void)
+{
+	struct race_registry r = { 0 };
+	struct race_softc *sc;
+	int units[8], cursor, n, i, total;
+
+	for (i = 0; i < 100; i++)
+		add(&r);
+	del(&r, 3);
+	race_registry_lookup(&r, 4)->pending = 1;
+
+	cursor = 0;
+	n = race_registry_page(&r, &cursor, units, 4);
+	CHECK(n == 4 && cursor == 6);
+	CHECK(units[0] == 0 && units[1] == 1 && units[2] == 2 &&
+	    units[3] == 5);
+
+	for (cursor = 0, total = 0; cursor >= 0; total += n)
+		n = race_registry_page(&r, &cursor, units, 8);
+	CHECK(total == 98);
+
+	/* Past the last page: an empty page, and no starting over. */
+	CHECK(cursor == -1);
+	CHECK(race_registry_page(&r, &cursor, units, 8) == 0);
+	CHECK(cursor == -1);
+	cursor = -5;
+	CHECK(race_registry_page(&r, &cursor, units, 8) == 0);
+
+	n = 0;
+	RACE_REGISTRY_FOREACH(&r, i, sc)
+		n++;
+	CHECK(n == 98);
+	race_registry_lookup(&r, 4)->pending = 0;
+	clear(&r);
+}
+
+static void
+test_nomem(void)
+{
+	struct race_registry r = { 0 };
+	struct race_softc sc;
+	long inuse;
+	int i;
+
+	for (i = 0; i < RACE_REGISTRY_MIN; i++)
+		add(&r);
+	inuse = shim_malloc_inuse("race");
+
+	/* The bitmap fails, then the table: nothing changes, no leak. */
+	shim_malloc_fail_after(0);
+	CHECK(race_registry_insert(&r, &sc, M_NOWAIT) == ENOMEM);
+	shim_malloc_fail_after(1);
+	CHECK(race_registry_insert(&r, &sc, M_NOWAIT) == ENOMEM);
+	shim_malloc_fail_after(-1);
+	CHECK(shim_malloc_inuse("race") == inuse);
+	CHECK(r.count == RACE_REGISTRY_MIN && r.size == RACE_REGISTRY_MIN);
+	for (i = 0; i < RACE_REGISTRY_MIN; i++)
+		CHECK(race_registry_lookup(&r, i) != NULL);
+
+	CHECK(race_registry_insert(&r, &sc, M_NOWAIT) == 0);
+	CHECK(sc.unit == RACE_REGISTRY_MIN);
+	race_registry_remove(&r, &sc);
+	clear(&r);
+}
+
+/*
+ * A driver that can't sleep under its lock sizes a spare, allocates it
+ * unlocked and installs it only if nobody grew the registry meanwhile.
+ */
+static void
+test_spare(void)
+{
+	struct race_registry r = { .sync = count_sync };
+	struct race_spare sp, stale;
+	struct race_softc *sc;
+	long inuse;
+	int i;
+
+	CHECK(race_registry_need(&r, 1) == RACE_REGISTRY_MIN);
+	CHECK(race_registry_need(&r, 200) == 256);
+	for (i = 0; i < 60; i++)
+		add(&r);
+	CHECK(race_registry_need(&r, 4) == 0);
+	CHECK(race_registry_need(&r, 5) == 2 * RACE_REGISTRY_MIN);
+	CHECK(race_registry_need(&r, INT_MAX - 10) == -1);
+
+	/* Two threads size the same spare; the second one is dropped. */
+	inuse = shim_malloc_inuse("race");
+	CHECK(race_spare_alloc(&sp, 128, M_WAITOK) == 0);
+	CHECK(race_spare_alloc(&stale, 128, M_WAITOK) == 0);
+	syncs = 0;
+	race_registry_install(&r, &sp);
+	CHECK(r.size == 128 && syncs == 1);
+	CHECK(race_registry_need(&r, 5) == 0);
+	race_spare_free(&sp);
+	race_spare_free(&stale);
+	/* The old table and bitmap went, the stale spare too. */
+	CHECK(shim_malloc_inuse("race") == inuse);
+
+	for (i = 0; i < 60; i++) {
+		sc = race_registry_lookup(&r, i);
+		CHECK(sc != NULL && sc->unit == i);
+	}
+	CHECK(add(&r)->unit == 60);
+	clear(&r);
+}
+
+
+/*
+ * Readers look up a stable set of units inside an epoch section while
+ * one writer keeps growing and shrinking the registry. The old tables
+ * are freed after the sync hook, so a reader never sees freed memory
+ * (build with -fsanitize=address to check).
+ */
+#define	STABLE	1000
+
+static struct race_registry race_reg;
+static epoch_t race_epoch;
+static int done;
+
+static void
+epoch_sync(void)
+{
+	epoch_wait_preempt(race_epoch);
+}
+
+static void *
+reader(void *arg)
+{
+	struct epoch_tracker et;
+	struct race_softc *sc;
+	unsigned int seed = (uintptr_t)arg;
+	long *bad = arg;
+	int unit;
+
+	*bad = 0;
+	while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+		unit = rand_r(&seed) % STABLE;
+		epoch_enter_preempt(race_epoch, &et);
+		sc = race_registry_lookup(&race_reg, unit);
+		if (sc == NULL || sc->unit != unit)
+			(*bad)++;
+		epoch_exit_preempt(race_epoch, &et);
+	}
+	return (NULL);
+}
+
+static void
+test_concurrent(void)
+{
+	pthread_t td[3];
+	long bad[3];
+	int i, round, unit;
+
+	race_epoch = epoch_alloc("race", EPOCH_PREEMPT);
+	race_reg.sync = epoch_sync;
+	for (i = 0; i < STABLE; i++)
+		add(&race_reg);
+	for (i = 0; i < 3; i++)
+		pthread_create(&td[i], NULL, reader, &bad[i]);
+
+	for (round = 0; round < 10; round++) {
+		for (i = 0; i < 20000; i++)
+			add(&race_reg);
+		for (unit = STABLE; unit < STABLE + 20000; unit++)
+			del(&race_reg, unit);
+	}
+
+	__atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < 3; i++) {
+		pthread_join(td[i], NULL);
+		CHECK(bad[i] == 0);
+	}
+	clear(&race_reg);
+	epoch_free(race_epoch);
+}
+
+int
+main(void)
+{
+	test_numbering();
+	test_growth();
+	test_page();
+	test_nomem();
+	test_spare();
+	test_concurrent();
+	CHECK(shim_malloc_inuse("race") == 0);
+
+	if (failures != 0) {
+		fprintf(stderr, "registry_test: %d failure(s)\n", failures);
+		return (1);
+	}
+	printf("registry_test: ok\n");
+	return (0);
+}
@@ -0,0 +1,1578 @@
+/*
+ * Userland implementation of kern_shim.h and shim.h. See kern_shim.h.
+ */
+#include <sched.h>
+#include <time.h>
+
+#include "kern_shim.h"
+
+/* This file gets libc's malloc() and free(). */
+#undef malloc
+#undef mallocarray
+#undef free
+
+/*
+ * malloc(9). Every type counts its live allocations so that a test can
+ * check for leaks after unload. M_NOWAIT allocations can be made to
+ * fail on purpose; M_WAITOK ones never fail, as in the kernel.
+ */
+static pthread_mutex_t malloc_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct malloc_type *malloc_types;
+static long malloc_fail_after = -1;
+
+void
+shim_malloc_register(struct malloc_type *mtp)
+{
+	pthread_mutex_lock(&malloc_mtx);
+	mtp->ks_next = malloc_types;
+	malloc_types = mtp;
+	pthread_mutex_unlock(&malloc_mtx);
+}
+
+void *
+shim_malloc(size_t size, struct malloc_type *mtp, int flags)
+{
+	void *p;
+
+	if (flags & M_NOWAIT) {
+		pthread_mutex_lock(&malloc_mtx);
+		if (malloc_fail_after == 0) {
+			pthread_mutex_unlock(&malloc_mtx);
+			return (NULL);
+		}
+		if (malloc_fail_after > 0)
+			malloc_fail_after--;
+		pthread_mutex_unlock(&malloc_mtx);
+	}
+
+	p = (flags & M_ZERO) ? calloc(1, size ? size : 1) :
+	    malloc(size ? size : 1);
+	if (p == NULL) {
+		if (flags & M_NOWAIT)
+			return (NULL);
+		fprintf(stderr, "malloc(%zu, %s): out of memory\n", size,
+		    mtp->ks_shortdesc);
+		abort();
+	}
+	__atomic_fetch_add(&mtp->ks_inuse, 1, __ATOMIC_RELAXED);
+
+	return (p);
+}
+
+void *
+shim_mallocarray(size_t nmemb, size_t size, struct malloc_type *mtp,
+    int flags)
+{
+	if (size != 0 && nmemb > SIZE_MAX / size) {
+		fprintf(stderr, "mallocarray(%zu, %zu): overflow\n", nmemb,
+		    size);
+		abort();
+	}
+	return (shim_malloc(nmemb * size, mtp, flags));
+}
+
+void
+shim_free(void *addr, struct malloc_type *mtp)
+{
+	if (addr == NULL)
+		return;
+	__atomic_fetch_sub(&mtp->ks_inuse, 1, __ATOMIC_RELAXED);
+	free(addr);
+}
+
+long
+shim_malloc_inuse(const char *shortdesc)
+{
+	struct malloc_type *mtp;
+	long n = -1;
+
+	pthread_mutex_lock(&malloc_mtx);
+	for (mtp = malloc_types; mtp != NULL; mtp = mtp->ks_next)
+		if (strcmp(mtp->ks_shortdesc, shortdesc) == 0)
+			n = __atomic_load_n(&mtp->ks_inuse, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&malloc_mtx);
+
+	return (n);
+}
+
+/*
+ * The next n M_NOWAIT allocations succeed, the ones after that fail.
+ * A negative n turns failures off again.
+ */
+void
+shim_malloc_fail_after(long n)
+{
+	pthread_mutex_lock(&malloc_mtx);
+	malloc_fail_after = n;
+	pthread_mutex_unlock(&malloc_mtx);
+}
+
+/*
+ * systm.h. Quiet unless SHIM_VERBOSE is set, but the message is
+ * formatted either way so benchmarks of uprintf() paths still pay for
+ * it; only the terminal output is missing.
+ */
+int
+uprintf(const char *fmt, ...)
+{
+	static __thread char sink[256];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	if (getenv("SHIM_VERBOSE") != NULL)
+		n = vprintf(fmt, ap);
+	else
+		n = vsnprintf(sink, sizeof(sink), fmt, ap);
+	va_end(ap);
+	return (n);
+}
+
+/* A NULL user address stands in for an unmapped one. */
+int
+copyin(const void *uaddr, void *kaddr, size_t len)
+{
+	if (uaddr == NULL && len > 0)
+		return (EFAULT);
+	memcpy(kaddr, uaddr, len);
+	return (0);
+}
+
+int
+copyout(const void *kaddr, void *uaddr, size_t len)
+{
+	if (uaddr == NULL && len > 0)
+		return (EFAULT);
+	memcpy(uaddr, kaddr, len);
+	return (0);
+}
+
+int
+uiomove(void *cp, int n, struct uio *uio)
+{
+	struct iovec *iov;
+	size_t cnt;
+
+	while (n > 0 && uio->uio_resid > 0) {
+		iov = uio->uio_iov;
+		cnt = iov->iov_len;
+		if (cnt == 0) {
+			uio->uio_iov++;
+			uio->uio_iovcnt--;
+			continue;
+		}
+		if (cnt > (size_t)n)
+			cnt = n;
+		if (iov->iov_base == NULL)
+			return (EFAULT);
+		if (uio->uio_rw == UIO_READ)
+			memcpy(iov->iov_base, cp, cnt);
+		else
+			memcpy(cp, iov->iov_base, cnt);
+		iov->iov_base = (char *)iov->iov_base + cnt;
+		iov->iov_len -= cnt;
+		uio->uio_resid -= cnt;
+		uio->uio_offset += cnt;
+		cp = (char *)cp + cnt;
+		n -= cnt;
+	}
+	return (0);
+}
+
+/* Locks. */
+void
+mtx_init(struct mtx *m, const char *name, const char *type __unused,
+    int opts __unused)
+{
+	pthread_mutex_init(&m->mtx_lock, NULL);
+	m->mtx_name = name;
+}
+
+void
+mtx_destroy(struct mtx *m)
+{
+	pthread_mutex_destroy(&m->mtx_lock);
+}
+
+void
+mtx_lock(struct mtx *m)
+{
+	pthread_mutex_lock(&m->mtx_lock);
+}
+
+void
+mtx_unlock(struct mtx *m)
+{
+	pthread_mutex_unlock(&m->mtx_lock);
+}
+
+void
+sx_init(struct sx *sx, const char *description)
+{
+	pthread_rwlock_init(&sx->sx_lock, NULL);
+	sx->sx_name = description;
+}
+
+void
+sx_destroy(struct sx *sx)
+{
+	pthread_rwlock_destroy(&sx->sx_lock);
+}
+
+void
+sx_xlock(struct sx *sx)
+{
+	pthread_rwlock_wrlock(&sx->sx_lock);
+}
+
+/* There are no signals to interrupt the wait. */
+int
+sx_xlock_sig(struct sx *sx)
+{
+	pthread_rwlock_wrlock(&sx->sx_lock);
+	return (0);
+}
+
+int
+sx_try_xlock(struct sx *sx)
+{
+	return (pthread_rwlock_trywrlock(&sx->sx_lock) == 0);
+}
+
+void
+sx_xunlock(struct sx *sx)
+{
+	pthread_rwlock_unlock(&sx->sx_lock);
+}
+
+void
+sx_slock(struct sx *sx)
+{
+	pthread_rwlock_rdlock(&sx->sx_lock);
+}
+
+void
+sx_sunlock(struct sx *sx)
+{
+	pthread_rwlock_unlock(&sx->sx_lock);
+}
+
+/*
+ * Sleep queues. Each sleeper waits on its own condition variable
+ * under sleepq_mtx, which it takes before dropping the interlock, so a
+ * wakeup() issued after the sleeper's last check is never lost.
+ */
+struct sleeper {
+	const void	*chan;
+	pthread_cond_t	cv;
+	int		woken;
+	struct sleeper	*next;
+};
+
+static pthread_mutex_t sleepq_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct sleeper *sleepq;
+
+int
+mtx_sleep(const void *chan, struct mtx *m, int priority __unused,
+    const char *wmesg __unused, int timo)
+{
+	struct sleeper s, **sp;
+	struct timespec ts;
+	int error = 0;
+
+	s.chan = chan;
+	s.woken = 0;
+	pthread_cond_init(&s.cv, NULL);
+	if (timo > 0) {
+		/* timo is in ticks, take hz = 1000. */
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += timo / 1000;
+		ts.tv_nsec += (long)(timo % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+	}
+
+	pthread_mutex_lock(&sleepq_mtx);
+	s.next = sleepq;
+	sleepq = &s;
+	mtx_unlock(m);
+	while (!s.woken && error == 0) {
+		if (timo > 0) {
+			if (pthread_cond_timedwait(&s.cv, &sleepq_mtx,
+			    &ts) == ETIMEDOUT)
+				error = EWOULDBLOCK;
+		} else {
+			pthread_cond_wait(&s.cv, &sleepq_mtx);
+		}
+	}
+	for (sp = &sleepq; *sp != &s; sp = &(*sp)->next)
+		;
+	*sp = s.next;
+	pthread_mutex_unlock(&sleepq_mtx);
+	pthread_cond_destroy(&s.cv);
+	mtx_lock(m);
+
+	return (error);
+}
+
+static void
+wakeup_n(const void *chan, int one)
+{
+	struct sleeper *s;
+
+	pthread_mutex_lock(&sleepq_mtx);
+	for (s = sleepq; s != NULL; s = s->next) {
+		if (s->chan != chan || s->woken)
+			continue;
+		s->woken = 1;
+		pthread_cond_signal(&s->cv);
+		if (one)
+			break;
+	}
+	pthread_mutex_unlock(&sleepq_mtx);
+}
+
+void
+wakeup(const void *chan)
+{
+	wakeup_n(chan, 0);
+}
+
+void
+wakeup_one(const void *chan)
+{
+	wakeup_n(chan, 1);
+}
+
+/* counter(9), one shared word instead of one per CPU. */
+counter_u64_t
+counter_u64_alloc(int flags __unused)
+{
+	counter_u64_t c = calloc(1, sizeof(*c));
+
+	if (c == NULL)
+		abort();
+	return (c);
+}
+
+void
+counter_u64_free(counter_u64_t c)
+{
+	free(c);
+}
+
+uint64_t
+counter_u64_fetch(counter_u64_t c)
+{
+	return (__atomic_load_n(c, __ATOMIC_RELAXED));
+}
+
+void
+counter_u64_zero(counter_u64_t c)
+{
+	__atomic_store_n(c, 0, __ATOMIC_RELAXED);
+}
+
+sbintime_t
+sbinuptime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (((sbintime_t)ts.tv_sec << 32) +
+	    (((uint64_t)ts.tv_nsec << 32) / 1000000000));
+}
+
+/*
+ * epoch(9). Sections share the rwlock, a grace period takes it
+ * exclusive, which with writer preference also holds off sections that
+ * start while it waits. Callbacks are handed to the epoch's thread,
+ * which runs each batch after a grace period, so epoch_call() is safe
+ * inside a section.
+ */
+struct epoch {
+	pthread_rwlock_t e_lock;
+	pthread_mutex_t	e_mtx;
+	pthread_cond_t	e_cv;
+	epoch_context_t	e_queue;	/* linked through data[0] */
+	int		e_running;	/* callbacks taken off e_queue */
+	int		e_stop;
+	pthread_t	e_td;
+};
+
+static void
+epoch_grace(epoch_t epoch)
+{
+	pthread_rwlock_wrlock(&epoch->e_lock);
+	pthread_rwlock_unlock(&epoch->e_lock);
+}
+
+static void *
+epoch_thread(void *arg)
+{
+	epoch_t epoch = arg;
+	epoch_context_t ctx, next;
+	void (*cb)(epoch_context_t);
+
+	pthread_mutex_lock(&epoch->e_mtx);
+	for (;;) {
+		while (epoch->e_queue == NULL && !epoch->e_stop)
+			pthread_cond_wait(&epoch->e_cv, &epoch->e_mtx);
+		if (epoch->e_queue == NULL)
+			break;
+		ctx = epoch->e_queue;
+		epoch->e_queue = NULL;
+		epoch->e_running = 1;
+		pthread_mutex_unlock(&epoch->e_mtx);
+
+		epoch_grace(epoch);
+		for (; ctx != NULL; ctx = next) {
+			next = ctx->data[0];
+			*(void **)&cb = ctx->data[1];
+			cb(ctx);
+		}
+
+		pthread_mutex_lock(&epoch->e_mtx);
+		epoch->e_running = 0;
+		pthread_cond_broadcast(&epoch->e_cv);
+	}
+	pthread_mutex_unlock(&epoch->e_mtx);
+
+	return (NULL);
+}
+
+epoch_t
+epoch_alloc(const char *name __unused, int flags __unused)
+{
+	pthread_rwlockattr_t attr;
+	epoch_t epoch;
+
+	if ((epoch = calloc(1, sizeof(*epoch))) == NULL)
+		abort();
+	pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+	pthread_rwlockattr_setkind_np(&attr,
+	    PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+	pthread_rwlock_init(&epoch->e_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	pthread_mutex_init(&epoch->e_mtx, NULL);
+	pthread_cond_init(&epoch->e_cv, NULL);
+	if (pthread_create(&epoch->e_td, NULL, epoch_thread, epoch) != 0)
+		abort();
+
+	return (epoch);
+}
+
+void
+epoch_free(epoch_t epoch)
+{
+	pthread_mutex_lock(&epoch->e_mtx);
+	epoch->e_stop = 1;
+	pthread_cond_broadcast(&epoch->e_cv);
+	pthread_mutex_unlock(&epoch->e_mtx);
+	pthread_join(epoch->e_td, NULL);
+	pthread_cond_destroy(&epoch->e_cv);
+	pthread_mutex_destroy(&epoch->e_mtx);
+	pthread_rwlock_destroy(&epoch->e_lock);
+	free(epoch);
+}
+
+void
+epoch_enter_preempt(epoch_t epoch, struct epoch_tracker *et __unused)
+{
+	pthread_rwlock_rdlock(&epoch->e_lock);
+}
+
+void
+epoch_exit_preempt(epoch_t epoch, struct epoch_tracker *et __unused)
+{
+	pthread_rwlock_unlock(&epoch->e_lock);
+}
+
+void
+epoch_wait_preempt(epoch_t epoch)
+{
+	epoch_grace(epoch);
+}
+
+void
+epoch_call(epoch_t epoch, void (*callback)(epoch_context_t),
+    epoch_context_t ctx)
+{
+	ctx->data[1] = *(void **)&callback;
+	pthread_mutex_lock(&epoch->e_mtx);
+	ctx->data[0] = epoch->e_queue;
+	epoch->e_queue = ctx;
+	pthread_cond_broadcast(&epoch->e_cv);
+	pthread_mutex_unlock(&epoch->e_mtx);
+}
+
+void
+epoch_drain_callbacks(epoch_t epoch)
+{
+	pthread_mutex_lock(&epoch->e_mtx);
+	while (epoch->e_queue != NULL || epoch->e_running)
+		pthread_cond_wait(&epoch->e_cv, &epoch->e_mtx);
+	pthread_mutex_unlock(&epoch->e_mtx);
+}
+
+/* UMA zones: no caching, only the count of items handed out. */
+struct uma_zone {
+	const char	*uz_name;
+	size_t		uz_size;
+	int		uz_cur;
+};
+
+uma_zone_t
+uma_zcreate(const char *name, size_t size, uma_ctor ctor, uma_dtor dtor,
+    uma_init uminit, uma_fini fini, int align __unused,
+    uint32_t flags __unused)
+{
+	uma_zone_t zone;
+
+	if (ctor != NULL || dtor != NULL || uminit != NULL || fini != NULL) {
+		fprintf(stderr, "uma_zcreate(%s): item hooks not supported\n",
+		    name);
+		abort();
+	}
+	if ((zone = calloc(1, sizeof(*zone))) == NULL)
+		abort();
+	zone->uz_name = name;
+	zone->uz_size = size;
+
+	return (zone);
+}
+
+void
+uma_zdestroy(uma_zone_t zone)
+{
+	if (zone->uz_cur != 0) {
+		fprintf(stderr, "uma_zdestroy(%s): %d items leaked\n",
+		    zone->uz_name, zone->uz_cur);
+		abort();
+	}
+	free(zone);
+}
+
+void *
+uma_zalloc(uma_zone_t zone, int flags)
+{
+	void *item;
+
+	item = (flags & M_ZERO) ? calloc(1, zone->uz_size) :
+	    malloc(zone->uz_size);
+	if (item == NULL) {
+		if (flags & M_NOWAIT)
+			return (NULL);
+		abort();
+	}
+	__atomic_fetch_add(&zone->uz_cur, 1, __ATOMIC_RELAXED);
+
+	return (item);
+}
+
+void
+uma_zfree(uma_zone_t zone, void *item)
+{
+	if (item == NULL)
+		return;
+	__atomic_fetch_sub(&zone->uz_cur, 1, __ATOMIC_RELAXED);
+	free(item);
+}
+
+int
+uma_zone_get_cur(uma_zone_t zone)
+{
+	return (__atomic_load_n(&zone->uz_cur, __ATOMIC_RELAXED));
+}
+
+/* Threads. */
+static struct ucred shim_cred;
+static __thread struct thread shim_td = { &shim_cred };
+
+struct thread *
+shim_curthread(void)
+{
+	return (&shim_td);
+}
+
+/* kqueue(2) and select(2) plumbing. */
+void
+knlist_init_mtx(struct knlist *knl, struct mtx *lock)
+{
+	knl->kl_list = NULL;
+	knl->kl_lock = lock;
+}
+
+void
+knlist_add(struct knlist *knl, struct knote *kn, int islocked)
+{
+	if (!islocked)
+		mtx_lock(knl->kl_lock);
+	kn->kn_next = knl->kl_list;
+	kn->kn_knlist = knl;
+	knl->kl_list = kn;
+	if (!islocked)
+		mtx_unlock(knl->kl_lock);
+}
+
+void
+knlist_remove(struct knlist *knl, struct knote *kn, int islocked)
+{
+	struct knote **kp;
+
+	if (!islocked)
+		mtx_lock(knl->kl_lock);
+	for (kp = &knl->kl_list; *kp != NULL; kp = &(*kp)->kn_next) {
+		if (*kp == kn) {
+			*kp = kn->kn_next;
+			break;
+		}
+	}
+	kn->kn_knlist = NULL;
+	if (!islocked)
+		mtx_unlock(knl->kl_lock);
+}
+
+/* The knotes are left detached with EV_EOF, f_detach is not called. */
+void
+knlist_clear(struct knlist *knl, int islocked)
+{
+	struct knote *kn;
+
+	if (!islocked)
+		mtx_lock(knl->kl_lock);
+	while ((kn = knl->kl_list) != NULL) {
+		knl->kl_list = kn->kn_next;
+		kn->kn_flags |= EV_EOF;
+		kn->kn_knlist = NULL;
+		__atomic_store_n(&kn->kn_active, 1, __ATOMIC_RELAXED);
+	}
+	if (!islocked)
+		mtx_unlock(knl->kl_lock);
+}
+
+void
+knlist_destroy(struct knlist *knl)
+{
+	if (knl->kl_list != NULL) {
+		fprintf(stderr, "knlist_destroy: knotes still attached\n");
+		abort();
+	}
+}
+
+void
+knote(struct knlist *knl, long hint, int islocked)
+{
+	struct knote *kn;
+
+	if (!islocked)
+		mtx_lock(knl->kl_lock);
+	for (kn = knl->kl_list; kn != NULL; kn = kn->kn_next)
+		if (kn->kn_fop->f_event(kn, hint))
+			__atomic_store_n(&kn->kn_active, 1, __ATOMIC_RELAXED);
+	if (!islocked)
+		mtx_unlock(knl->kl_lock);
+}
+
+void
+selrecord(struct thread *td __unused, struct selinfo *sip)
+{
+	sip->si_waiting++;
+}
+
+void
+selwakeup(struct selinfo *sip)
+{
+	sip->si_waiting = 0;
+}
+
+void
+seldrain(struct selinfo *sip)
+{
+	sip->si_waiting = 0;
+}
+
+/*
+ * devfs. Devices and descriptors sit on two global lists. A call into
+ * the driver counts itself in si_threadcount; destroy_dev() unlinks the
+ * device so no new calls start, waits for the running ones, and then
+ * runs the cdevpriv destructors of the descriptors still open, as
+ * devfs does. Such descriptors fail with ENXIO afterwards.
+ */
+struct shim_file {
+	struct cdev	*dev;
+	int		oflags;
+	off_t		offset;
+	void		*priv;
+	d_priv_dtor_t	*dtor;
+	struct knote	*knotes;
+	struct shim_file *next;
+};
+
+static pthread_mutex_t dev_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct cdev *devices;
+static struct shim_file *files;
+static __thread struct shim_file *curfile;
+
+static struct cdev *
+dev_alloc(const char *fmt, va_list ap)
+{
+	struct cdev *dev = calloc(1, sizeof(*dev));
+
+	if (dev == NULL)
+		abort();
+	vsnprintf(dev->si_name, sizeof(dev->si_name), fmt, ap);
+	return (dev);
+}
+
+struct cdev *
+make_dev(struct cdevsw *devsw, int unit __unused, uid_t uid __unused,
+    gid_t gid __unused, int perms __unused, const char *fmt, ...)
+{
+	struct cdev *dev;
+	va_list ap;
+
+	va_start(ap, fmt);
+	dev = dev_alloc(fmt, ap);
+	va_end(ap);
+	dev->si_devsw = devsw;
+
+	pthread_mutex_lock(&dev_mtx);
+	dev->si_next = devices;
+	devices = dev;
+	pthread_mutex_unlock(&dev_mtx);
+
+	return (dev);
+}
+
+void
+make_dev_args_init(struct make_dev_args *args)
+{
+
+	memset(args, 0, sizeof(*args));
+	args->mda_size = sizeof(*args);
+}
+
+/* The device is published with si_drv1/si_drv2 already set. */
+int
+make_dev_s(struct make_dev_args *args, struct cdev **cdev,
+    const char *fmt, ...)
+{
+	struct cdev *dev;
+	va_list ap;
+
+	if (args->mda_size != sizeof(*args))
+		abort();
+	va_start(ap, fmt);
+	dev = dev_alloc(fmt, ap);
+	va_end(ap);
+	dev->si_devsw = args->mda_devsw;
+	dev->si_drv1 = args->mda_si_drv1;
+	dev->si_drv2 = args->mda_si_drv2;
+
+	pthread_mutex_lock(&dev_mtx);
+	dev->si_next = devices;
+	devices = dev;
+	pthread_mutex_unlock(&dev_mtx);
+
+	*cdev = dev;
+	return (0);
+}
+
+struct cdev *
+make_dev_alias(struct cdev *pdev, const char *fmt, ...)
+{
+	struct cdev *dev;
+	va_list ap;
+
+	va_start(ap, fmt);
+	dev = dev_alloc(fmt, ap);
+	va_end(ap);
+	dev->si_parent = pdev;
+	dev->si_devsw = pdev->si_devsw;
+
+	pthread_mutex_lock(&dev_mtx);
+	dev->si_next = devices;
+	devices = dev;
+	pthread_mutex_unlock(&dev_mtx);
+
+	return (dev);
+}
+
+void
+destroy_dev(struct cdev *dev)
+{
+	struct cdev **dp, *d;
+	struct shim_file *fp;
+
+	pthread_mutex_lock(&dev_mtx);
+	dev->si_gone = 1;
+	for (dp = &devices; (d = *dp) != NULL;) {
+		if (d == dev || d->si_parent == dev) {
+			*dp = d->si_next;
+			if (d != dev)
+				free(d);
+		} else {
+			dp = &d->si_next;
+		}
+	}
+	while (__atomic_load_n(&dev->si_threadcount, __ATOMIC_ACQUIRE) != 0) {
+		pthread_mutex_unlock(&dev_mtx);
+		sched_yield();
+		pthread_mutex_lock(&dev_mtx);
+	}
+	for (fp = files; fp != NULL; fp = fp->next) {
+		if (fp->dev != dev)
+			continue;
+		if (fp->dtor != NULL)
+			fp->dtor(fp->priv);
+		fp->priv = NULL;
+		fp->dtor = NULL;
+		fp->dev = NULL;
+	}
+	pthread_mutex_unlock(&dev_mtx);
+	free(dev);
+}
+
+int
+devfs_set_cdevpriv(void *priv, d_priv_dtor_t *dtr)
+{
+	if (curfile == NULL)
+		return (ENOENT);
+	if (curfile->priv != NULL)
+		return (EBUSY);
+	curfile->priv = priv;
+	curfile->dtor = dtr;
+	return (0);
+}
+
+int
+devfs_get_cdevpriv(void **datap)
+{
+	if (curfile == NULL || curfile->priv == NULL)
+		return (EBADF);
+	*datap = curfile->priv;
+	return (0);
+}
+
+int
+shim_dev_exists(const char *name)
+{
+	struct cdev *dev;
+
+	pthread_mutex_lock(&dev_mtx);
+	for (dev = devices; dev != NULL; dev = dev->si_next)
+		if (strcmp(dev->si_name, name) == 0)
+			break;
+	pthread_mutex_unlock(&dev_mtx);
+
+	return (dev != NULL);
+}
+
+/*
+ * Enter and leave the driver on behalf of 'fp'. Entering fails with
+ * ENXIO once the device is being destroyed.
+ */
+static int
+dev_enter(struct shim_file *fp, struct cdev **devp)
+{
+	struct cdev *dev;
+
+	pthread_mutex_lock(&dev_mtx);
+	dev = fp->dev;
+	if (dev == NULL || dev->si_gone) {
+		pthread_mutex_unlock(&dev_mtx);
+		return (ENXIO);
+	}
+	__atomic_fetch_add(&dev->si_threadcount, 1, __ATOMIC_ACQUIRE);
+	pthread_mutex_unlock(&dev_mtx);
+	curfile = fp;
+	*devp = dev;
+
+	return (0);
+}
+
+static void
+dev_leave(struct cdev *dev)
+{
+	curfile = NULL;
+	__atomic_fetch_sub(&dev->si_threadcount, 1, __ATOMIC_RELEASE);
+}
+
+int
+shim_open(const char *name, int oflags, struct shim_file **fpp)
+{
+	struct shim_file *fp;
+	struct cdev *dev;
+	int error;
+
+	if ((fp = calloc(1, sizeof(*fp))) == NULL)
+		return (ENOMEM);
+	fp->oflags = oflags;
+
+	pthread_mutex_lock(&dev_mtx);
+	for (dev = devices; dev != NULL; dev = dev->si_next)
+		if (strcmp(dev->si_name, name) == 0)
+			break;
+	if (dev == NULL) {
+		pthread_mutex_unlock(&dev_mtx);
+		free(fp);
+		return (ENOENT);
+	}
+	fp->dev = dev->si_parent != NULL ? dev->si_parent : dev;
+	fp->next = files;
+	files = fp;
+	pthread_mutex_unlock(&dev_mtx);
+
+	error = dev_enter(fp, &dev);
+	if (error == 0) {
+		if (dev->si_devsw->d_open != NULL)
+			error = dev->si_devsw->d_open(dev, oflags, 0,
+			    curthread);
+		dev_leave(dev);
+	}
+	if (error != 0) {
+		shim_close(fp);
+		return (error);
+	}
+	*fpp = fp;
+
+	return (0);
+}
+
+void
+shim_close(struct shim_file *fp)
+{
+	struct shim_file **fpp;
+	struct cdev *dev;
+
+	while (fp->knotes != NULL)
+		shim_kqueue_detach(fp->knotes);
+
+	if (dev_enter(fp, &dev) == 0) {
+		if (dev->si_devsw->d_close != NULL)
+			dev->si_devsw->d_close(dev, fp->oflags, 0, curthread);
+		dev_leave(dev);
+	}
+
+	pthread_mutex_lock(&dev_mtx);
+	for (fpp = &files; *fpp != fp; fpp = &(*fpp)->next)
+		;
+	*fpp = fp->next;
+	pthread_mutex_unlock(&dev_mtx);
+	if (fp->dtor != NULL)
+		fp->dtor(fp->priv);
+	free(fp);
+}
+
+/*
+ * read(2)/write(2) through d_read/d_write at the file offset. A partial
+ * transfer that ends in EWOULDBLOCK or EINTR is a success, as in
+ * dofileread()/dofilewrite().
+ */
+static int
+shim_rw(struct shim_file *fp, const struct iovec *iov, int iovcnt,
+    size_t *done, enum uio_rw rw)
+{
+	struct iovec aiov[16];
+	struct uio uio;
+	struct cdev *dev;
+	ssize_t len = 0;
+	int error, i, ioflag;
+
+	if (iovcnt < 0 || iovcnt > 16)
+		return (EINVAL);
+	for (i = 0; i < iovcnt; i++) {
+		aiov[i] = iov[i];
+		len += iov[i].iov_len;
+	}
+	uio.uio_iov = aiov;
+	uio.uio_iovcnt = iovcnt;
+	uio.uio_offset = fp->offset;
+	uio.uio_resid = len;
+	uio.uio_segflg = UIO_USERSPACE;
+	uio.uio_rw = rw;
+	uio.uio_td = curthread;
+	ioflag = (fp->oflags & O_NONBLOCK) ? IO_NDELAY : 0;
+
+	error = dev_enter(fp, &dev);
+	if (error != 0)
+		return (error);
+	if (rw == UIO_READ)
+		error = dev->si_devsw->d_read(dev, &uio, ioflag);
+	else
+		error = dev->si_devsw->d_write(dev, &uio, ioflag);
+	dev_leave(dev);
+
+	if (uio.uio_resid != len && (error == EWOULDBLOCK || error == EINTR))
+		error = 0;
+	fp->offset = uio.uio_offset;
+	if (done != NULL)
+		*done = len - uio.uio_resid;
+
+	return (error);
+}
+
+int
+shim_read(struct shim_file *fp, void *buf, size_t len, size_t *done)
+{
+	struct iovec iov = { buf, len };
+
+	return (shim_rw(fp, &iov, 1, done, UIO_READ));
+}
+
+int
+shim_write(struct shim_file *fp, const void *buf, size_t len, size_t *done)
+{
+	struct iovec iov = { (void *)(uintptr_t)buf, len };
+
+	return (shim_rw(fp, &iov, 1, done, UIO_WRITE));
+}
+
+int
+shim_readv(struct shim_file *fp, const struct iovec *iov, int iovcnt,
+    size_t *done)
+{
+	return (shim_rw(fp, iov, iovcnt, done, UIO_READ));
+}
+
+int
+shim_writev(struct shim_file *fp, const struct iovec *iov, int iovcnt,
+    size_t *done)
+{
+	return (shim_rw(fp, iov, iovcnt, done, UIO_WRITE));
+}
+
+off_t
+shim_lseek(struct shim_file *fp, off_t offset)
+{
+	return (fp->offset = offset);
+}
+
+/* 'data' is the kernel copy of the argument, as after ioctl(2)'s copyin. */
+int
+shim_ioctl(struct shim_file *fp, unsigned long cmd, void *data)
+{
+	struct cdev *dev;
+	int error;
+
+	error = dev_enter(fp, &dev);
+	if (error != 0)
+		return (error);
+	error = dev->si_devsw->d_ioctl != NULL ?
+	    dev->si_devsw->d_ioctl(dev, cmd, data, fp->oflags, curthread) :
+	    ENODEV;
+	dev_leave(dev);
+
+	return (error);
+}
+
+int
+shim_poll(struct shim_file *fp, int events)
+{
+	struct cdev *dev;
+	int revents;
+
+	if (dev_enter(fp, &dev) != 0)
+		return (POLLHUP);
+	revents = dev->si_devsw->d_poll != NULL ?
+	    dev->si_devsw->d_poll(dev, events, curthread) :
+	    events & (POLLIN | POLLOUT | POLLRDNORM | POLLWRNORM);
+	dev_leave(dev);
+
+	return (revents);
+}
+
+int
+shim_kqueue_attach(struct shim_file *fp, int filter, struct knote **knp)
+{
+	struct knote *kn;
+	struct cdev *dev;
+	int error;
+
+	error = dev_enter(fp, &dev);
+	if (error != 0)
+		return (error);
+	if ((kn = calloc(1, sizeof(*kn))) == NULL) {
+		dev_leave(dev);
+		return (ENOMEM);
+	}
+	kn->kn_filter = filter;
+	error = dev->si_devsw->d_kqfilter != NULL ?
+	    dev->si_devsw->d_kqfilter(dev, kn) : EINVAL;
+	dev_leave(dev);
+	if (error != 0) {
+		free(kn);
+		return (error);
+	}
+	kn->kn_fp = fp;
+	kn->kn_fpnext = fp->knotes;
+	fp->knotes = kn;
+	*knp = kn;
+
+	return (0);
+}
+
+/* What kevent(2) would report for the knote now. */
+int
+shim_kqueue_ready(struct knote *kn, int64_t *data)
+{
+	struct knlist *knl = kn->kn_knlist;
+	int ready;
+
+	if (knl == NULL)
+		return ((kn->kn_flags & EV_EOF) != 0);
+	mtx_lock(knl->kl_lock);
+	ready = kn->kn_fop->f_event(kn, 0);
+	mtx_unlock(knl->kl_lock);
+	if (data != NULL)
+		*data = kn->kn_data;
+
+	return (ready);
+}
+
+/* Whether KNOTE() activated the knote since the last call. */
+int
+shim_kqueue_fired(struct knote *kn)
+{
+	return (__atomic_exchange_n(&kn->kn_active, 0, __ATOMIC_RELAXED));
+}
+
+void
+shim_kqueue_detach(struct knote *kn)
+{
+	struct knote **kp;
+
+	if (kn->kn_knlist != NULL)
+		kn->kn_fop->f_detach(kn);
+	for (kp = &kn->kn_fp->knotes; *kp != kn; kp = &(*kp)->kn_fpnext)
+		;
+	*kp = kn->kn_fpnext;
+	free(kn);
+}
+
+/*
+ * Device pager. Objects are shared by handle, as cdev_pager_allocate()
+ * does, so the constructor runs once per handle and the destructor
+ * when the last reference goes. Faulted pages stay in the object.
+ */
+static pthread_mutex_t object_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct vm_object *objects;
+
+vm_object_t
+cdev_pager_allocate(void *handle, int type __unused,
+    struct cdev_pager_ops *ops, vm_ooffset_t size, vm_prot_t prot,
+    vm_ooffset_t foff, struct ucred *cred)
+{
+	struct vm_object *obj;
+	u_short color;
+
+	pthread_mutex_lock(&object_mtx);
+	for (obj = objects; obj != NULL; obj = obj->next) {
+		if (obj->handle == handle) {
+			obj->ref_count++;
+			pthread_mutex_unlock(&object_mtx);
+			return (obj);
+		}
+	}
+	if (ops->cdev_pg_ctor(handle, size, prot, foff, cred, &color) != 0) {
+		pthread_mutex_unlock(&object_mtx);
+		return (NULL);
+	}
+	if ((obj = calloc(1, sizeof(*obj))) == NULL)
+		abort();
+	obj->handle = handle;
+	obj->un_pager_ops = ops;
+	obj->size = size;
+	obj->ref_count = 1;
+	mtx_init(&obj->lock, "vm object", NULL, MTX_DEF);
+	obj->next = objects;
+	objects = obj;
+	pthread_mutex_unlock(&object_mtx);
+
+	return (obj);
+}
+
+vm_page_t
+vm_page_getfake(vm_paddr_t paddr, vm_memattr_t memattr __unused)
+{
+	vm_page_t m = calloc(1, sizeof(*m));
+
+	if (m == NULL)
+		abort();
+	m->flags = PG_FICTITIOUS;
+	m->phys_addr = paddr;
+	return (m);
+}
+
+void
+vm_page_updatefake(vm_page_t m, vm_paddr_t paddr,
+    vm_memattr_t memattr __unused)
+{
+	m->phys_addr = paddr;
+}
+
+/* 'mold' is the placeholder from shim_mmap_fault(), nothing to free. */
+void
+vm_page_replace(vm_page_t mnew, vm_object_t object, vm_pindex_t pindex,
+    vm_page_t mold __unused)
+{
+	vm_pindex_t n;
+
+	if (pindex >= object->npages) {
+		n = pindex + 1;
+		object->pages = realloc(object->pages,
+		    n * sizeof(object->pages[0]));
+		if (object->pages == NULL)
+			abort();
+		memset(object->pages + object->npages, 0,
+		    (n - object->npages) * sizeof(object->pages[0]));
+		object->npages = n;
+	}
+	mnew->pindex = pindex;
+	object->pages[pindex] = mnew;
+}
+
+void
+vm_page_valid(vm_page_t m)
+{
+	m->valid = 1;
+}
+
+int
+shim_mmap(struct shim_file *fp, off_t offset, size_t size, int prot,
+    struct vm_object **objp)
+{
+	vm_ooffset_t off = offset;
+	struct cdev *dev;
+	int error;
+
+	error = dev_enter(fp, &dev);
+	if (error != 0)
+		return (error);
+	error = dev->si_devsw->d_mmap_single != NULL ?
+	    dev->si_devsw->d_mmap_single(dev, &off, size, objp, prot) :
+	    ENODEV;
+	dev_leave(dev);
+
+	return (error);
+}
+
+void *
+shim_mmap_fault(struct vm_object *obj, off_t offset)
+{
+	struct vm_page placeholder;
+	vm_pindex_t pidx = OFF_TO_IDX(offset);
+	vm_page_t m;
+	void *addr = NULL;
+
+	VM_OBJECT_WLOCK(obj);
+	if (pidx < obj->npages && obj->pages[pidx] != NULL) {
+		m = obj->pages[pidx];
+	} else {
+		memset(&placeholder, 0, sizeof(placeholder));
+		placeholder.pindex = pidx;
+		m = &placeholder;
+	}
+	if (obj->un_pager_ops->cdev_pg_fault(obj, offset & ~PAGE_MASK,
+	    VM_PROT_READ, &m) == VM_PAGER_OK)
+		addr = (void *)(uintptr_t)m->phys_addr;
+	VM_OBJECT_WUNLOCK(obj);
+
+	return (addr);
+}
+
+void
+shim_munmap(struct vm_object *obj)
+{
+	struct vm_object **op;
+	vm_pindex_t i;
+
+	pthread_mutex_lock(&object_mtx);
+	if (--obj->ref_count > 0) {
+		pthread_mutex_unlock(&object_mtx);
+		return;
+	}
+	for (op = &objects; *op != obj; op = &(*op)->next)
+		;
+	*op = obj->next;
+	pthread_mutex_unlock(&object_mtx);
+
+	obj->un_pager_ops->cdev_pg_dtor(obj->handle);
+	for (i = 0; i < obj->npages; i++)
+		free(obj->pages[i]);
+	free(obj->pages);
+	mtx_destroy(&obj->lock);
+	free(obj);
+}
+
+/*
+ * sysctl(9). Oids live on one list and are found by their dotted name.
+ * Handlers run under a read lock, adding and removing oids takes it
+ * exclusive.
+ */
+struct sysctl_oid sysctl__hw = { .oid_name = "hw", .oid_kind = CTLTYPE_NODE };
+struct sysctl_oid sysctl__kern = { .oid_name = "kern",
+    .oid_kind = CTLTYPE_NODE };
+struct sysctl_oid sysctl__debug = { .oid_name = "debug",
+    .oid_kind = CTLTYPE_NODE };
+
+static pthread_rwlock_t sysctl_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct sysctl_oid *sysctl_oids;
+
+static void
+sysctl_unregister(struct sysctl_oid *oidp)
+{
+	struct sysctl_oid **op;
+
+	for (op = &sysctl_oids; *op != NULL; op = &(*op)->oid_next) {
+		if (*op == oidp) {
+			*op = oidp->oid_next;
+			break;
+		}
+	}
+}
+
+void
+shim_sysctl_register(struct sysctl_oid *oidp)
+{
+	pthread_rwlock_wrlock(&sysctl_lock);
+	oidp->oid_next = sysctl_oids;
+	sysctl_oids = oidp;
+	pthread_rwlock_unlock(&sysctl_lock);
+}
+
+int
+sysctl_ctx_init(struct sysctl_ctx_list *clist)
+{
+	clist->first = NULL;
+	return (0);
+}
+
+/* Newest first, so children go before their parents. */
+int
+sysctl_ctx_free(struct sysctl_ctx_list *clist)
+{
+	struct sysctl_oid *oidp;
+
+	pthread_rwlock_wrlock(&sysctl_lock);
+	while ((oidp = clist->first) != NULL) {
+		clist->first = oidp->oid_ctx_next;
+		sysctl_unregister(oidp);
+		free(oidp->oid_dynname);
+		free(oidp);
+	}
+	pthread_rwlock_unlock(&sysctl_lock);
+
+	return (0);
+}
+
+struct sysctl_oid *
+shim_sysctl_add(struct sysctl_ctx_list *clist, struct sysctl_oid_list *parent,
+    const char *name, u_int kind, void *arg1, intmax_t arg2,
+    sysctl_handler_t *handler)
+{
+	struct sysctl_oid *oidp = calloc(1, sizeof(*oidp));
+
+	if (oidp == NULL || (oidp->oid_dynname = strdup(name)) == NULL)
+		abort();
+	oidp->oid_parent = (struct sysctl_oid *)parent;
+	oidp->oid_name = oidp->oid_dynname;
+	oidp->oid_kind = kind;
+	oidp->oid_arg1 = arg1;
+	oidp->oid_arg2 = arg2;
+	oidp->oid_handler = handler;
+	shim_sysctl_register(oidp);
+	if (clist != NULL) {
+		pthread_rwlock_wrlock(&sysctl_lock);
+		oidp->oid_ctx_next = clist->first;
+		clist->first = oidp;
+		pthread_rwlock_unlock(&sysctl_lock);
+	}
+
+	return (oidp);
+}
+
+/* Whether 'name' ends with the full dotted name of 'oidp'. */
+static const char *
+sysctl_match(struct sysctl_oid *oidp, const char *name, size_t len)
+{
+	size_t n = strlen(oidp->oid_name);
+	const char *p;
+
+	if (len < n || strncmp(name + len - n, oidp->oid_name, n) != 0)
+		return (NULL);
+	if (oidp->oid_parent == NULL)
+		return (len == n ? name : NULL);
+	if (len == n || name[len - n - 1] != '.')
+		return (NULL);
+	p = sysctl_match(oidp->oid_parent, name, len - n - 1);
+	return (p);
+}
+
+static struct sysctl_oid *
+sysctl_find(const char *name)
+{
+	struct sysctl_oid *oidp;
+
+	for (oidp = sysctl_oids; oidp != NULL; oidp = oidp->oid_next)
+		if (sysctl_match(oidp, name, strlen(name)) != NULL)
+			return (oidp);
+	return (NULL);
+}
+
+int
+shim_sysctl(const char *name, void *oldp, size_t *oldlenp, const void *newp,
+    size_t newlen)
+{
+	struct sysctl_req req;
+	struct sysctl_oid *oidp;
+	int error;
+
+	pthread_rwlock_rdlock(&sysctl_lock);
+	oidp = sysctl_find(name);
+	if (oidp == NULL || oidp->oid_handler == NULL) {
+		error = ENOENT;
+		goto out;
+	}
+	if (newp != NULL && !(oidp->oid_kind & CTLFLAG_WR)) {
+		error = EPERM;
+		goto out;
+	}
+	memset(&req, 0, sizeof(req));
+	req.oldptr = oldp;
+	req.oldlen = oldlenp != NULL ? *oldlenp : 0;
+	req.newptr = newp;
+	req.newlen = newlen;
+	error = oidp->oid_handler(oidp, oidp->oid_arg1, oidp->oid_arg2, &req);
+	if (oldlenp != NULL)
+		*oldlenp = req.oldidx;
+out:
+	pthread_rwlock_unlock(&sysctl_lock);
+
+	return (error);
+}
+
+int
+shim_tunable_int(const char *name, int value)
+{
+	struct sysctl_oid *oidp;
+	int error = 0;
+
+	pthread_rwlock_rdlock(&sysctl_lock);
+	oidp = sysctl_find(name);
+	if (oidp == NULL || (oidp->oid_kind & CTLTYPE_MASK) != CTLTYPE_INT ||
+	    !(oidp->oid_kind & CTLFLAG_TUN) || oidp->oid_arg1 == NULL)
+		error = ENOENT;
+	else
+		*(int *)oidp->oid_arg1 = value;
+	pthread_rwlock_unlock(&sysctl_lock);
+
+	return (error);
+}
+
+int
+shim_sysctl_out(struct sysctl_req *req, const void *p, size_t l)
+{
+	int error = 0;
+
+	if (req->oldptr != NULL) {
+		if (req->oldidx + l > req->oldlen)
+			error = ENOMEM;
+		else
+			memcpy((char *)req->oldptr + req->oldidx, p, l);
+	}
+	req->oldidx += l;
+
+	return (error);
+}
+
+int
+shim_sysctl_in(struct sysctl_req *req, void *p, size_t l)
+{
+	if (req->newptr == NULL)
+		return (0);
+	if (req->newlen - req->newidx < l)
+		return (EINVAL);
+	memcpy(p, (const char *)req->newptr + req->newidx, l);
+	req->newidx += l;
+
+	return (0);
+}
+
+int
+sysctl_handle_int(SYSCTL_HANDLER_ARGS)
+{
+	int tmp, error;
+
+	tmp = arg1 != NULL ? *(int *)arg1 : (int)arg2;
+	error = SYSCTL_OUT(req, &tmp, sizeof(tmp));
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+	if (arg1 == NULL)
+		return (EPERM);
+
+	return (SYSCTL_IN(req, arg1, sizeof(int)));
+}
+
+int
+sysctl_handle_counter_u64(SYSCTL_HANDLER_ARGS)
+{
+	uint64_t out;
+	int error;
+
+	out = counter_u64_fetch(*(counter_u64_t *)arg1);
+	error = SYSCTL_OUT(req, &out, sizeof(out));
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+	error = SYSCTL_IN(req, &out, sizeof(out));
+	if (error == 0)
+		counter_u64_zero(*(counter_u64_t *)arg1);
+
+	return (error);
+}
+
+int
+sysctl_handle_counter_u64_array(SYSCTL_HANDLER_ARGS)
+{
+	uint64_t out;
+	int error = 0, i;
+
+	for (i = 0; i < arg2 && error == 0; i++) {
+		out = counter_u64_fetch(((counter_u64_t *)arg1)[i]);
+		error = SYSCTL_OUT(req, &out, sizeof(out));
+	}
+	return (error);
+}
+
+int
+sysctl_handle_opaque(SYSCTL_HANDLER_ARGS)
+{
+	int error;
+
+	error = SYSCTL_OUT(req, arg1, arg2);
+	if (error != 0 || req->newptr == NULL)
+		return (error);
+
+	return (SYSCTL_IN(req, arg1, arg2));
+}
+
+int
+sysctl_handle_uma_zone_cur(SYSCTL_HANDLER_ARGS)
+{
+	int cur;
+
+	cur = uma_zone_get_cur(*(uma_zone_t *)arg1);
+	return (SYSCTL_OUT(req, &cur, sizeof(cur)));
+}
+
+/* Module loader. */
+int
+shim_module_event(struct shim_module *mod, int event)
+{
+	return (mod->evhand(mod, event, mod->arg));
+}
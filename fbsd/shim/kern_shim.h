@@ -0,0 +1,659 @@
+#pragma once
+
+/*
+ * Just enough of the FreeBSD kernel API, on top of libc and pthreads,
+ * to compile the fbsd/ drivers unchanged as ordinary userland code.
+ * The headers under sys/, machine/ and vm/ in this directory all
+ * include this one; put the directory first on the include path and
+ * build with -D_KERNEL -D_GNU_SOURCE. Headers that Linux already has
+ * (sys/param.h, sys/uio.h, sys/time.h, sys/poll.h, ...) are the libc
+ * ones, the missing kernel bits of them are defined here.
+ *
+ * The harness side, which plays the part of devfs and the VM system,
+ * is in shim.h. It must not include this file: malloc() and free()
+ * take the kernel arguments here.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shim.h"
+
+#ifndef __unused
+#define	__unused	__attribute__((__unused__))
+#endif
+#ifndef __containerof
+#define	__containerof(x, s, m)						\
+	((s *)(void *)((char *)(x) - offsetof(s, m)))
+#endif
+
+/* machine/param.h */
+#define	PAGE_SHIFT	12
+#define	PAGE_SIZE	(1 << PAGE_SHIFT)
+#define	PAGE_MASK	(PAGE_SIZE - 1)
+#define	ptoa(x)		((vm_paddr_t)(x) << PAGE_SHIFT)
+#define	atop(x)		((vm_paddr_t)(x) >> PAGE_SHIFT)
+#define	OFF_TO_IDX(off)	((vm_pindex_t)(((vm_ooffset_t)(off)) >> PAGE_SHIFT))
+
+static __inline int
+fls(int mask)
+{
+	return (mask == 0 ? 0 : 32 - __builtin_clz((unsigned int)mask));
+}
+
+/* sys/module.h */
+typedef void *module_t;
+typedef int (*modeventhand_t)(module_t, int, void *);
+
+struct shim_module {
+	const char	*name;
+	modeventhand_t	evhand;
+	void		*arg;
+};
+
+/* The harness finds the module as shim_module_<name>. */
+#define	DEV_MODULE(name, evh, arg)					\
+	struct shim_module shim_module_##name = { #name, evh, arg }
+#define	MODULE_VERSION(name, version)
+
+/* sys/systm.h */
+int	uprintf(const char *fmt, ...) __attribute__((__format__(__printf__, 1, 2)));
+int	copyin(const void *uaddr, void *kaddr, size_t len);
+int	copyout(const void *kaddr, void *uaddr, size_t len);
+
+#define	KASSERT(exp, msg) do {						\
+	if (!(exp)) {							\
+		printf msg;						\
+		abort();						\
+	}								\
+} while (0)
+
+/* sys/malloc.h */
+#define	M_NOWAIT	0x0001
+#define	M_WAITOK	0x0002
+#define	M_ZERO		0x0100
+
+struct malloc_type {
+	const char	*ks_shortdesc;
+	long		ks_inuse;	/* live allocations */
+	struct malloc_type *ks_next;
+};
+
+void	shim_malloc_register(struct malloc_type *mtp);
+void	*shim_malloc(size_t size, struct malloc_type *mtp, int flags);
+void	*shim_mallocarray(size_t nmemb, size_t size, struct malloc_type *mtp,
+	    int flags);
+void	shim_free(void *addr, struct malloc_type *mtp);
+
+#define	MALLOC_DEFINE(type, shortdesc, longdesc)			\
+	struct malloc_type type[1] = { { shortdesc, 0, NULL } };	\
+	static void __attribute__((__constructor__))			\
+	type##_register(void)						\
+	{								\
+		shim_malloc_register(type);				\
+	}
+#define	MALLOC_DECLARE(type)	extern struct malloc_type type[1]
+
+#define	malloc(size, type, flags)	shim_malloc(size, type, flags)
+#define	mallocarray(nmemb, size, type, flags)				\
+	shim_mallocarray(nmemb, size, type, flags)
+#define	free(addr, type)		shim_free(addr, type)
+
+/* sys/lock.h, sys/mutex.h, sys/sx.h */
+#define	MTX_DEF		0x0000
+#define	MTX_SPIN	0x0001
+#define	MA_OWNED	0x0004
+#define	SA_XLOCKED	0x0004
+
+struct mtx {
+	pthread_mutex_t	mtx_lock;
+	const char	*mtx_name;
+};
+
+struct sx {
+	pthread_rwlock_t sx_lock;
+	const char	*sx_name;
+};
+
+void	mtx_init(struct mtx *m, const char *name, const char *type, int opts);
+void	mtx_destroy(struct mtx *m);
+void	mtx_lock(struct mtx *m);
+void	mtx_unlock(struct mtx *m);
+#define	mtx_assert(m, what)
+
+void	sx_init(struct sx *sx, const char *description);
+void	sx_destroy(struct sx *sx);
+void	sx_xlock(struct sx *sx);
+int	sx_xlock_sig(struct sx *sx);
+int	sx_try_xlock(struct sx *sx);
+void	sx_xunlock(struct sx *sx);
+void	sx_slock(struct sx *sx);
+void	sx_sunlock(struct sx *sx);
+#define	sx_assert(sx, what)
+
+/* sleep(9), wakeup(9) */
+#define	PCATCH		0x00000100
+
+int	mtx_sleep(const void *chan, struct mtx *m, int priority,
+	    const char *wmesg, int timo);
+void	wakeup(const void *chan);
+void	wakeup_one(const void *chan);
+
+/* machine/atomic.h */
+#define	atomic_load_int(p)	__atomic_load_n((p), __ATOMIC_RELAXED)
+#define	atomic_store_int(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define	atomic_load_acq_int(p)	__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define	atomic_store_rel_int(p, v)					\
+	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define	atomic_load_acq_ptr(p)	__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define	atomic_store_rel_ptr(p, v)					\
+	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define	atomic_add_int(p, v)						\
+	((void)__atomic_fetch_add((p), (v), __ATOMIC_RELAXED))
+#define	atomic_subtract_int(p, v)					\
+	((void)__atomic_fetch_sub((p), (v), __ATOMIC_RELAXED))
+#define	atomic_fetchadd_int(p, v)					\
+	__atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#define	atomic_thread_fence_acq()	__atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define	atomic_thread_fence_rel()	__atomic_thread_fence(__ATOMIC_RELEASE)
+#define	atomic_thread_fence_seq_cst()	__atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/* sys/counter.h */
+typedef uint64_t *counter_u64_t;
+
+counter_u64_t	counter_u64_alloc(int flags);
+void		counter_u64_free(counter_u64_t c);
+uint64_t	counter_u64_fetch(counter_u64_t c);
+void		counter_u64_zero(counter_u64_t c);
+
+#define	counter_u64_add(c, v)						\
+	((void)__atomic_fetch_add((c), (v), __ATOMIC_RELAXED))
+
+#define	COUNTER_ARRAY_ALLOC(a, n, wait) do {				\
+	for (int _i = 0; _i < (n); _i++)				\
+		(a)[_i] = counter_u64_alloc(wait);			\
+} while (0)
+#define	COUNTER_ARRAY_FREE(a, n) do {					\
+	for (int _i = 0; _i < (n); _i++)				\
+		counter_u64_free((a)[_i]);				\
+} while (0)
+
+/* sys/time.h */
+typedef int64_t sbintime_t;
+
+#define	SBT_1S	((sbintime_t)1 << 32)
+#define	SBT_1MS	(SBT_1S / 1000)
+#define	SBT_1US	(SBT_1S / 1000000)
+
+sbintime_t	sbinuptime(void);
+
+static __inline int64_t
+sbttous(sbintime_t sbt)
+{
+	return ((sbt >> 32) * 1000000 +
+	    (((sbt & 0xffffffff) * 1000000) >> 32));
+}
+
+/* sys/proc.h */
+struct ucred {
+	uid_t	cr_uid;
+};
+
+struct thread {
+	struct ucred	*td_ucred;
+};
+
+struct thread	*shim_curthread(void);
+#define	curthread	(shim_curthread())
+
+/* sys/uio.h */
+enum uio_rw { UIO_READ, UIO_WRITE };
+enum uio_seg { UIO_USERSPACE, UIO_SYSSPACE };
+
+struct uio {
+	struct iovec	*uio_iov;
+	int		uio_iovcnt;
+	off_t		uio_offset;
+	ssize_t		uio_resid;
+	enum uio_seg	uio_segflg;
+	enum uio_rw	uio_rw;
+	struct thread	*uio_td;
+};
+
+int	uiomove(void *cp, int n, struct uio *uio);
+
+/* sys/vnode.h ioflag */
+#define	IO_UNIT		0x0001
+#define	IO_APPEND	0x0002
+#define	IO_NDELAY	0x0004
+
+/* sys/event.h, EVFILT_* and EV_EOF are in shim.h */
+
+struct filterops {
+	int	f_isfd;
+	int	(*f_attach)(struct knote *kn);
+	void	(*f_detach)(struct knote *kn);
+	int	(*f_event)(struct knote *kn, long hint);
+};
+
+struct knlist {
+	struct knote	*kl_list;
+	struct mtx	*kl_lock;
+};
+
+struct knote {
+	short		kn_filter;
+	u_short		kn_flags;
+	int64_t		kn_data;
+	void		*kn_hook;
+	struct filterops *kn_fop;
+	/* shim */
+	struct knote	*kn_next;
+	struct knlist	*kn_knlist;	/* NULL once detached */
+	int		kn_active;	/* f_event said ready */
+	struct shim_file *kn_fp;
+	struct knote	*kn_fpnext;	/* knotes of kn_fp */
+};
+
+void	knlist_init_mtx(struct knlist *knl, struct mtx *lock);
+void	knlist_add(struct knlist *knl, struct knote *kn, int islocked);
+void	knlist_remove(struct knlist *knl, struct knote *kn, int islocked);
+void	knlist_clear(struct knlist *knl, int islocked);
+void	knlist_destroy(struct knlist *knl);
+void	knote(struct knlist *knl, long hint, int lockflags);
+#define	KNOTE_LOCKED(list, hint)	knote(list, hint, 1)
+#define	KNOTE_UNLOCKED(list, hint)	knote(list, hint, 0)
+
+/* sys/selinfo.h */
+struct selinfo {
+	struct knlist	si_note;
+	int		si_waiting;	/* selrecord() since the last wakeup */
+};
+
+void	selrecord(struct thread *td, struct selinfo *sip);
+void	selwakeup(struct selinfo *sip);
+void	seldrain(struct selinfo *sip);
+
+/* sys/conf.h */
+#define	D_VERSION	0x17122009
+#define	UID_ROOT	0
+#define	GID_WHEEL	0
+#define	SPECNAMELEN	255
+
+#define	MAKEDEV_WAITOK	0x10
+#define	MAKEDEV_CHECKNAME	0x20
+
+struct cdev;
+struct cdevsw;
+struct vm_object;
+typedef int64_t vm_ooffset_t;
+typedef uintptr_t vm_size_t;
+
+typedef int d_open_t(struct cdev *dev, int oflags, int devtype,
+    struct thread *td);
+typedef int d_close_t(struct cdev *dev, int fflag, int devtype,
+    struct thread *td);
+typedef int d_read_t(struct cdev *dev, struct uio *uio, int ioflag);
+typedef int d_write_t(struct cdev *dev, struct uio *uio, int ioflag);
+typedef int d_ioctl_t(struct cdev *dev, u_long cmd, caddr_t data,
+    int fflag, struct thread *td);
+typedef int d_poll_t(struct cdev *dev, int events, struct thread *td);
+typedef int d_kqfilter_t(struct cdev *dev, struct knote *kn);
+typedef int d_mmap_single_t(struct cdev *cdev, vm_ooffset_t *offset,
+    vm_size_t size, struct vm_object **object, int nprot);
+typedef void d_priv_dtor_t(void *data);
+
+struct cdevsw {
+	int		d_version;
+	u_int		d_flags;
+	const char	*d_name;
+	d_open_t	*d_open;
+	d_close_t	*d_close;
+	d_read_t	*d_read;
+	d_write_t	*d_write;
+	d_ioctl_t	*d_ioctl;
+	d_poll_t	*d_poll;
+	d_mmap_single_t	*d_mmap_single;
+	d_kqfilter_t	*d_kqfilter;
+};
+
+struct cdev {
+	void		*si_drv1;
+	void		*si_drv2;
+	struct cdevsw	*si_devsw;
+	char		si_name[SPECNAMELEN + 1];
+	/* shim */
+	struct cdev	*si_parent;	/* aliases: the real device */
+	struct cdev	*si_next;
+	int		si_threadcount;	/* calls in the driver */
+	int		si_gone;	/* destroy_dev() started */
+};
+
+struct cdev	*make_dev(struct cdevsw *devsw, int unit, uid_t uid, gid_t gid,
+		    int perms, const char *fmt, ...)
+		    __attribute__((__format__(__printf__, 6, 7)));
+struct make_dev_args {
+	size_t		mda_size;
+	int		mda_flags;
+	struct cdevsw	*mda_devsw;
+	struct ucred	*mda_cr;
+	uid_t		mda_uid;
+	gid_t		mda_gid;
+	int		mda_mode;
+	int		mda_unit;
+	void		*mda_si_drv1;
+	void		*mda_si_drv2;
+};
+
+void		make_dev_args_init(struct make_dev_args *args);
+int		make_dev_s(struct make_dev_args *args, struct cdev **cdev,
+		    const char *fmt, ...)
+		    __attribute__((__format__(__printf__, 3, 4)));
+struct cdev	*make_dev_alias(struct cdev *pdev, const char *fmt, ...)
+		    __attribute__((__format__(__printf__, 2, 3)));
+void		destroy_dev(struct cdev *dev);
+int		devfs_set_cdevpriv(void *priv, d_priv_dtor_t *dtr);
+int		devfs_get_cdevpriv(void **datap);
+
+/* sys/sysctl.h */
+#define	CTLTYPE_NODE	1
+#define	CTLTYPE_INT	2
+#define	CTLTYPE_U64	3
+#define	CTLTYPE_OPAQUE	5
+#define	CTLTYPE_MASK	0xf
+#define	CTLFLAG_RD	0x80000000
+#define	CTLFLAG_WR	0x40000000
+#define	CTLFLAG_RW	(CTLFLAG_RD | CTLFLAG_WR)
+#define	CTLFLAG_TUN	0x00080000
+#define	CTLFLAG_RDTUN	(CTLFLAG_RD | CTLFLAG_TUN)
+#define	CTLFLAG_RWTUN	(CTLFLAG_RW | CTLFLAG_TUN)
+#define	CTLFLAG_MPSAFE	0x00040000
+#define	OID_AUTO	(-1)
+
+struct sysctl_req {
+	void		*oldptr;
+	size_t		oldlen;
+	size_t		oldidx;
+	const void	*newptr;
+	size_t		newlen;
+	size_t		newidx;
+};
+
+struct sysctl_oid;
+
+#define	SYSCTL_HANDLER_ARGS						\
+	struct sysctl_oid *oidp, void *arg1, intmax_t arg2,		\
+	struct sysctl_req *req
+
+typedef int sysctl_handler_t(SYSCTL_HANDLER_ARGS);
+
+/* A node's children are named by the node itself. */
+struct sysctl_oid_list {
+	int		unused;
+};
+
+struct sysctl_oid {
+	struct sysctl_oid_list oid_children;	/* must be first */
+	struct sysctl_oid *oid_parent;
+	const char	*oid_name;
+	u_int		oid_kind;
+	void		*oid_arg1;
+	intmax_t	oid_arg2;
+	sysctl_handler_t *oid_handler;
+	struct sysctl_oid *oid_next;		/* all registered oids */
+	struct sysctl_oid *oid_ctx_next;	/* dynamic oids of a context */
+	char		*oid_dynname;
+};
+
+struct sysctl_ctx_list {
+	struct sysctl_oid *first;
+};
+
+extern struct sysctl_oid sysctl__hw;
+extern struct sysctl_oid sysctl__kern;
+extern struct sysctl_oid sysctl__debug;
+
+int	sysctl_handle_int(SYSCTL_HANDLER_ARGS);
+int	sysctl_handle_counter_u64(SYSCTL_HANDLER_ARGS);
+int	sysctl_handle_counter_u64_array(SYSCTL_HANDLER_ARGS);
+int	sysctl_handle_opaque(SYSCTL_HANDLER_ARGS);
+int	sysctl_handle_uma_zone_cur(SYSCTL_HANDLER_ARGS);
+int	shim_sysctl_out(struct sysctl_req *req, const void *p, size_t l);
+int	shim_sysctl_in(struct sysctl_req *req, void *p, size_t l);
+#define	SYSCTL_OUT(req, p, l)	shim_sysctl_out(req, p, l)
+#define	SYSCTL_IN(req, p, l)	shim_sysctl_in(req, p, l)
+
+void	shim_sysctl_register(struct sysctl_oid *oidp);
+int	sysctl_ctx_init(struct sysctl_ctx_list *clist);
+int	sysctl_ctx_free(struct sysctl_ctx_list *clist);
+struct sysctl_oid *shim_sysctl_add(struct sysctl_ctx_list *clist,
+	    struct sysctl_oid_list *parent, const char *name, u_int kind,
+	    void *arg1, intmax_t arg2, sysctl_handler_t *handler);
+
+#define	SYSCTL_CHILDREN(oidp)	(&(oidp)->oid_children)
+#define	SYSCTL_STATIC_CHILDREN(oid_name)				\
+	(&sysctl_##oid_name.oid_children)
+
+/* Static oids register themselves when the program starts. */
+#define	SHIM_SYSCTL_OID(parent, name, kind, a1, a2, handler)		\
+	struct sysctl_oid sysctl_##parent##_##name = {			\
+		.oid_parent = &sysctl_##parent,				\
+		.oid_name = #name,					\
+		.oid_kind = (kind),					\
+		.oid_arg1 = (a1),					\
+		.oid_arg2 = (a2),					\
+		.oid_handler = (handler),				\
+	};								\
+	static void __attribute__((__constructor__))			\
+	sysctl_##parent##_##name##_register(void)			\
+	{								\
+		shim_sysctl_register(&sysctl_##parent##_##name);	\
+	}
+
+#define	SYSCTL_NODE(parent, nbr, name, access, handler, descr)		\
+	SHIM_SYSCTL_OID(parent, name, CTLTYPE_NODE | (access), NULL, 0,	\
+	    NULL)
+#define	SYSCTL_INT(parent, nbr, name, access, ptr, val, descr)		\
+	SHIM_SYSCTL_OID(parent, name, CTLTYPE_INT | (access), ptr, val,	\
+	    sysctl_handle_int)
+#define	SYSCTL_PROC(parent, nbr, name, access, ptr, arg, handler, fmt,	\
+	    descr)							\
+	SHIM_SYSCTL_OID(parent, name, access, ptr, arg, handler)
+#define	SYSCTL_COUNTER_U64(parent, nbr, name, access, ptr, descr)	\
+	SHIM_SYSCTL_OID(parent, name, CTLTYPE_U64 | (access), ptr, 0,	\
+	    sysctl_handle_counter_u64)
+#define	SYSCTL_COUNTER_U64_ARRAY(parent, nbr, name, access, ptr, len,	\
+	    descr)							\
+	SHIM_SYSCTL_OID(parent, name, CTLTYPE_OPAQUE | (access), ptr,	\
+	    len, sysctl_handle_counter_u64_array)
+
+#define	SYSCTL_UMA_CUR(parent, nbr, name, access, ptr, descr)		\
+	SHIM_SYSCTL_OID(parent, name, CTLTYPE_INT | (access), ptr, 0,	\
+	    sysctl_handle_uma_zone_cur)
+
+#define	SYSCTL_ADD_NODE(ctx, parent, nbr, name, access, handler, descr)	\
+	shim_sysctl_add(ctx, parent, name, CTLTYPE_NODE | (access),	\
+	    NULL, 0, handler)
+#define	SYSCTL_ADD_INT(ctx, parent, nbr, name, access, ptr, val, descr)	\
+	shim_sysctl_add(ctx, parent, name, CTLTYPE_INT | (access),	\
+	    ptr, val, sysctl_handle_int)
+#define	SYSCTL_ADD_PROC(ctx, parent, nbr, name, access, ptr, arg,	\
+	    handler, fmt, descr)					\
+	shim_sysctl_add(ctx, parent, name, access, ptr, arg, handler)
+#define	SYSCTL_ADD_COUNTER_U64(ctx, parent, nbr, name, access, ptr,	\
+	    descr)							\
+	shim_sysctl_add(ctx, parent, name, CTLTYPE_U64 | (access),	\
+	    ptr, 0, sysctl_handle_counter_u64)
+#define	SYSCTL_ADD_COUNTER_U64_ARRAY(ctx, parent, nbr, name, access,	\
+	    ptr, len, descr)						\
+	shim_sysctl_add(ctx, parent, name, CTLTYPE_OPAQUE | (access),	\
+	    ptr, len, sysctl_handle_counter_u64_array)
+
+/* sys/bitstring.h */
+typedef unsigned long bitstr_t;
+
+#define	_BITSTR_BITS		(sizeof(bitstr_t) * 8)
+#define	_bit_idx(bit)		((bit) / _BITSTR_BITS)
+#define	_bit_mask(bit)		(1UL << ((bit) % _BITSTR_BITS))
+#define	bitstr_size(nbits)	(howmany((nbits), _BITSTR_BITS) * sizeof(bitstr_t))
+#define	bit_alloc(nbits, type, flags)					\
+	((bitstr_t *)shim_malloc(bitstr_size(nbits), type, (flags) | M_ZERO))
+
+static __inline int
+bit_test(const bitstr_t *b, int bit)
+{
+	return ((b[_bit_idx(bit)] & _bit_mask(bit)) != 0);
+}
+
+static __inline void
+bit_set(bitstr_t *b, int bit)
+{
+	b[_bit_idx(bit)] |= _bit_mask(bit);
+}
+
+static __inline void
+bit_clear(bitstr_t *b, int bit)
+{
+	b[_bit_idx(bit)] &= ~_bit_mask(bit);
+}
+
+/* First clear bit at or after 'start', or -1. */
+static __inline void
+bit_ffc_at(bitstr_t *b, int start, int nbits, int *result)
+{
+	bitstr_t w;
+	int i, bit;
+
+	*result = -1;
+	if (start >= nbits)
+		return;
+	i = _bit_idx(start);
+	w = ~b[i] & (~0UL << (start % _BITSTR_BITS));
+	for (;;) {
+		if (w != 0) {
+			bit = i * _BITSTR_BITS + __builtin_ctzl(w);
+			if (bit < nbits)
+				*result = bit;
+			return;
+		}
+		if (++i >= (int)howmany(nbits, _BITSTR_BITS))
+			return;
+		w = ~b[i];
+	}
+}
+
+/*
+ * sys/epoch.h. A section is a read hold of the epoch's rwlock, a grace
+ * period a write acquire and release. Callbacks are queued and run by
+ * a thread of the epoch after a grace period.
+ */
+#define	EPOCH_PREEMPT	0x1
+
+struct epoch_context {
+	void	*data[2];
+};
+typedef struct epoch_context *epoch_context_t;
+
+struct epoch_tracker {
+	int	et_dummy;
+};
+
+typedef struct epoch *epoch_t;
+
+epoch_t	epoch_alloc(const char *name, int flags);
+void	epoch_free(epoch_t epoch);
+void	epoch_enter_preempt(epoch_t epoch, struct epoch_tracker *et);
+void	epoch_exit_preempt(epoch_t epoch, struct epoch_tracker *et);
+void	epoch_wait_preempt(epoch_t epoch);
+void	epoch_call(epoch_t epoch, void (*callback)(epoch_context_t),
+	    epoch_context_t ctx);
+void	epoch_drain_callbacks(epoch_t epoch);
+
+/* vm/uma.h, a zone is malloc(9) with a type of its own. */
+#define	UMA_ALIGN_PTR	(sizeof(void *) - 1)
+
+typedef struct uma_zone *uma_zone_t;
+typedef int (*uma_ctor)(void *mem, int size, void *arg, int flags);
+typedef void (*uma_dtor)(void *mem, int size, void *arg);
+typedef int (*uma_init)(void *mem, int size, int flags);
+typedef void (*uma_fini)(void *mem, int size);
+
+uma_zone_t	uma_zcreate(const char *name, size_t size, uma_ctor ctor,
+		    uma_dtor dtor, uma_init uminit, uma_fini fini, int align,
+		    uint32_t flags);
+void		uma_zdestroy(uma_zone_t zone);
+void		*uma_zalloc(uma_zone_t zone, int flags);
+void		uma_zfree(uma_zone_t zone, void *item);
+int		uma_zone_get_cur(uma_zone_t zone);
+
+/* vm/vm.h, vm/vm_page.h, vm/vm_object.h, vm/vm_pager.h, vm/pmap.h */
+typedef u_char vm_prot_t;
+typedef uint64_t vm_paddr_t;
+typedef uint64_t vm_pindex_t;
+typedef int vm_memattr_t;
+
+#define	VM_PROT_NONE		0x00
+#define	VM_PROT_READ		0x01
+#define	VM_PROT_WRITE		0x02
+#define	VM_MEMATTR_DEFAULT	0
+#define	PG_FICTITIOUS		0x0004
+#define	VM_PAGER_OK		0
+#define	VM_PAGER_FAIL		2
+#define	OBJT_DEVICE		3
+
+struct vm_page {
+	vm_pindex_t	pindex;
+	vm_paddr_t	phys_addr;
+	int		flags;
+	int		valid;
+};
+typedef struct vm_page *vm_page_t;
+
+struct cdev_pager_ops {
+	int	(*cdev_pg_fault)(struct vm_object *vm_obj, vm_ooffset_t offset,
+		    int prot, vm_page_t *mres);
+	int	(*cdev_pg_ctor)(void *handle, vm_ooffset_t size,
+		    vm_prot_t prot, vm_ooffset_t foff, struct ucred *cred,
+		    u_short *color);
+	void	(*cdev_pg_dtor)(void *handle);
+};
+
+struct vm_object {
+	void		*handle;
+	struct cdev_pager_ops *un_pager_ops;
+	vm_ooffset_t	size;
+	int		ref_count;
+	struct mtx	lock;
+	vm_page_t	*pages;		/* fictitious pages, by pindex */
+	vm_pindex_t	npages;
+	struct vm_object *next;
+};
+typedef struct vm_object *vm_object_t;
+
+#define	VM_OBJECT_WLOCK(obj)	mtx_lock(&(obj)->lock)
+#define	VM_OBJECT_WUNLOCK(obj)	mtx_unlock(&(obj)->lock)
+
+/* The shim's "physical" addresses are the kernel virtual ones. */
+#define	vtophys(va)		((vm_paddr_t)(uintptr_t)(va))
+
+vm_object_t	cdev_pager_allocate(void *handle, int type,
+		    struct cdev_pager_ops *ops, vm_ooffset_t size,
+		    vm_prot_t prot, vm_ooffset_t foff, struct ucred *cred);
+vm_page_t	vm_page_getfake(vm_paddr_t paddr, vm_memattr_t memattr);
+void		vm_page_updatefake(vm_page_t m, vm_paddr_t paddr,
+		    vm_memattr_t memattr);
+void		vm_page_replace(vm_page_t mnew, vm_object_t object,
+		    vm_pindex_t pindex, vm_page_t mold);
+void		vm_page_valid(vm_page_t m);
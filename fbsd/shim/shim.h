@@ -0,0 +1,84 @@
+#pragma once
+
+/*
+ * The harness side of the kernel shim: what a test runner or benchmark
+ * calls to play the part of the module loader, devfs, the VM system
+ * and loader.conf. Safe to include next to libc's malloc() and free();
+ * kern_shim.h has the kernel API the drivers see.
+ *
+ * A shim_file is an open descriptor. It carries the descriptor flags,
+ * the file offset and the devfs_set_cdevpriv() data, which the driver
+ * sees as its own for the duration of each call.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct shim_module;
+struct shim_file;
+struct knote;
+struct vm_object;
+
+/* sys/module.h, sys/event.h: shared with kern_shim.h. */
+#define	MOD_LOAD	0
+#define	MOD_UNLOAD	1
+#define	MOD_SHUTDOWN	2
+#define	MOD_QUIESCE	3
+
+#define	EVFILT_READ	(-1)
+#define	EVFILT_WRITE	(-2)
+#define	EV_EOF		0x8000
+
+/*
+ * Module loader. Unlike kldload(8), a MOD_LOAD after MOD_UNLOAD finds
+ * the module's static data as the unload left it.
+ */
+int	shim_module_event(struct shim_module *mod, int event);
+#define	SHIM_MODULE(name)	(&shim_module_##name)
+#define	SHIM_MODULE_DECLARE(name)					\
+	extern struct shim_module shim_module_##name
+
+/* loader.conf: set a CTLFLAG_TUN integer before the module loads. */
+int	shim_tunable_int(const char *name, int value);
+
+/* sysctl(3) by name, on integer and opaque oids. */
+int	shim_sysctl(const char *name, void *oldp, size_t *oldlenp,
+	    const void *newp, size_t newlen);
+
+/* devfs: open(2), close(2) and the calls made on the descriptor. */
+int	shim_dev_exists(const char *name);
+int	shim_open(const char *name, int oflags, struct shim_file **fpp);
+void	shim_close(struct shim_file *fp);
+int	shim_read(struct shim_file *fp, void *buf, size_t len, size_t *done);
+int	shim_write(struct shim_file *fp, const void *buf, size_t len,
+	    size_t *done);
+int	shim_readv(struct shim_file *fp, const struct iovec *iov, int iovcnt,
+	    size_t *done);
+int	shim_writev(struct shim_file *fp, const struct iovec *iov, int iovcnt,
+	    size_t *done);
+off_t	shim_lseek(struct shim_file *fp, off_t offset);
+int	shim_ioctl(struct shim_file *fp, unsigned long cmd, void *data);
+int	shim_poll(struct shim_file *fp, int events);
+
+/* kqueue(2): one knote per call, polled by hand. */
+int	shim_kqueue_attach(struct shim_file *fp, int filter,
+	    struct knote **knp);
+int	shim_kqueue_ready(struct knote *kn, int64_t *data);
+int	shim_kqueue_fired(struct knote *kn);
+void	shim_kqueue_detach(struct knote *kn);
+
+/*
+ * mmap(2): the object from d_mmap_single() and its pages. A fault
+ * returns the kernel address backing the page, or NULL if the pager
+ * refused it.
+ */
+int	shim_mmap(struct shim_file *fp, off_t offset, size_t size, int prot,
+	    struct vm_object **objp);
+void	*shim_mmap_fault(struct vm_object *obj, off_t offset);
+void	shim_munmap(struct vm_object *obj);
+
+/* malloc(9) accounting, by type short description. */
+long	shim_malloc_inuse(const char *shortdesc);
+void	shim_malloc_fail_after(long n);
@@ -0,0 +1,2 @@
+/* FreeBSD has _IO() and friends here, Linux in sys/ioctl.h. */
+#include <sys/ioctl.h>
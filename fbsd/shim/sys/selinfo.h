@@ -0,0 +1 @@
+#include "../kern_shim.h"
@@ -6,122 +6,1054 @@
 #include <linux/fs.h>
 #include <linux/sched.h>
 #include <linux/uaccess.h>
+#include <linux/hashtable.h>
+#include <linux/log2.h>
+#include <linux/rculist.h>
+#include <linux/mutex.h>
+#include <linux/stringhash.h>
+#include <linux/refcount.h>
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/vmalloc.h>
+#include <linux/moduleparam.h>
+#include <linux/sizes.h>
+#include <linux/uio.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/seqlock.h>
+#include <linux/compat.h>
+
+#include "miscdrv_secret.h"
+
+#define CREATE_TRACE_POINTS
+#include "trace/events/miscdrv_secret.h"
 
 MODULE_AUTHOR("Niko Nastonen");
 MODULE_LICENSE("GPL");
 MODULE_VERSION("0.1");
 
-#define MAXBYTES 128
+#define MAXBYTES SECRET_VAL_MAX
+
+/* upper bound for the secret served by read()/write() and mmap() */
+static unsigned int max_size = SZ_4M;
+module_param(max_size, uint, 0444);
+MODULE_PARM_DESC(max_size, "largest secret accepted by write(), in bytes (default 4 MiB)");
+#define SECRET_MAX_SIZE_LIMIT SZ_256M   /* keeps PAGE_ALIGN(max_size) from wrapping */
+#define SECRET_HASH_BITS 8
+#define SECRET_LAT_BUCKETS 16   /* log2 buckets from < 1us to >= 16ms */
+
+/*
+ * Per-CPU statistics, the data path only ever touches its own CPU's copy.
+ * The debugfs 'stats' file sums them up on read.
+ */
+struct secret_stats {
+        u64_stats_t tx_bytes;
+        u64_stats_t rx_bytes;
+        u64_stats_t reads;
+        u64_stats_t writes;
+        u64_stats_t ioctls;
+        u64_stats_t errors;
+        u64_stats_t lat[SECRET_LAT_BUCKETS];
+        struct u64_stats_sync syncp;
+};
 
 /* driver context */
 static struct drv_ctx {
         struct device *dev;
-        int tx, rx, err, myword;
+        struct secret_stats __percpu *stats;
+        struct dentry *dbg;
+        int myword;
         u32 config1, config2;
         u64 config3;
-        char secret[MAXBYTES];
+        struct secret_blob __rcu *secret;
+        u64 gen;                        /* generation of the current secret */
+        wait_queue_head_t wq;           /* pollers waiting for a new secret */
+        struct secret_map_hdr *map;     /* vmalloc_user() area, header page + data, from the first mmap() */
+        struct mutex map_lock;          /* serializes updates of the mmap() area */
+        u64 map_gen;                    /* generation mirrored in the mmap() area */
+        struct mutex lock;      /* serializes updates of the secret and the keyed store */
+        seqcount_mutex_t kv_seq;        /* bumped around batched puts */
+        DECLARE_HASHTABLE(secrets, SECRET_HASH_BITS);
 } *ctx;
 
+/*
+ * One immutable version of the secret. Writers publish a new blob with
+ * rcu_assign_pointer(), readers pin the current one with a reference and
+ * copy out of it at leisure. Until it is published the blob is a
+ * writer's staging buffer, 'size' bytes of room for 'len' bytes of data.
+ */
+struct secret_blob {
+        struct rcu_head rcu;
+        refcount_t ref;
+        u32 len;
+        u32 size;
+        u64 gen;
+        char data[];
+};
+
+static struct kmem_cache *secret_blob_cache;
+
+/* a named secret, readers walk the hash buckets under RCU only */
+struct secret_entry {
+        struct hlist_node node;
+        struct rcu_head rcu;
+        u32 hash;
+        u32 len;
+        char key[SECRET_KEY_MAX];
+        char val[MAXBYTES];
+};
+
+/* per-open context, hung off filp->private_data */
+struct secret_file {
+        struct drv_ctx *ctx;
+        struct mutex lock;              /* protects snap and stage */
+        struct secret_blob *snap;       /* version being streamed by short reads, holds a reference */
+        loff_t end;                     /* length of the version read to the end, -1 if none */
+        struct secret_blob *stage;      /* written but not yet published, see secret_write_iter() */
+        u64 seen_gen;                   /* generation last handed to read() */
+};
+
 static int secret_open(struct inode *inode, struct file *filp)
 {
-        struct device *dev = ctx->dev;
-        char *buf = kzalloc(PATH_MAX, GFP_KERNEL);
+        struct secret_file *sf;
 
-        if (unlikely(!buf))
+        /* %pD resolves the name only when this callsite is enabled */
+        dev_dbg(ctx->dev, "%s opening %pD, f_flags = 0x%x\n",
+                        current->comm, filp, filp->f_flags);
+        trace_secret_open(filp->f_flags);
+
+        sf = kzalloc(sizeof(*sf), GFP_KERNEL);
+        if (unlikely(!sf))
                 return -ENOMEM;
+        sf->ctx = ctx;
+        mutex_init(&sf->lock);
+        sf->end = -1;
+        filp->private_data = sf;
+
+        return 0;
+}
 
-        dev_info(dev, "opening %s now, f_flags = 0x%x\n",
-                        file_path(filp, buf, PATH_MAX), filp->f_flags);
-        kfree(buf);
+/* returns the latency in ns, for the tracepoints */
+static u64 secret_account(struct drv_ctx *ctx, int op, ssize_t ret, u64 t0)
+{
+        struct secret_stats *st = get_cpu_ptr(ctx->stats);
+        u64 ns = ktime_get_ns() - t0;
+
+        u64_stats_update_begin(&st->syncp);
+        switch (op) {
+        case SECRET_OP_READ:
+                u64_stats_inc(&st->reads);
+                if (ret > 0)
+                        u64_stats_add(&st->tx_bytes, ret);
+                break;
+        case SECRET_OP_WRITE:
+                u64_stats_inc(&st->writes);
+                if (ret > 0)
+                        u64_stats_add(&st->rx_bytes, ret);
+                break;
+        case SECRET_OP_IOCTL:
+                u64_stats_inc(&st->ioctls);
+                break;
+        }
+        if (ret < 0)
+                u64_stats_inc(&st->errors);
+        u64_stats_inc(&st->lat[min_t(int, fls64(ns >> 10), SECRET_LAT_BUCKETS - 1)]);
+        u64_stats_update_end(&st->syncp);
+        put_cpu_ptr(ctx->stats);
 
-        return nonseekable_open(inode, filp);
+        if (ret < 0)
+                trace_secret_error(op, ret, ns);
+        return ns;
 }
 
-static ssize_t secret_read(struct file *filp, char __user *ubuf, size_t count, loff_t *off)
+/* take a reference on the currently published secret, never blocks */
+static struct secret_blob *secret_blob_get(struct drv_ctx *ctx)
 {
-        int ret = count;
-        int secret_len = strnlen(ctx->secret, MAXBYTES);
-        struct device *dev = ctx->dev;
-        char tasknm[TASK_COMM_LEN];
+        struct secret_blob *b;
 
-        dev_info(dev, "%s wants to read (upto) %zu bytes\n", get_task_comm(tasknm, current), count);
+        rcu_read_lock();
+        do {
+                b = rcu_dereference(ctx->secret);
+        } while (b && !refcount_inc_not_zero(&b->ref));
+        rcu_read_unlock();
 
-        ret = -EINVAL;
-        if (count < MAXBYTES) {
-                dev_warn(dev, "request # of bytes (%zu) is < required size (%d), aborting read\n",
-                                count, MAXBYTES);
-                goto out_notok;
+        return b;
+}
+
+static void secret_blob_free(struct secret_blob *b)
+{
+        if (b->size <= MAXBYTES)
+                kmem_cache_free(secret_blob_cache, b);
+        else
+                kvfree(b);
+}
+
+static void secret_blob_free_rcu(struct rcu_head *head)
+{
+        secret_blob_free(container_of(head, struct secret_blob, rcu));
+}
+
+static void secret_blob_put(struct secret_blob *b)
+{
+        /* lockless readers may still be looking at it, free after a grace period */
+        if (refcount_dec_and_test(&b->ref))
+                call_rcu(&b->rcu, secret_blob_free_rcu);
+}
+
+/*
+ * Small secrets, the common case, come from a dedicated cache so a write
+ * doesn't go through the generic allocator; only large ones use kvmalloc().
+ * Any user can write, so the memory is charged to the writer's cgroup.
+ */
+static struct secret_blob *secret_blob_alloc(size_t len)
+{
+        struct secret_blob *b;
+
+        if (len <= MAXBYTES)
+                b = kmem_cache_alloc(secret_blob_cache, GFP_KERNEL_ACCOUNT);
+        else
+                b = kvmalloc(struct_size(b, data, len), GFP_KERNEL_ACCOUNT);
+        if (unlikely(!b))
+                return NULL;
+        refcount_set(&b->ref, 1);
+        b->len = len;
+        b->size = max_t(size_t, len, MAXBYTES);
+
+        return b;
+}
+
+/*
+ * mirror 'b' into the mmap()able area, see struct secret_map_hdr for the
+ * protocol; the tail of a longer previous secret is wiped, not left behind
+ */
+static void secret_map_update(struct drv_ctx *ctx, struct secret_blob *b)
+{
+        struct secret_map_hdr *hdr = ctx->map;
+        char *data = (char *)hdr + hdr->data_off;
+        size_t old_len = hdr->len;
+
+        lockdep_assert_held(&ctx->map_lock);
+
+        WRITE_ONCE(hdr->seq, hdr->seq + 1);
+        smp_wmb();
+        memcpy(data, b->data, b->len);
+        if (b->len < old_len)
+                memset(data + b->len, 0, old_len - b->len);
+        WRITE_ONCE(hdr->len, b->len);
+        smp_wmb();
+        WRITE_ONCE(hdr->seq, hdr->seq + 1);
+}
+
+/*
+ * Bring the mmap() area up to the latest secret. This runs after the
+ * secret is published and outside ctx->lock, so copying a large secret
+ * holds up neither the other writers nor the keyed store. A writer that
+ * finds map_lock taken leaves the copy to the holder, which goes round
+ * again until the area holds the latest generation: writers never queue
+ * behind each other's copies, and a version already replaced by the
+ * time its turn comes is skipped.
+ */
+static void secret_map_sync(struct drv_ctx *ctx)
+{
+        struct secret_blob *b;
+
+        for (;;) {
+                /*
+                 * Orders the caller's publish, or the holder's unlock,
+                 * before the checks: either this thread sees the new
+                 * generation or the other one gets map_lock and does.
+                 */
+                smp_mb();
+                if (!READ_ONCE(ctx->map) || READ_ONCE(ctx->map_gen) == READ_ONCE(ctx->gen))
+                        return;
+                if (!mutex_trylock(&ctx->map_lock))
+                        return;
+
+                b = secret_blob_get(ctx);
+                if (b && b->gen != ctx->map_gen) {
+                        secret_map_update(ctx, b);
+                        WRITE_ONCE(ctx->map_gen, b->gen);
+                }
+                mutex_unlock(&ctx->map_lock);
+
+                if (b)
+                        secret_blob_put(b);
+        }
+}
+
+/* make 'b' the current secret, the publisher's reference moves to ctx */
+static void secret_publish(struct drv_ctx *ctx, struct secret_blob *b)
+{
+        struct secret_blob *old;
+
+        mutex_lock(&ctx->lock);
+        b->gen = ++ctx->gen;
+        old = rcu_replace_pointer(ctx->secret, b, lockdep_is_held(&ctx->lock));
+        mutex_unlock(&ctx->lock);
+
+        if (old)
+                secret_blob_put(old);
+
+        secret_map_sync(ctx);
+
+        wake_up_interruptible_poll(&ctx->wq, EPOLLIN | EPOLLRDNORM);
+}
+
+/*
+ * The largest copy done under rcu_read_lock() alone; a longer one pins
+ * its version instead of holding up the grace period while it copies.
+ */
+#define SECRET_RCU_COPY_MAX PAGE_SIZE
+
+/*
+ * Copy the rest of the current secret from 'pos' without touching its
+ * reference count, the one cache line every reader would otherwise
+ * write. It only works if the read takes all of the rest, there isn't
+ * much of it and the user's buffer is resident; otherwise nothing is
+ * copied and -EAGAIN tells the caller to pin a version and copy from
+ * that, where it may sleep.
+ */
+static ssize_t secret_read_rcu(struct secret_file *sf, struct iov_iter *to,
+                               loff_t pos, size_t count)
+{
+        struct secret_blob *b;
+        size_t n, copied;
+        ssize_t ret = 0;
+
+        rcu_read_lock();
+        b = rcu_dereference(sf->ctx->secret);
+        if (!b)
+                goto out;
+        if (pos >= b->len) {
+                sf->end = b->len;       /* EOF */
+                goto out;
         }
-        if (secret_len <= 0) {
-                dev_warn(dev, "whoops, something's wrong, the 'secret' isn't available, aborting read\n");
-                goto out_notok;
+
+        ret = -EAGAIN;
+        n = b->len - pos;
+        if (n > count || n > SECRET_RCU_COPY_MAX)
+                goto out;
+
+        pagefault_disable();
+        copied = copy_to_iter(b->data + pos, n, to);
+        pagefault_enable();
+        if (copied != n) {
+                iov_iter_revert(to, copied);
+                goto out;
         }
+        sf->end = b->len;
+        WRITE_ONCE(sf->seen_gen, b->gen);
+        ret = n;
+out:
+        rcu_read_unlock();
+        return ret;
+}
 
-        ret = -EFAULT;
-        if (copy_to_user(ubuf, ctx->secret, secret_len)) {
-                dev_warn(dev, "copy_to_user() failed\n");
-                goto out_notok;
+/*
+ * Copy from the version this file is streaming, pinning the current one
+ * if there is none yet. The reference is dropped once the version has
+ * been read to the end.
+ */
+static ssize_t secret_read_pinned(struct secret_file *sf, struct iov_iter *to,
+                                  loff_t pos, size_t count)
+{
+        struct secret_blob *b = sf->snap;
+        ssize_t ret = 0;
+
+        if (!b) {
+                b = secret_blob_get(sf->ctx);
+                if (!b)
+                        return 0;
+                sf->snap = b;
+        }
+
+        if (pos < b->len) {
+                ret = copy_to_iter(b->data + pos, min_t(size_t, b->len - pos, count), to);
+                if (!ret)
+                        return -EFAULT;
+                WRITE_ONCE(sf->seen_gen, b->gen);
+        }
+        if (pos + ret >= b->len) {
+                sf->end = b->len;
+                sf->snap = NULL;
+                secret_blob_put(b);
         }
-        ret = secret_len;
 
-        ctx->tx += secret_len;
-        dev_info(dev, "%d bytes read, returning... (stats: tx=%d, rx=%d)\n",
-                        secret_len, ctx->tx, ctx->rx);
+        return ret;
+}
+
+/*
+ * A read at offset 0 starts on the latest secret. Reads further in stay
+ * on the version the file is streaming, so a sequence of short reads
+ * never mixes two secrets, and return EOF once it has been read to the
+ * end.
+ */
+static ssize_t secret_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+        struct secret_file *sf = iocb->ki_filp->private_data;
+        struct drv_ctx *ctx = sf->ctx;
+        size_t count = iov_iter_count(to);
+        loff_t pos = iocb->ki_pos;
+        ssize_t ret = 0;
+        u64 t0 = ktime_get_ns(), ns;
+
+        /* hot path: dynamic debug only, nothing is formatted unless enabled */
+        dev_dbg(ctx->dev, "%s wants to read (upto) %zu bytes at %lld\n",
+                        current->comm, count, pos);
+
+        mutex_lock(&sf->lock);
+        if (pos == 0) {
+                if (sf->snap)
+                        secret_blob_put(sf->snap);
+                sf->snap = NULL;
+                sf->end = -1;
+        }
+        if (!count || (!sf->snap && sf->end >= 0 && pos >= sf->end))
+                goto out;       /* EOF */
 
-out_notok:
+        ret = -EAGAIN;
+        if (!sf->snap)
+                ret = secret_read_rcu(sf, to, pos, count);
+        if (ret == -EAGAIN)
+                ret = secret_read_pinned(sf, to, pos, count);
+        if (ret < 0) {
+                dev_dbg(ctx->dev, "copy_to_iter() failed\n");
+                goto out;
+        }
+        iocb->ki_pos = pos + ret;
+
+        dev_dbg(ctx->dev, "%zd bytes read, returning...\n", ret);
+
+out:
+        mutex_unlock(&sf->lock);
+        ns = secret_account(ctx, SECRET_OP_READ, ret, t0);
+        trace_secret_read(pos, count, ret, ns);
         return ret;
 }
 
-static ssize_t secret_write(struct file *filp, const char __user *ubuf, size_t count, loff_t *off)
+/*
+ * Make room for 'len' bytes in the staging buffer, growing it by doubling
+ * so a secret streamed in as many writes costs linear time overall.
+ */
+static int secret_stage_reserve(struct secret_file *sf, size_t len)
+{
+        struct secret_blob *b, *old = sf->stage;
+
+        lockdep_assert_held(&sf->lock);
+
+        if (old && len <= old->size)
+                return 0;
+
+        b = secret_blob_alloc(min_t(size_t, max_t(size_t, roundup_pow_of_two(len), MAXBYTES),
+                                    max_size));
+        if (unlikely(!b))
+                return -ENOMEM;
+        b->len = 0;
+        if (old) {
+                memcpy(b->data, old->data, old->len);
+                b->len = old->len;
+                secret_blob_free(old);
+        }
+        sf->stage = b;
+
+        return 0;
+}
+
+/* publish what was written through this file, nothing if it wrote nothing */
+static void secret_stage_publish(struct secret_file *sf)
 {
-        int ret = count;
-        void *kbuf = NULL;
+        struct secret_blob *b;
+
+        mutex_lock(&sf->lock);
+        b = sf->stage;
+        sf->stage = NULL;
+        mutex_unlock(&sf->lock);
+
+        if (!b)
+                return;
+        if (!b->len) {
+                secret_blob_free(b);
+                return;
+        }
+        secret_publish(sf->ctx, b);
+}
+
+/*
+ * Writes are staged in the open file and become the new secret, in one
+ * piece, on fsync() or close(). A write at offset 'pos' keeps the first
+ * 'pos' bytes staged so far and replaces the rest with the written data,
+ * so a secret larger than one write() streams in as consecutive writes
+ * without readers ever seeing part of it, and without other writers'
+ * data getting mixed in.
+ */
+static ssize_t secret_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+        struct secret_file *sf = iocb->ki_filp->private_data;
+        struct drv_ctx *ctx = sf->ctx;
+        size_t count = iov_iter_count(from);
+        loff_t pos = iocb->ki_pos;
+        ssize_t ret = -EFBIG;
         struct device *dev = ctx->dev;
-        char tasknm[TASK_COMM_LEN];
+        size_t copied;
+        u64 t0 = ktime_get_ns(), ns;
 
-        if (unlikely(count > MAXBYTES)) {
-                dev_warn(dev, "count %zu exceeds max # of bytes allowed,\
-                                aborting write\n", count);
-                goto out_nomem;
+        if (unlikely(pos > max_size || count > max_size - pos)) {
+                dev_dbg(dev, "%zu bytes at %lld exceed max # of bytes allowed, aborting write\n",
+                                count, pos);
+                goto out;
         }
+        ret = 0;
+        if (unlikely(!count))
+                goto out;
 
-        dev_info(dev, "%s wants to write %zu bytes\n", get_task_comm(tasknm, current), count);
+        dev_dbg(dev, "%s wants to write %zu bytes at %lld\n", current->comm, count, pos);
 
-        ret = -ENOMEM;
-        kbuf = kvzalloc(count, GFP_KERNEL);
-        if (unlikely(!kbuf))
-                goto out_nomem;
+        mutex_lock(&sf->lock);
+        ret = -EINVAL;
+        if (pos > (sf->stage ? sf->stage->len : 0))
+                goto out_unlock;        /* no holes */
 
+        ret = secret_stage_reserve(sf, pos + count);
+        if (unlikely(ret))
+                goto out_unlock;
+
+        copied = copy_from_iter(sf->stage->data + pos, count, from);
+        sf->stage->len = pos + copied;
         ret = -EFAULT;
-        if (copy_from_user(kbuf, ubuf, count)) {
-                dev_warn(dev, "copy_from_user failed\n");
-                goto out_cfu;
+        if (!copied) {
+                dev_dbg(dev, "copy_from_iter() failed\n");
+                goto out_unlock;
+        }
+
+        iocb->ki_pos = pos + copied;
+        ret = copied;
+        dev_dbg(dev, "%zu bytes staged, returning...\n", copied);
+
+out_unlock:
+        mutex_unlock(&sf->lock);
+out:
+        ns = secret_account(ctx, SECRET_OP_WRITE, ret, t0);
+        trace_secret_write(pos, count, ret, ns);
+        return ret;
+}
+
+static int secret_fsync(struct file *filp, loff_t start, loff_t end, int datasync)
+{
+        secret_stage_publish(filp->private_data);
+        return 0;
+}
+
+/* readable once a secret newer than the last one read() returned is published */
+static __poll_t secret_poll(struct file *filp, poll_table *wait)
+{
+        struct secret_file *sf = filp->private_data;
+        struct drv_ctx *ctx = sf->ctx;
+        __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+        poll_wait(filp, &ctx->wq, wait);
+
+        if (READ_ONCE(ctx->gen) != READ_ONCE(sf->seen_gen))
+                mask |= EPOLLIN | EPOLLRDNORM;
+
+        return mask;
+}
+
+/* SEEK_END is relative to the version this file is reading, or last read */
+static loff_t secret_llseek(struct file *filp, loff_t offset, int whence)
+{
+        struct secret_file *sf = filp->private_data;
+        struct secret_blob *b;
+        loff_t eof;
+
+        mutex_lock(&sf->lock);
+        if (sf->snap) {
+                eof = sf->snap->len;
+        } else if (sf->end >= 0) {
+                eof = sf->end;
+        } else {
+                rcu_read_lock();
+                b = rcu_dereference(sf->ctx->secret);
+                eof = b ? b->len : 0;
+                rcu_read_unlock();
         }
+        mutex_unlock(&sf->lock);
+
+        return generic_file_llseek_size(filp, offset, whence, max_size, eof);
+}
 
-        /* write our secret */
-        strscpy(ctx->secret, kbuf, count);
+static struct secret_entry *secret_lookup(struct drv_ctx *ctx, const char *key, u32 hash)
+{
+        struct secret_entry *e;
+
+        hash_for_each_possible_rcu(ctx->secrets, e, node, hash,
+                                   lockdep_is_held(&ctx->lock))
+                if (e->hash == hash && !strcmp(e->key, key))
+                        return e;
 
-        ctx->rx += count;
-        ret = count;
-        dev_info(dev, "%zu bytes written, returning... (stats: tx=%d, rx=%d)\n",
-                        count, ctx->tx, ctx->rx);
+        return NULL;
+}
+
+/* validate a request from user space and hash its key */
+static int secret_kv_check(struct secret_kv *kv, u32 *hash)
+{
+        size_t klen = strnlen(kv->key, SECRET_KEY_MAX);
+
+        /* 'flags' is output only, keep it free for future use */
+        if (klen == 0 || klen == SECRET_KEY_MAX || kv->flags)
+                return -EINVAL;
+        *hash = full_name_hash(NULL, kv->key, klen);
+
+        return 0;
+}
+
+/* build an entry for 'kv' off to the side, readers never see it half done */
+static struct secret_entry *secret_entry_new(struct secret_kv *kv, u32 hash)
+{
+        struct secret_entry *e;
+
+        if (kv->len > MAXBYTES)
+                return ERR_PTR(-EMSGSIZE);
+
+        e = kmalloc(sizeof(*e), GFP_KERNEL);
+        if (unlikely(!e))
+                return ERR_PTR(-ENOMEM);
+
+        if (copy_from_user(e->val, u64_to_user_ptr(kv->val), kv->len)) {
+                kfree(e);
+                return ERR_PTR(-EFAULT);
+        }
+        e->hash = hash;
+        e->len = kv->len;
+        strscpy(e->key, kv->key, SECRET_KEY_MAX);
+
+        return e;
+}
 
-out_cfu:
-        kvfree(kbuf);
-out_nomem:
+/* make 'e' visible, returns the entry it replaced (if any) */
+static struct secret_entry *secret_entry_link(struct drv_ctx *ctx, struct secret_entry *e)
+{
+        struct secret_entry *old;
+
+        lockdep_assert_held(&ctx->lock);
+
+        old = secret_lookup(ctx, e->key, e->hash);
+        if (old)
+                hlist_replace_rcu(&old->node, &e->node);
+        else
+                hash_add_rcu(ctx->secrets, &e->node, e->hash);
+
+        return old;
+}
+
+static int secret_kv_put(struct drv_ctx *ctx, struct secret_kv *kv, u32 hash)
+{
+        struct secret_entry *e, *old;
+
+        e = secret_entry_new(kv, hash);
+        if (IS_ERR(e))
+                return PTR_ERR(e);
+
+        mutex_lock(&ctx->lock);
+        old = secret_entry_link(ctx, e);
+        mutex_unlock(&ctx->lock);
+
+        if (old)
+                kfree_rcu(old, rcu);
+
+        return 0;
+}
+
+static int secret_kv_get(struct drv_ctx *ctx, struct secret_kv *kv, u32 hash)
+{
+        struct secret_entry *e;
+        char val[MAXBYTES];
+        u32 len;
+
+        rcu_read_lock();
+        e = secret_lookup(ctx, kv->key, hash);
+        if (!e) {
+                rcu_read_unlock();
+                return -ENOENT;
+        }
+        len = e->len;
+        memcpy(val, e->val, len);
+        rcu_read_unlock();
+
+        /* tell the caller how much room it needs */
+        if (kv->len < len) {
+                kv->len = len;
+                return -ENOSPC;
+        }
+        kv->len = len;
+
+        if (copy_to_user(u64_to_user_ptr(kv->val), val, len))
+                return -EFAULT;
+
+        return 0;
+}
+
+static int secret_kv_del(struct drv_ctx *ctx, struct secret_kv *kv, u32 hash)
+{
+        struct secret_entry *e;
+
+        mutex_lock(&ctx->lock);
+        e = secret_lookup(ctx, kv->key, hash);
+        if (e)
+                hash_del_rcu(&e->node);
+        mutex_unlock(&ctx->lock);
+
+        if (!e)
+                return -ENOENT;
+        kfree_rcu(e, rcu);
+
+        return 0;
+}
+
+static void secret_kv_flush(struct drv_ctx *ctx)
+{
+        struct secret_entry *e;
+        struct hlist_node *tmp;
+        int bkt;
+
+        hash_for_each_safe(ctx->secrets, bkt, tmp, e, node) {
+                hash_del(&e->node);
+                kfree(e);
+        }
+}
+
+/*
+ * Every entry of the batch is built before the table lock is taken, then
+ * all of them are linked in one critical section: a failure leaves the
+ * table untouched and SECRET_IOC_GET_N never sees half a batch.
+ */
+static int secret_kv_put_n(struct drv_ctx *ctx, struct secret_batch *bt)
+{
+        struct secret_entry **ents;
+        struct secret_kv *kvs;
+        u32 hash, i;
+        int ret;
+
+        if (!bt->count || bt->count > SECRET_BATCH_MAX)
+                return -EINVAL;
+
+        kvs = vmemdup_user(u64_to_user_ptr(bt->kvs), array_size(bt->count, sizeof(*kvs)));
+        if (IS_ERR(kvs))
+                return PTR_ERR(kvs);
+
+        ret = -ENOMEM;
+        ents = kcalloc(bt->count, sizeof(*ents), GFP_KERNEL);
+        if (unlikely(!ents))
+                goto out;
+
+        for (i = 0; i < bt->count; i++) {
+                ret = secret_kv_check(&kvs[i], &hash);
+                if (ret)
+                        goto out_free;
+                ents[i] = secret_entry_new(&kvs[i], hash);
+                if (IS_ERR(ents[i])) {
+                        ret = PTR_ERR(ents[i]);
+                        ents[i] = NULL;
+                        goto out_free;
+                }
+        }
+
+        mutex_lock(&ctx->lock);
+        write_seqcount_begin(&ctx->kv_seq);
+        for (i = 0; i < bt->count; i++)
+                ents[i] = secret_entry_link(ctx, ents[i]);
+        write_seqcount_end(&ctx->kv_seq);
+        mutex_unlock(&ctx->lock);
+
+        /* ents[] now holds the replaced entries */
+        for (i = 0; i < bt->count; i++)
+                if (ents[i])
+                        kfree_rcu(ents[i], rcu);
+        ret = 0;
+        goto out;
+
+out_free:
+        for (i = 0; i < bt->count; i++)
+                kfree(ents[i]);
+out:
+        kfree(ents);
+        kvfree(kvs);
+        return ret;
+}
+
+/* one value as seen by secret_kv_get_n(), copied out after the lookup */
+struct secret_kv_val {
+        bool found;
+        u32 len;
+        char val[MAXBYTES];
+};
+
+static int secret_kv_get_n(struct drv_ctx *ctx, struct secret_batch *bt)
+{
+        struct secret_kv_val *vals;
+        struct secret_entry *e;
+        struct secret_kv *kvs;
+        unsigned int seq;
+        u32 *hashes;
+        u32 i;
+        int ret;
+
+        if (!bt->count || bt->count > SECRET_BATCH_MAX)
+                return -EINVAL;
+
+        kvs = vmemdup_user(u64_to_user_ptr(bt->kvs), array_size(bt->count, sizeof(*kvs)));
+        if (IS_ERR(kvs))
+                return PTR_ERR(kvs);
+
+        ret = -ENOMEM;
+        hashes = kmalloc_array(bt->count, sizeof(*hashes), GFP_KERNEL);
+        vals = kvmalloc_array(bt->count, sizeof(*vals), GFP_KERNEL);
+        if (unlikely(!hashes || !vals))
+                goto out;
+
+        for (i = 0; i < bt->count; i++) {
+                ret = secret_kv_check(&kvs[i], &hashes[i]);
+                if (ret)
+                        goto out;
+        }
+
+        /* a consistent view of all the keys, retried if a batched put raced with us */
+        do {
+                seq = read_seqcount_begin(&ctx->kv_seq);
+                rcu_read_lock();
+                for (i = 0; i < bt->count; i++) {
+                        e = secret_lookup(ctx, kvs[i].key, hashes[i]);
+                        vals[i].found = e != NULL;
+                        if (!e)
+                                continue;
+                        vals[i].len = e->len;
+                        memcpy(vals[i].val, e->val, e->len);
+                }
+                rcu_read_unlock();
+        } while (read_seqcount_retry(&ctx->kv_seq, seq));
+
+        for (i = 0; i < bt->count; i++) {
+                kvs[i].flags = 0;
+                if (!vals[i].found) {
+                        kvs[i].flags = SECRET_KV_NOENT;
+                        kvs[i].len = 0;
+                        continue;
+                }
+                if (kvs[i].len < vals[i].len) {
+                        kvs[i].flags = SECRET_KV_NOSPC;
+                        kvs[i].len = vals[i].len;
+                        continue;
+                }
+                kvs[i].len = vals[i].len;
+
+                ret = -EFAULT;
+                if (copy_to_user(u64_to_user_ptr(kvs[i].val), vals[i].val, vals[i].len))
+                        goto out;
+        }
+
+        ret = 0;
+        if (copy_to_user(u64_to_user_ptr(bt->kvs), kvs, array_size(bt->count, sizeof(*kvs))))
+                ret = -EFAULT;
+
+out:
+        kvfree(vals);
+        kfree(hashes);
+        kvfree(kvs);
         return ret;
 }
 
+static int secret_ioctl_kv(struct drv_ctx *ctx, unsigned int cmd, void __user *uarg)
+{
+        struct secret_kv kv;
+        u32 hash;
+        int ret;
+
+        if (copy_from_user(&kv, uarg, sizeof(kv)))
+                return -EFAULT;
+
+        ret = secret_kv_check(&kv, &hash);
+        if (ret)
+                return ret;
+
+        switch (cmd) {
+        case SECRET_IOC_PUT:
+                ret = secret_kv_put(ctx, &kv, hash);
+                break;
+        case SECRET_IOC_GET:
+                ret = secret_kv_get(ctx, &kv, hash);
+                if ((!ret || ret == -ENOSPC) &&
+                    put_user(kv.len, &((struct secret_kv __user *)uarg)->len))
+                        ret = -EFAULT;
+                break;
+        case SECRET_IOC_DEL:
+                ret = secret_kv_del(ctx, &kv, hash);
+                break;
+        }
+
+        return ret;
+}
+
+static int secret_ioctl_batch(struct drv_ctx *ctx, unsigned int cmd, void __user *uarg)
+{
+        struct secret_batch bt;
+
+        if (copy_from_user(&bt, uarg, sizeof(bt)))
+                return -EFAULT;
+        if (bt.flags)
+                return -EINVAL;
+
+        if (cmd == SECRET_IOC_GET_N)
+                return secret_kv_get_n(ctx, &bt);
+
+        return secret_kv_put_n(ctx, &bt);
+}
+
+static long secret_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+        struct secret_file *sf = filp->private_data;
+        struct drv_ctx *ctx = sf->ctx;
+        void __user *uarg = (void __user *)arg;
+        u64 t0 = ktime_get_ns();
+        int ret;
+
+        switch (cmd) {
+        case SECRET_IOC_PUT:
+        case SECRET_IOC_GET:
+        case SECRET_IOC_DEL:
+                ret = secret_ioctl_kv(ctx, cmd, uarg);
+                break;
+        case SECRET_IOC_GET_N:
+        case SECRET_IOC_PUT_N:
+                ret = secret_ioctl_batch(ctx, cmd, uarg);
+                break;
+        default:
+                ret = -ENOTTY;
+                break;
+        }
+
+        secret_account(ctx, SECRET_OP_IOCTL, ret, t0);
+        return ret;
+}
+
+/*
+ * The mmap() area is sized for max_size, so it is only allocated once
+ * somebody maps it; until then secret_map_sync() has nothing to mirror.
+ */
+static int secret_map_alloc(struct drv_ctx *ctx)
+{
+        struct secret_map_hdr *map;
+
+        if (READ_ONCE(ctx->map))
+                return 0;
+
+        map = vmalloc_user(PAGE_SIZE + PAGE_ALIGN(max_size));
+        if (unlikely(!map))
+                return -ENOMEM;
+        map->data_off = PAGE_SIZE;
+
+        mutex_lock(&ctx->map_lock);
+        if (!ctx->map) {
+                WRITE_ONCE(ctx->map, map);
+                map = NULL;
+        }
+        mutex_unlock(&ctx->map_lock);
+        vfree(map);
+
+        /* fill it with the current secret, see secret_map_sync() */
+        secret_map_sync(ctx);
+
+        return 0;
+}
+
+/* read-only view of the header page and the current secret */
+static int secret_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+        struct secret_file *sf = filp->private_data;
+        int ret;
+
+        if (vma->vm_flags & VM_WRITE)
+                return -EPERM;
+        vm_flags_clear(vma, VM_MAYWRITE);
+
+        ret = secret_map_alloc(sf->ctx);
+        if (ret)
+                return ret;
+
+        return remap_vmalloc_range(vma, sf->ctx->map, vma->vm_pgoff);
+}
+
 static int secret_close(struct inode *inode, struct file *filp)
 {
+        struct secret_file *sf = filp->private_data;
+
+        secret_stage_publish(sf);
+        if (sf->snap)
+                secret_blob_put(sf->snap);
+        mutex_destroy(&sf->lock);
+        kfree(sf);
         return 0;
 }
 
+static int secret_stats_show(struct seq_file *m, void *v)
+{
+        struct drv_ctx *ctx = m->private;
+        u64 tx = 0, rx = 0, reads = 0, writes = 0, ioctls = 0, errors = 0;
+        u64 lat[SECRET_LAT_BUCKETS] = { 0 };
+        unsigned int start;
+        int cpu, i;
+
+        for_each_possible_cpu(cpu) {
+                struct secret_stats *st = per_cpu_ptr(ctx->stats, cpu);
+                u64 t[6], l[SECRET_LAT_BUCKETS];
+
+                do {
+                        start = u64_stats_fetch_begin(&st->syncp);
+                        t[0] = u64_stats_read(&st->tx_bytes);
+                        t[1] = u64_stats_read(&st->rx_bytes);
+                        t[2] = u64_stats_read(&st->reads);
+                        t[3] = u64_stats_read(&st->writes);
+                        t[4] = u64_stats_read(&st->ioctls);
+                        t[5] = u64_stats_read(&st->errors);
+                        for (i = 0; i < SECRET_LAT_BUCKETS; i++)
+                                l[i] = u64_stats_read(&st->lat[i]);
+                } while (u64_stats_fetch_retry(&st->syncp, start));
+
+                tx += t[0];
+                rx += t[1];
+                reads += t[2];
+                writes += t[3];
+                ioctls += t[4];
+                errors += t[5];
+                for (i = 0; i < SECRET_LAT_BUCKETS; i++)
+                        lat[i] += l[i];
+        }
+
+        seq_printf(m, "tx_bytes %llu\nrx_bytes %llu\nreads %llu\nwrites %llu\n"
+                      "ioctls %llu\nerrors %llu\n",
+                   tx, rx, reads, writes, ioctls, errors);
+        /* bucket i counts ops that took less than 2^i us, the last one is open ended */
+        for (i = 0; i < SECRET_LAT_BUCKETS - 1; i++)
+                seq_printf(m, "lat_lt_%uus %llu\n", 1U << i, lat[i]);
+        seq_printf(m, "lat_ge_%uus %llu\n", 1U << (SECRET_LAT_BUCKETS - 2), lat[i]);
+
+        return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(secret_stats);
+
 static const struct file_operations secret_fops = {
+        .owner = THIS_MODULE,
         .open = secret_open,
-        .read = secret_read,
-        .write = secret_write,
-        .llseek = no_llseek,
+        .read_iter = secret_read_iter,
+        .write_iter = secret_write_iter,
+        .fsync = secret_fsync,
+        .unlocked_ioctl = secret_ioctl,
+        .compat_ioctl = compat_ptr_ioctl,
+        .mmap = secret_mmap,
+        .poll = secret_poll,
+        .llseek = secret_llseek,
         .release = secret_close
 };
 
@@ -133,39 +1065,97 @@ static struct miscdevice llkd_miscdev = {
 };
 
 
+/*
+ * Everything the file operations touch is set up before the device node
+ * appears, and torn down only after it is gone.
+ */
 static int __init miscdrv_secret_init(void)
 {
-        struct device *dev;
+        struct secret_blob *b;
+        int ret = -ENOMEM;
+        int cpu;
 
-        int ret = misc_register(&llkd_miscdev);
-        if (ret) {
-                pr_notice("device registration failed\n");
-                return ret;
+        /* the mapping must hold at least the initial secret and a keyed value */
+        if (max_size < MAXBYTES || max_size > SECRET_MAX_SIZE_LIMIT) {
+                pr_err("max_size must be between %u and %u bytes\n",
+                       MAXBYTES, SECRET_MAX_SIZE_LIMIT);
+                return -EINVAL;
         }
 
-        dev = llkd_miscdev.this_device;
-        ctx->dev = dev;
-
-        dev_info(dev, "LLKD misc driver (major # 10) registered, minor = %d,\
-                        dev node is /dev/%s\n", llkd_miscdev.minor, llkd_miscdev.name);
-
-        ctx = devm_kzalloc(dev, sizeof(struct drv_ctx), GFP_KERNEL);
+        ctx = kzalloc(sizeof(struct drv_ctx), GFP_KERNEL);
         if (unlikely(!ctx))
                 return -ENOMEM;
 
+        mutex_init(&ctx->lock);
+        mutex_init(&ctx->map_lock);
+        seqcount_mutex_init(&ctx->kv_seq, &ctx->lock);
+        init_waitqueue_head(&ctx->wq);
+        hash_init(ctx->secrets);
+
+        ctx->stats = alloc_percpu(struct secret_stats);
+        if (unlikely(!ctx->stats))
+                goto out_ctx;
+        for_each_possible_cpu(cpu)
+                u64_stats_init(&per_cpu_ptr(ctx->stats, cpu)->syncp);
+
+        secret_blob_cache = kmem_cache_create("secret_blob",
+                        sizeof(struct secret_blob) + MAXBYTES, 0, 0, NULL);
+        if (unlikely(!secret_blob_cache))
+                goto out_stats;
+
+        b = secret_blob_alloc(7);
+        if (unlikely(!b))
+                goto out_cache;
+        memcpy(b->data, "initmsg", 7);
+        secret_publish(ctx, b);
+
+        ret = misc_register(&llkd_miscdev);
+        if (ret) {
+                pr_notice("device registration failed\n");
+                goto out_secret;
+        }
+        ctx->dev = llkd_miscdev.this_device;
+
+        ctx->dbg = debugfs_create_dir(KBUILD_MODNAME, NULL);
+        debugfs_create_file("stats", 0444, ctx->dbg, ctx, &secret_stats_fops);
 
-        strscpy(ctx->secret, "initmsg", 8);
+        dev_info(ctx->dev, "LLKD misc driver (major # 10) registered, minor = %d, dev node is /dev/%s\n",
+                        llkd_miscdev.minor, llkd_miscdev.name);
         dev_dbg(ctx->dev, "A sample print via the dev_dbg(): driver initialized\n");
 
         return 0;
+
+out_secret:
+        secret_blob_free(rcu_dereference_protected(ctx->secret, 1));
+out_cache:
+        kmem_cache_destroy(secret_blob_cache);
+out_stats:
+        free_percpu(ctx->stats);
+out_ctx:
+        kfree(ctx);
+        return ret;
 }
 
 static void __exit miscdrv_secret_exit(void)
 {
+        dev_info(ctx->dev, "LLKD misc driver deregistering\n");
+
+        debugfs_remove_recursive(ctx->dbg);
         misc_deregister(&llkd_miscdev);
-        dev_info(ctx->dev, "LLKD misc driver deregistered\n");
+
+        secret_kv_flush(ctx);
+        secret_blob_free(rcu_dereference_protected(ctx->secret, 1));
+        rcu_barrier();  /* pending secret_blob_free_rcu() callbacks */
+        kmem_cache_destroy(secret_blob_cache);
+        vfree(ctx->map);
+        free_percpu(ctx->stats);
+        kfree(ctx);
 }
 
 module_init(miscdrv_secret_init);
 module_exit(miscdrv_secret_exit);
 
+#if IS_ENABLED(CONFIG_MISCDRV_SECRET_KUNIT_TEST)
+#include "miscdrv_secret_kunit.c"
+#endif
+
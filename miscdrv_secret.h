@@ -0,0 +1,69 @@
+#ifndef _MISCDRV_SECRET_H
+#define _MISCDRV_SECRET_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define SECRET_KEY_MAX		32	/* incl. terminating NUL */
+#define SECRET_VAL_MAX		128
+
+/*
+ * A named secret. 'val' is a user pointer to the value buffer; on
+ * SECRET_IOC_GET 'len' is the buffer size on input and the value size
+ * on output. 'flags' must be 0 on input, or the call fails with EINVAL.
+ */
+struct secret_kv {
+	char key[SECRET_KEY_MAX];
+	__u64 val;
+	__u32 len;
+	__u32 flags;
+};
+
+/* per-entry results of SECRET_IOC_GET_N, returned in secret_kv.flags */
+#define SECRET_KV_NOENT		0x1	/* no such key, 'len' is 0 */
+#define SECRET_KV_NOSPC		0x2	/* buffer too small, 'len' is the size needed */
+
+/*
+ * Several secrets in one call: 'kvs' points to an array of 'count'
+ * struct secret_kv. SECRET_IOC_PUT_N stores all of them or none,
+ * SECRET_IOC_GET_N returns a consistent view of all of them. 'flags'
+ * must be 0.
+ */
+struct secret_batch {
+	__u64 kvs;
+	__u32 count;
+	__u32 flags;
+};
+
+#define SECRET_BATCH_MAX	256
+
+/*
+ * Layout of the first page of an mmap() of /dev/secret. The secret
+ * itself starts 'data_off' bytes into the mapping. 'seq' is odd while
+ * the driver is updating the data, so a reader does
+ *
+ *	do {
+ *		while ((s = READ_ONCE(hdr->seq)) & 1)
+ *			;
+ *		rmb();
+ *		copy hdr->len bytes at (char *)hdr + hdr->data_off;
+ *		rmb();
+ *	} while (READ_ONCE(hdr->seq) != s);
+ *
+ * and can compare 'seq' against the last value it saw to notice an
+ * update without entering the kernel.
+ */
+struct secret_map_hdr {
+	__u32 seq;
+	__u32 data_off;
+	__u64 len;
+};
+
+#define SECRET_IOC_MAGIC	'S'
+#define SECRET_IOC_PUT		_IOW(SECRET_IOC_MAGIC, 1, struct secret_kv)
+#define SECRET_IOC_GET		_IOWR(SECRET_IOC_MAGIC, 2, struct secret_kv)
+#define SECRET_IOC_DEL		_IOW(SECRET_IOC_MAGIC, 3, struct secret_kv)
+#define SECRET_IOC_GET_N	_IOWR(SECRET_IOC_MAGIC, 4, struct secret_batch)
+#define SECRET_IOC_PUT_N	_IOW(SECRET_IOC_MAGIC, 5, struct secret_batch)
+
+#endif /* _MISCDRV_SECRET_H */
@@ -0,0 +1,369 @@
+/*
+ * KUnit tests for the secret misc device, #included at the end of
+ * miscdrv_secret.c so they can drive its file operations directly.
+ * They run against the live driver context the module init set up,
+ * with a bare struct file and kernel buffers standing in for open(2)
+ * and the user's memory.
+ *
+ *	./tools/testing/kunit/kunit.py run --kunitconfig=<this dir>
+ *
+ * secret_test_bench is a slow case: it times write/read loops and
+ * reports ns/op per size, it does not fail on a regression.
+ */
+#include <kunit/test.h>
+#include <linux/kernel.h>
+#include <linux/random.h>
+
+KUNIT_DEFINE_ACTION_WRAPPER(secret_test_kvfree, kvfree, const void *);
+
+static void secret_test_release(void *filp)
+{
+        secret_close(NULL, filp);
+}
+
+/* open(2) of /dev/secret, closed again when the test ends */
+static struct file *secret_test_open(struct kunit *test)
+{
+        struct file *filp;
+
+        filp = kunit_kzalloc(test, sizeof(*filp), GFP_KERNEL);
+        KUNIT_ASSERT_NOT_NULL(test, filp);
+        KUNIT_ASSERT_EQ(test, secret_open(NULL, filp), 0);
+        KUNIT_ASSERT_EQ(test, kunit_add_action_or_reset(test, secret_test_release, filp), 0);
+
+        return filp;
+}
+
+static char *secret_test_buf(struct kunit *test, size_t len)
+{
+        char *buf = kvmalloc(len, GFP_KERNEL);
+
+        KUNIT_ASSERT_NOT_NULL(test, buf);
+        KUNIT_ASSERT_EQ(test, kunit_add_action_or_reset(test, secret_test_kvfree, buf), 0);
+
+        return buf;
+}
+
+static ssize_t secret_test_read(struct file *filp, void *buf, size_t len, loff_t *pos)
+{
+        struct kvec kv = { .iov_base = buf, .iov_len = len };
+        struct kiocb kiocb = { .ki_filp = filp, .ki_pos = *pos };
+        struct iov_iter iter;
+        ssize_t ret;
+
+        iov_iter_kvec(&iter, ITER_DEST, &kv, 1, len);
+        ret = secret_read_iter(&kiocb, &iter);
+        *pos = kiocb.ki_pos;
+
+        return ret;
+}
+
+static ssize_t secret_test_write(struct file *filp, const void *buf, size_t len, loff_t *pos)
+{
+        struct kvec kv = { .iov_base = (void *)buf, .iov_len = len };
+        struct kiocb kiocb = { .ki_filp = filp, .ki_pos = *pos };
+        struct iov_iter iter;
+        ssize_t ret;
+
+        iov_iter_kvec(&iter, ITER_SOURCE, &kv, 1, len);
+        ret = secret_write_iter(&kiocb, &iter);
+        *pos = kiocb.ki_pos;
+
+        return ret;
+}
+
+static void secret_test_sync(struct kunit *test, struct file *filp)
+{
+        KUNIT_ASSERT_EQ(test, secret_fsync(filp, 0, LLONG_MAX, 0), 0);
+}
+
+/* write 's' at offset 0 and publish it */
+static void secret_test_set(struct kunit *test, struct file *filp, const char *s)
+{
+        loff_t pos = 0;
+
+        KUNIT_ASSERT_EQ(test, secret_test_write(filp, s, strlen(s), &pos), (ssize_t)strlen(s));
+        secret_test_sync(test, filp);
+}
+
+static void secret_test_open_close(struct kunit *test)
+{
+        struct file *filp = secret_test_open(test);
+        struct secret_file *sf = filp->private_data;
+
+        KUNIT_ASSERT_NOT_NULL(test, sf);
+        KUNIT_EXPECT_PTR_EQ(test, sf->ctx, ctx);
+        KUNIT_EXPECT_NULL(test, sf->snap);
+        KUNIT_EXPECT_NULL(test, sf->stage);
+        KUNIT_EXPECT_EQ(test, sf->end, -1LL);
+        KUNIT_EXPECT_EQ(test, sf->seen_gen, 0ULL);
+}
+
+static void secret_test_roundtrip(struct kunit *test)
+{
+        struct file *w = secret_test_open(test), *r = secret_test_open(test);
+        char buf[32];
+        loff_t pos = 0;
+
+        secret_test_set(test, w, "swordfish");
+        KUNIT_EXPECT_EQ(test, secret_test_read(r, buf, sizeof(buf), &pos), 9);
+        KUNIT_EXPECT_MEMEQ(test, buf, "swordfish", 9);
+        KUNIT_EXPECT_EQ(test, pos, 9);
+
+        /* a read of the whole secret copies under RCU, without a reference */
+        KUNIT_EXPECT_EQ(test, refcount_read(&rcu_dereference_protected(ctx->secret, 1)->ref), 1U);
+
+        /* EOF, at and past the end; the version read is let go at EOF */
+        KUNIT_EXPECT_EQ(test, secret_test_read(r, buf, sizeof(buf), &pos), 0);
+        KUNIT_EXPECT_NULL(test, ((struct secret_file *)r->private_data)->snap);
+        pos = 100;
+        KUNIT_EXPECT_EQ(test, secret_test_read(r, buf, sizeof(buf), &pos), 0);
+        pos = 0;
+        KUNIT_EXPECT_EQ(test, secret_test_read(r, buf, 0, &pos), 0);
+
+        KUNIT_EXPECT_EQ(test, secret_llseek(r, 0, SEEK_END), 9);
+        KUNIT_EXPECT_EQ(test, secret_llseek(r, 4, SEEK_SET), 4);
+}
+
+/* short reads stay on one version until the reader comes back to offset 0 */
+static void secret_test_short_reads(struct kunit *test)
+{
+        struct file *w = secret_test_open(test), *r = secret_test_open(test);
+        char buf[8];
+        loff_t pos = 0;
+
+        secret_test_set(test, w, "abcdef");
+        KUNIT_EXPECT_EQ(test, secret_test_read(r, buf, 3, &pos), 3);
+        KUNIT_EXPECT_MEMEQ(test, buf, "abc", 3);
+        KUNIT_EXPECT_NOT_NULL(test, ((struct secret_file *)r->private_data)->snap);
+
+        secret_test_set(test, w, "XYZ");
+        KUNIT_EXPECT_EQ(test, secret_test_read(r, buf, 3, &pos), 3);
+        KUNIT_EXPECT_MEMEQ(test, buf, "def", 3);
+        KUNIT_EXPECT_NULL(test, ((struct secret_file *)r->private_data)->snap);
+        KUNIT_EXPECT_EQ(test, secret_llseek(r, 0, SEEK_END), 6);
+        KUNIT_EXPECT_EQ(test, secret_test_read(r, buf, 3, &pos), 0);
+
+        pos = 0;
+        KUNIT_EXPECT_EQ(test, secret_test_read(r, buf, sizeof(buf), &pos), 3);
+        KUNIT_EXPECT_MEMEQ(test, buf, "XYZ", 3);
+}
+
+/*
+ * A write at an offset keeps the bytes staged before it, and nothing is
+ * visible until the writer syncs.
+ */
+static void secret_test_append(struct kunit *test)
+{
+        struct file *w = secret_test_open(test), *r = secret_test_open(test);
+        char buf[16];
+        loff_t pos = 0;
+
+        secret_test_set(test, w, "old");
+        KUNIT_EXPECT_EQ(test, secret_test_write(w, "hello", 5, &pos), 5);
+        KUNIT_EXPECT_EQ(test, secret_test_write(w, "world", 5, &pos), 5);
+        KUNIT_EXPECT_EQ(test, pos, 10);
+        pos = 3;
+        KUNIT_EXPECT_EQ(test, secret_test_write(w, "P!", 2, &pos), 2);
+
+        /* no holes */
+        pos = 6;
+        KUNIT_EXPECT_EQ(test, secret_test_write(w, "x", 1, &pos), -EINVAL);
+        KUNIT_EXPECT_EQ(test, pos, 6);
+
+        pos = 0;
+        KUNIT_EXPECT_EQ(test, secret_test_read(r, buf, sizeof(buf), &pos), 3);
+        KUNIT_EXPECT_MEMEQ(test, buf, "old", 3);
+
+        secret_test_sync(test, w);
+        KUNIT_EXPECT_NULL(test, ((struct secret_file *)w->private_data)->stage);
+        pos = 0;
+        KUNIT_EXPECT_EQ(test, secret_test_read(r, buf, sizeof(buf), &pos), 5);
+        KUNIT_EXPECT_MEMEQ(test, buf, "helP!", 5);
+
+        /* a write at an offset needs something staged before it */
+        pos = 5;
+        KUNIT_EXPECT_EQ(test, secret_test_write(w, "x", 1, &pos), -EINVAL);
+}
+
+/* two files streaming in secrets at the same time publish one each, unmixed */
+static void secret_test_writers(struct kunit *test)
+{
+        struct file *a = secret_test_open(test), *b = secret_test_open(test);
+        char buf[16];
+        loff_t apos = 0, bpos = 0, pos = 0;
+
+        KUNIT_EXPECT_EQ(test, secret_test_write(a, "aaaa", 4, &apos), 4);
+        KUNIT_EXPECT_EQ(test, secret_test_write(b, "bb", 2, &bpos), 2);
+        KUNIT_EXPECT_EQ(test, secret_test_write(a, "AAAA", 4, &apos), 4);
+        KUNIT_EXPECT_EQ(test, secret_test_write(b, "BB", 2, &bpos), 2);
+
+        secret_test_sync(test, b);
+        KUNIT_EXPECT_EQ(test, secret_test_read(a, buf, sizeof(buf), &pos), 4);
+        KUNIT_EXPECT_MEMEQ(test, buf, "bbBB", 4);
+
+        /* close() publishes too */
+        secret_close(NULL, a);
+        KUNIT_ASSERT_EQ(test, secret_open(NULL, a), 0);
+        pos = 0;
+        KUNIT_EXPECT_EQ(test, secret_test_read(b, buf, sizeof(buf), &pos), 8);
+        KUNIT_EXPECT_MEMEQ(test, buf, "aaaaAAAA", 8);
+}
+
+/* the secret as seen through the mmap() area */
+static void secret_test_expect_map(struct kunit *test, const char *data, size_t len)
+{
+        struct secret_map_hdr *hdr = ctx->map;
+
+        KUNIT_EXPECT_EQ(test, hdr->data_off, (u32)PAGE_SIZE);
+        KUNIT_EXPECT_EQ(test, hdr->len, (u64)len);
+        KUNIT_EXPECT_EQ(test, hdr->seq % 2, 0U);
+        KUNIT_EXPECT_MEMEQ(test, (char *)hdr + hdr->data_off, data, len);
+}
+
+/* the area mmap() allocates starts out holding the current secret */
+static void secret_test_map_alloc(struct kunit *test)
+{
+        struct file *filp = secret_test_open(test);
+
+        secret_test_set(test, filp, "lazy");
+        KUNIT_ASSERT_EQ(test, secret_map_alloc(ctx), 0);
+        secret_test_expect_map(test, "lazy", 4);
+        secret_test_set(test, filp, "again");
+        secret_test_expect_map(test, "again", 5);
+        KUNIT_EXPECT_EQ(test, ctx->map_gen, ctx->gen);
+}
+
+/*
+ * Sizes on both sides of the kmem_cache/kvmalloc() split and of
+ * max_size, checked through read() and the mmap() area.
+ */
+static void secret_test_sizes(struct kunit *test)
+{
+        static const size_t sizes[] = {
+                1, MAXBYTES - 1, MAXBYTES, MAXBYTES + 1, PAGE_SIZE, PAGE_SIZE + 1,
+        };
+        struct file *filp = secret_test_open(test);
+        char *in = secret_test_buf(test, max_size + 1);
+        char *out = secret_test_buf(test, max_size + 1);
+        struct secret_map_hdr *hdr;
+        size_t len;
+        loff_t pos;
+        int i;
+
+        KUNIT_ASSERT_EQ(test, secret_map_alloc(ctx), 0);
+        hdr = ctx->map;
+        get_random_bytes(in, max_size + 1);
+
+        for (i = 0; i <= ARRAY_SIZE(sizes); i++) {
+                len = i < ARRAY_SIZE(sizes) ? sizes[i] : max_size;
+                pos = 0;
+                KUNIT_EXPECT_EQ(test, secret_test_write(filp, in, len, &pos), (ssize_t)len);
+                secret_test_sync(test, filp);
+                pos = 0;
+                memset(out, 0, len);
+                KUNIT_EXPECT_EQ(test, secret_test_read(filp, out, max_size + 1, &pos),
+                                (ssize_t)len);
+                KUNIT_EXPECT_MEMEQ(test, out, in, len);
+                secret_test_expect_map(test, in, len);
+        }
+
+        /* one byte too many, at offset 0 and at the end */
+        pos = 0;
+        KUNIT_EXPECT_EQ(test, secret_test_write(filp, in, max_size + 1, &pos), -EFBIG);
+        pos = max_size;
+        KUNIT_EXPECT_EQ(test, secret_test_write(filp, in, 1, &pos), -EFBIG);
+        pos = (loff_t)max_size + 1;
+        KUNIT_EXPECT_EQ(test, secret_test_write(filp, in, 0, &pos), -EFBIG);
+
+        /* an empty write publishes nothing */
+        pos = 0;
+        KUNIT_EXPECT_EQ(test, secret_test_write(filp, in, 0, &pos), 0);
+        secret_test_sync(test, filp);
+        KUNIT_EXPECT_EQ(test, secret_llseek(filp, 0, SEEK_END), (loff_t)max_size);
+
+        /* a shorter secret leaves nothing of the longer one in the mapping */
+        secret_test_set(test, filp, "short");
+        secret_test_expect_map(test, "short", 5);
+        KUNIT_EXPECT_NULL(test, memchr_inv((char *)hdr + hdr->data_off + 5, 0, max_size - 5));
+}
+
+static void secret_test_poll(struct kunit *test)
+{
+        struct file *w = secret_test_open(test), *r = secret_test_open(test);
+        char buf[8];
+        loff_t pos = 0;
+
+        secret_test_set(test, w, "one");
+        KUNIT_EXPECT_EQ(test, secret_poll(r, NULL), EPOLLIN | EPOLLRDNORM | EPOLLOUT | EPOLLWRNORM);
+        KUNIT_EXPECT_EQ(test, secret_test_read(r, buf, sizeof(buf), &pos), 3);
+        KUNIT_EXPECT_EQ(test, secret_poll(r, NULL), EPOLLOUT | EPOLLWRNORM);
+        secret_test_set(test, w, "two");
+        KUNIT_EXPECT_EQ(test, secret_poll(r, NULL) & EPOLLIN, EPOLLIN);
+}
+
+/* in-kernel cost of the data path, no syscall or copy to user memory */
+static void secret_test_bench(struct kunit *test)
+{
+        static const size_t sizes[] = { 16, MAXBYTES, PAGE_SIZE, SZ_64K };
+        struct file *filp = secret_test_open(test);
+        char *buf = secret_test_buf(test, SZ_64K);
+        u64 t0, wr, rd;
+        size_t len;
+        loff_t pos;
+        int i, n, iters;
+
+        memset(buf, 0x5a, SZ_64K);
+        for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+                len = sizes[i];
+                if (len > max_size)
+                        break;
+                iters = clamp_t(int, SZ_16M / len, 256, 10000);
+
+                t0 = ktime_get_ns();
+                for (n = 0; n < iters; n++) {
+                        pos = 0;
+                        if (secret_test_write(filp, buf, len, &pos) != (ssize_t)len)
+                                break;
+                        secret_fsync(filp, 0, LLONG_MAX, 0);
+                        cond_resched();
+                }
+                wr = ktime_get_ns() - t0;
+                KUNIT_EXPECT_EQ(test, n, iters);
+
+                t0 = ktime_get_ns();
+                for (n = 0; n < iters; n++) {
+                        pos = 0;
+                        if (secret_test_read(filp, buf, len, &pos) != (ssize_t)len)
+                                break;
+                        cond_resched();
+                }
+                rd = ktime_get_ns() - t0;
+                KUNIT_EXPECT_EQ(test, n, iters);
+
+                kunit_info(test, "%6zu bytes: write %llu ns/op, read %llu ns/op (%d ops)\n",
+                           len, div_u64(wr, iters), div_u64(rd, iters), iters);
+                /* don't let the replaced versions pile up behind call_rcu() */
+                rcu_barrier();
+        }
+}
+
+static struct kunit_case secret_test_cases[] = {
+        KUNIT_CASE(secret_test_open_close),
+        KUNIT_CASE(secret_test_roundtrip),
+        KUNIT_CASE(secret_test_short_reads),
+        KUNIT_CASE(secret_test_append),
+        KUNIT_CASE(secret_test_writers),
+        KUNIT_CASE(secret_test_map_alloc),
+        KUNIT_CASE(secret_test_sizes),
+        KUNIT_CASE(secret_test_poll),
+        KUNIT_CASE_SLOW(secret_test_bench),
+        {}
+};
+
+static struct kunit_suite secret_test_suite = {
+        .name = "miscdrv_secret",
+        .test_cases = secret_test_cases,
+};
+
+kunit_test_suite(secret_test_suite);
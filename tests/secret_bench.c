@@ -0,0 +1,374 @@
+/*
+ * Read scaling of /dev/secret with a writer running. 1, 2, 4, ... up to
+ * max_readers threads each pread() the whole secret from offset 0 on
+ * their own descriptor while one thread keeps publishing new versions
+ * with write() + fsync(). Reports reads per second, and the writer's
+ * publishes per second, for each reader count. Every version is one
+ * byte repeated, so a read mixing two versions fails the run.
+ *
+ * With -m, one thread compares the two ways of getting at the secret
+ * for sizes from 16 bytes to 1 MiB: pread() of the whole secret against
+ * a copy out of the mmap() area under its seq protocol. Reports ns per
+ * copy each way.
+ *
+ * With -l, 1, 2, 4, ... up to max_writers threads each publish secrets
+ * with write() + fsync() as fast as they can, with the device mapped so
+ * every publish also updates the mmap() area. Reports the median and
+ * 99th percentile latency of a publish for each writer count.
+ *
+ *	secret_bench [-r max_readers] [-s size] [-d seconds] [device]
+ *	secret_bench -m [device]
+ *	secret_bench -l max_writers [-s size] [-d seconds] [device]
+ */
+#include <err.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "miscdrv_secret.h"
+
+static const char *dev = "/dev/secret";
+static size_t size = 64;
+static volatile int stop;
+
+struct reader {
+	pthread_t	td;
+	long		ops;
+	long		torn;
+};
+
+/* one read of the whole secret, 1 if it holds more than one version */
+static int
+read_secret(int fd, unsigned char *buf)
+{
+	ssize_t n;
+	size_t i;
+
+	if ((n = pread(fd, buf, size, 0)) < 0)
+		err(1, "read");
+	if ((size_t)n != size)
+		return (1);
+	for (i = 1; i < size; i++)
+		if (buf[i] != buf[0])
+			return (1);
+	return (0);
+}
+
+static void *
+reader_loop(void *arg)
+{
+	struct reader *r = arg;
+	unsigned char *buf;
+	int fd;
+
+	if ((fd = open(dev, O_RDONLY)) < 0)
+		err(1, "%s", dev);
+	if ((buf = malloc(size)) == NULL)
+		err(1, "malloc");
+	while (!stop) {
+		r->torn += read_secret(fd, buf);
+		r->ops++;
+	}
+	free(buf);
+	close(fd);
+	return (NULL);
+}
+
+static void
+publish(int fd, unsigned char *buf, unsigned char c)
+{
+	memset(buf, c, size);
+	if (pwrite(fd, buf, size, 0) != (ssize_t)size)
+		err(1, "write");
+	if (fsync(fd) != 0)
+		err(1, "fsync");
+}
+
+static void *
+writer_loop(void *arg)
+{
+	long *ops = arg;
+	unsigned char *buf;
+	int fd;
+
+	if ((fd = open(dev, O_WRONLY)) < 0)
+		err(1, "%s", dev);
+	if ((buf = malloc(size)) == NULL)
+		err(1, "malloc");
+	for (*ops = 0; !stop; (*ops)++)
+		publish(fd, buf, 'a' + *ops % 26);
+	free(buf);
+	close(fd);
+	return (NULL);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+/* the reader side of the protocol described at struct secret_map_hdr */
+static size_t
+map_copy(const struct secret_map_hdr *hdr, unsigned char *buf, size_t len)
+{
+	__u32 seq;
+	size_t n;
+
+	do {
+		while ((seq = __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE)) & 1)
+			;
+		n = __atomic_load_n(&hdr->len, __ATOMIC_RELAXED);
+		if (n > len)
+			n = len;
+		memcpy(buf, (const char *)hdr + hdr->data_off, n);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&hdr->seq, __ATOMIC_RELAXED) != seq);
+	return (n);
+}
+
+#define	MAP_MIN		16
+#define	MAP_MAX		(1024 * 1024)
+
+static void
+run_map(void)
+{
+	struct secret_map_hdr *hdr;
+	unsigned char *buf;
+	double t, tr, tm;
+	long i, iters;
+	size_t maplen;
+	int fd;
+
+	if ((fd = open(dev, O_RDWR)) < 0)
+		err(1, "%s", dev);
+	if ((buf = malloc(MAP_MAX)) == NULL)
+		err(1, "malloc");
+	maplen = sysconf(_SC_PAGESIZE) + MAP_MAX;
+	hdr = mmap(NULL, maplen, PROT_READ, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED)
+		err(1, "mmap");
+
+	printf("%10s %10s %10s   (ns per copy)\n", "size", "read", "mmap");
+	for (size = MAP_MIN; size <= MAP_MAX; size *= 8) {
+		publish(fd, buf, 'x');
+		iters = 64L * 1024 * 1024 / size;
+		if (iters > 1000000)
+			iters = 1000000;
+
+		t = now();
+		for (i = 0; i < iters; i++)
+			if (read_secret(fd, buf))
+				errx(1, "read %zu: short or torn", size);
+		tr = now() - t;
+
+		t = now();
+		for (i = 0; i < iters; i++)
+			if (map_copy(hdr, buf, size) != size)
+				errx(1, "mmap %zu: short copy", size);
+		tm = now() - t;
+
+		printf("%10zu %10.0f %10.0f\n", size, tr / iters, tm / iters);
+	}
+
+	munmap(hdr, maplen);
+	free(buf);
+	close(fd);
+}
+
+#define	SAMPLES		(1 << 18)	/* latencies kept per writer */
+
+struct writer {
+	pthread_t	td;
+	double		*lat;
+	long		n;
+	int		id;
+};
+
+static void *
+latency_loop(void *arg)
+{
+	struct writer *w = arg;
+	unsigned char *buf;
+	double t;
+	int fd;
+
+	if ((fd = open(dev, O_WRONLY)) < 0)
+		err(1, "%s", dev);
+	if ((buf = malloc(size)) == NULL)
+		err(1, "malloc");
+	for (w->n = 0; !stop && w->n < SAMPLES; w->n++) {
+		t = now();
+		publish(fd, buf, 'a' + w->id % 26);
+		w->lat[w->n] = now() - t;
+	}
+	free(buf);
+	close(fd);
+	return (NULL);
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return ((x > y) - (x < y));
+}
+
+static void
+run_latency(int maxwriters, int seconds)
+{
+	struct writer *w;
+	double *all;
+	void *hdr;
+	long total, pagesize;
+	int fd, i, n;
+
+	/* the mmap() area only exists, and costs a copy, once mapped */
+	if ((fd = open(dev, O_RDONLY)) < 0)
+		err(1, "%s", dev);
+	pagesize = sysconf(_SC_PAGESIZE);
+	if ((hdr = mmap(NULL, pagesize, PROT_READ, MAP_SHARED, fd, 0)) ==
+	    MAP_FAILED)
+		err(1, "mmap");
+	if ((w = calloc(maxwriters, sizeof(*w))) == NULL ||
+	    (all = malloc(sizeof(double) * SAMPLES)) == NULL)
+		err(1, "malloc");
+	for (i = 0; i < maxwriters; i++)
+		if ((w[i].lat = malloc(sizeof(double) * SAMPLES)) == NULL)
+			err(1, "malloc");
+
+	printf("%8s %12s %12s %12s   (%zu-byte secret, %d s each)\n",
+	    "writers", "publishes/s", "p50 us", "p99 us", size, seconds);
+	for (n = 1; n <= maxwriters; n *= 2) {
+		stop = 0;
+		for (i = 0; i < n; i++) {
+			w[i].id = i;
+			if (pthread_create(&w[i].td, NULL, latency_loop, &w[i]))
+				errx(1, "pthread_create");
+		}
+		sleep(seconds);
+		stop = 1;
+		for (total = 0, i = 0; i < n; i++) {
+			pthread_join(w[i].td, NULL);
+			total += w[i].n;
+		}
+
+		/* every writer's samples, sorted */
+		if (total == 0)
+			errx(1, "no publish completed in %d s", seconds);
+		if ((all = realloc(all, sizeof(double) * total)) == NULL)
+			err(1, "realloc");
+		for (total = 0, i = 0; i < n; i++) {
+			memcpy(all + total, w[i].lat, sizeof(double) * w[i].n);
+			total += w[i].n;
+		}
+		qsort(all, total, sizeof(double), cmp_double);
+		printf("%8d %12.0f %12.1f %12.1f\n", n, (double)total / seconds,
+		    all[total / 2] / 1e3, all[total * 99 / 100] / 1e3);
+	}
+
+	for (i = 0; i < maxwriters; i++)
+		free(w[i].lat);
+	free(all);
+	free(w);
+	munmap(hdr, pagesize);
+	close(fd);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: secret_bench [-r max_readers] [-s size] "
+	    "[-d seconds] [device]\n"
+	    "       secret_bench -m [device]\n"
+	    "       secret_bench -l max_writers [-s size] [-d seconds] "
+	    "[device]\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct reader *r;
+	pthread_t wtd;
+	long ops, wops, torn = 0;
+	int ch, i, n, maxreaders = 64, maxwriters = 0, seconds = 2, map = 0;
+
+	while ((ch = getopt(argc, argv, "d:l:mr:s:")) != -1) {
+		switch (ch) {
+		case 'd':
+			seconds = atoi(optarg);
+			break;
+		case 'l':
+			maxwriters = atoi(optarg);
+			if (maxwriters < 1)
+				usage();
+			break;
+		case 'm':
+			map = 1;
+			break;
+		case 'r':
+			maxreaders = atoi(optarg);
+			break;
+		case 's':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind < argc)
+		dev = argv[optind];
+	if (maxreaders < 1 || size == 0 || seconds < 1)
+		usage();
+	if (map) {
+		run_map();
+		return (0);
+	}
+	if (maxwriters > 0) {
+		run_latency(maxwriters, seconds);
+		return (0);
+	}
+	if ((r = calloc(maxreaders, sizeof(*r))) == NULL)
+		err(1, "calloc");
+
+	printf("%8s %12s %12s   (%zu-byte secret, %d s each)\n", "readers",
+	    "reads/s", "writes/s", size, seconds);
+	for (n = 1; n <= maxreaders; n *= 2) {
+		stop = 0;
+		if (pthread_create(&wtd, NULL, writer_loop, &wops))
+			errx(1, "pthread_create");
+		for (i = 0; i < n; i++) {
+			r[i].ops = 0;
+			r[i].torn = 0;
+			if (pthread_create(&r[i].td, NULL, reader_loop, &r[i]))
+				errx(1, "pthread_create");
+		}
+		sleep(seconds);
+		stop = 1;
+		for (ops = 0, i = 0; i < n; i++) {
+			pthread_join(r[i].td, NULL);
+			ops += r[i].ops;
+			torn += r[i].torn;
+		}
+		pthread_join(wtd, NULL);
+		printf("%8d %12.0f %12.0f\n", n, (double)ops / seconds,
+		    (double)wops / seconds);
+	}
+
+	free(r);
+	if (torn != 0) {
+		fprintf(stderr, "secret_bench: %ld torn reads\n", torn);
+		return (1);
+	}
+	return (0);
+}
@@ -0,0 +1,195 @@
+/*
+ * Checks the keyed store of /dev/secret from user space: every
+ * SECRET_IOC_GET_N entry must match what SECRET_IOC_GET says about the
+ * same key, including the SECRET_KV_NOENT and SECRET_KV_NOSPC cases,
+ * and nonzero input flags are refused. Needs the module loaded and
+ * leaves the keys it used deleted.
+ *
+ *	secret_kv_test [device]		(default /dev/secret)
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "miscdrv_secret.h"
+
+#define NKEYS	40		/* a few more than one hash bucket's worth */
+
+static int failures;
+
+#define CHECK(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		failures++;						\
+	}								\
+} while (0)
+
+/* ioctl(2) as 0 or an errno */
+static int
+xioctl(int fd, unsigned long cmd, void *arg)
+{
+	return ioctl(fd, cmd, arg) == 0 ? 0 : errno;
+}
+
+static void
+kv_init(struct secret_kv *kv, const char *key, void *val, uint32_t len)
+{
+	memset(kv, 0, sizeof(*kv));
+	memcpy(kv->key, key, strnlen(key, sizeof(kv->key) - 1));
+	kv->val = (uintptr_t)val;
+	kv->len = len;
+}
+
+static void
+key_name(char *buf, size_t len, int i)
+{
+	snprintf(buf, len, "kv_test.%d", i);
+}
+
+/* key i holds i + 1 bytes of 'a' + i % 26, so its length tells them apart */
+static void
+test_batch_vs_single(int fd)
+{
+	static char vals[NKEYS][SECRET_VAL_MAX], out[NKEYS + 2][SECRET_VAL_MAX];
+	struct secret_kv kvs[NKEYS + 2], kv;
+	struct secret_batch bt;
+	char key[SECRET_KEY_MAX], buf[SECRET_VAL_MAX];
+	int err, i;
+
+	for (i = 0; i < NKEYS; i++) {
+		key_name(key, sizeof(key), i);
+		memset(vals[i], 'a' + i % 26, i + 1);
+		kv_init(&kvs[i], key, vals[i], i + 1);
+	}
+	memset(&bt, 0, sizeof(bt));
+	bt.kvs = (uintptr_t)kvs;
+	bt.count = NKEYS;
+	CHECK(xioctl(fd, SECRET_IOC_PUT_N, &bt) == 0);
+
+	/*
+	 * Read them all back in one batch, plus a key that doesn't exist.
+	 * Every fourth buffer is one byte short.
+	 */
+	for (i = 0; i < NKEYS; i++) {
+		key_name(key, sizeof(key), i);
+		kv_init(&kvs[i], key, out[i], i % 4 == 3 ? i : i + 1);
+	}
+	kv_init(&kvs[NKEYS], "kv_test.missing", out[NKEYS], SECRET_VAL_MAX);
+	key_name(key, sizeof(key), 0);
+	kv_init(&kvs[NKEYS + 1], key, out[NKEYS + 1], SECRET_VAL_MAX);
+	bt.count = NKEYS + 2;
+	CHECK(xioctl(fd, SECRET_IOC_GET_N, &bt) == 0);
+
+	/* The same requests one at a time must agree entry by entry. */
+	for (i = 0; i < NKEYS + 2; i++) {
+		kv_init(&kv, kvs[i].key, buf, i < NKEYS && i % 4 == 3 ? i :
+		    i < NKEYS ? i + 1 : SECRET_VAL_MAX);
+		err = xioctl(fd, SECRET_IOC_GET, &kv);
+		switch (err) {
+		case 0:
+			CHECK(kvs[i].flags == 0);
+			CHECK(kvs[i].len == kv.len);
+			CHECK(memcmp(out[i], buf, kv.len) == 0);
+			break;
+		case ENOENT:
+			CHECK(kvs[i].flags == SECRET_KV_NOENT);
+			CHECK(kvs[i].len == 0);
+			break;
+		case ENOSPC:
+			CHECK(kvs[i].flags == SECRET_KV_NOSPC);
+			CHECK(kvs[i].len == kv.len);
+			break;
+		default:
+			CHECK(!"unexpected errno from SECRET_IOC_GET");
+			break;
+		}
+	}
+
+	/* And both agree with what was stored. */
+	for (i = 0; i < NKEYS; i++) {
+		if (i % 4 == 3) {
+			CHECK(kvs[i].flags == SECRET_KV_NOSPC);
+			CHECK(kvs[i].len == (uint32_t)i + 1);
+		} else {
+			CHECK(kvs[i].flags == 0);
+			CHECK(kvs[i].len == (uint32_t)i + 1);
+			CHECK(memcmp(out[i], vals[i], i + 1) == 0);
+		}
+	}
+	CHECK(kvs[NKEYS].flags == SECRET_KV_NOENT);
+	CHECK(kvs[NKEYS + 1].flags == 0 && kvs[NKEYS + 1].len == 1);
+
+	for (i = 0; i < NKEYS; i++) {
+		key_name(key, sizeof(key), i);
+		kv_init(&kv, key, NULL, 0);
+		CHECK(xioctl(fd, SECRET_IOC_DEL, &kv) == 0);
+	}
+	CHECK(xioctl(fd, SECRET_IOC_DEL, &kv) == ENOENT);
+}
+
+static void
+test_flags(int fd)
+{
+	struct secret_kv kv;
+	struct secret_batch bt;
+	char val[] = "v", buf[8];
+
+	/* 'flags' is output only: a request carrying any is refused. */
+	kv_init(&kv, "kv_test.flags", val, 1);
+	kv.flags = SECRET_KV_NOENT;
+	CHECK(xioctl(fd, SECRET_IOC_PUT, &kv) == EINVAL);
+	kv.flags = 0;
+	CHECK(xioctl(fd, SECRET_IOC_PUT, &kv) == 0);
+	kv_init(&kv, "kv_test.flags", buf, sizeof(buf));
+	kv.flags = 0x80000000;
+	CHECK(xioctl(fd, SECRET_IOC_GET, &kv) == EINVAL);
+	kv.flags = SECRET_KV_NOSPC;
+	CHECK(xioctl(fd, SECRET_IOC_DEL, &kv) == EINVAL);
+
+	memset(&bt, 0, sizeof(bt));
+	bt.kvs = (uintptr_t)&kv;
+	bt.count = 1;
+	kv.flags = 0;
+	bt.flags = 1;
+	CHECK(xioctl(fd, SECRET_IOC_GET_N, &bt) == EINVAL);
+	CHECK(xioctl(fd, SECRET_IOC_PUT_N, &bt) == EINVAL);
+	bt.flags = 0;
+	kv.flags = SECRET_KV_NOENT;
+	CHECK(xioctl(fd, SECRET_IOC_GET_N, &bt) == EINVAL);
+	kv_init(&kv, "kv_test.flags", val, 1);
+	kv.flags = 4;
+	CHECK(xioctl(fd, SECRET_IOC_PUT_N, &bt) == EINVAL);
+
+	/* Nothing above changed the stored value. */
+	kv_init(&kv, "kv_test.flags", buf, sizeof(buf));
+	CHECK(xioctl(fd, SECRET_IOC_GET, &kv) == 0);
+	CHECK(kv.len == 1 && buf[0] == 'v');
+	CHECK(xioctl(fd, SECRET_IOC_DEL, &kv) == 0);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *dev = argc > 1 ? argv[1] : "/dev/secret";
+	int fd;
+
+	if ((fd = open(dev, O_RDWR)) < 0) {
+		perror(dev);
+		return (1);
+	}
+	test_batch_vs_single(fd);
+	test_flags(fd);
+	close(fd);
+
+	if (failures != 0) {
+		fprintf(stderr, "secret_kv_test: %d failure(s)\n", failures);
+		return (1);
+	}
+	printf("secret_kv_test: ok\n");
+	return (0);
+}
@@ -0,0 +1,178 @@
+/*
+ * Stress and throughput of the keyed store of /dev/secret. Each thread
+ * opens the device on its own and runs a mix of SECRET_IOC_GET and
+ * SECRET_IOC_PUT (plus the odd SECRET_IOC_DEL) over a shared set of
+ * keys for a fixed time; reports operations per second for 1, 2, 4, ...
+ * threads. Every value is one byte repeated, so a GET that returns
+ * mixed bytes or a length that value never had is reported as torn.
+ *
+ *	secret_stress [-t max_threads] [-k keys] [-r read_pct] [-s seconds]
+ *	    [device]
+ */
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "miscdrv_secret.h"
+
+static const char *dev = "/dev/secret";
+static int nkeys = 1000;
+static int read_pct = 90;
+static volatile int stop;
+
+struct worker {
+	pthread_t	td;
+	unsigned int	seed;
+	long		ops;
+	long		torn;
+};
+
+static void
+kv_init(struct secret_kv *kv, int key, void *val, uint32_t len)
+{
+	memset(kv, 0, sizeof(*kv));
+	snprintf(kv->key, sizeof(kv->key), "stress.%d", key);
+	kv->val = (uintptr_t)val;
+	kv->len = len;
+}
+
+/* key k holds 1..SECRET_VAL_MAX bytes of the byte 'k % 251' */
+static int
+put(int fd, int key, uint32_t len)
+{
+	char val[SECRET_VAL_MAX];
+	struct secret_kv kv;
+
+	memset(val, key % 251, len);
+	kv_init(&kv, key, val, len);
+	return (ioctl(fd, SECRET_IOC_PUT, &kv));
+}
+
+static void *
+worker_loop(void *arg)
+{
+	struct worker *w = arg;
+	char val[SECRET_VAL_MAX];
+	struct secret_kv kv;
+	int fd, key, r;
+	uint32_t i;
+
+	if ((fd = open(dev, O_RDWR)) < 0)
+		err(1, "%s", dev);
+	while (!stop) {
+		key = rand_r(&w->seed) % nkeys;
+		r = rand_r(&w->seed) % 1000;
+		if (r < read_pct * 10) {
+			kv_init(&kv, key, val, sizeof(val));
+			if (ioctl(fd, SECRET_IOC_GET, &kv) == 0) {
+				for (i = 0; i < kv.len; i++)
+					if (val[i] != (char)(key % 251))
+						break;
+				if (kv.len == 0 || i != kv.len)
+					w->torn++;
+			} else if (errno != ENOENT) {
+				err(1, "SECRET_IOC_GET");
+			}
+		} else if (r < 995) {
+			if (put(fd, key, 1 + rand_r(&w->seed) % SECRET_VAL_MAX))
+				err(1, "SECRET_IOC_PUT");
+		} else {
+			kv_init(&kv, key, NULL, 0);
+			if (ioctl(fd, SECRET_IOC_DEL, &kv) && errno != ENOENT)
+				err(1, "SECRET_IOC_DEL");
+		}
+		w->ops++;
+	}
+	close(fd);
+	return (NULL);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: secret_stress [-t max_threads] [-k keys] "
+	    "[-r read_pct] [-s seconds] [device]\n");
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct worker *w;
+	struct secret_kv kv;
+	long ops, torn = 0;
+	int ch, fd, i, n, maxthreads = 64, seconds = 2;
+
+	while ((ch = getopt(argc, argv, "k:r:s:t:")) != -1) {
+		switch (ch) {
+		case 'k':
+			nkeys = atoi(optarg);
+			break;
+		case 'r':
+			read_pct = atoi(optarg);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 't':
+			maxthreads = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind < argc)
+		dev = argv[optind];
+	if (nkeys < 1 || read_pct < 0 || read_pct > 100 || seconds < 1 ||
+	    maxthreads < 1)
+		usage();
+
+	if ((fd = open(dev, O_RDWR)) < 0)
+		err(1, "%s", dev);
+	for (i = 0; i < nkeys; i++)
+		if (put(fd, i, SECRET_VAL_MAX))
+			err(1, "SECRET_IOC_PUT");
+	if ((w = calloc(maxthreads, sizeof(*w))) == NULL)
+		err(1, "calloc");
+
+	printf("%8s %12s   (%d keys, %d%% reads, %d s each)\n", "threads",
+	    "ops/s", nkeys, read_pct, seconds);
+	for (n = 1; n <= maxthreads; n *= 2) {
+		stop = 0;
+		for (i = 0; i < n; i++) {
+			w[i].seed = i + 1;
+			w[i].ops = 0;
+			w[i].torn = 0;
+			if (pthread_create(&w[i].td, NULL, worker_loop, &w[i]))
+				errx(1, "pthread_create");
+		}
+		sleep(seconds);
+		stop = 1;
+		for (ops = 0, i = 0; i < n; i++) {
+			pthread_join(w[i].td, NULL);
+			ops += w[i].ops;
+			torn += w[i].torn;
+		}
+		printf("%8d %12.0f\n", n, (double)ops / seconds);
+	}
+
+	for (i = 0; i < nkeys; i++) {
+		kv_init(&kv, i, NULL, 0);
+		ioctl(fd, SECRET_IOC_DEL, &kv);
+	}
+	close(fd);
+	free(w);
+	if (torn != 0) {
+		fprintf(stderr, "secret_stress: %ld torn values\n", torn);
+		return (1);
+	}
+	return (0);
+}
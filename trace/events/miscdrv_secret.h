@@ -0,0 +1,128 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Tracepoints of the secret misc device. They cost a static branch each
+ * while disabled; enable them under events/miscdrv_secret/ in tracefs.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM miscdrv_secret
+
+#if !defined(_TRACE_MISCDRV_SECRET_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_MISCDRV_SECRET_H
+
+#include <linux/sched.h>
+#include <linux/tracepoint.h>
+
+#ifndef _TRACE_MISCDRV_SECRET_DEF_ONCE
+#define _TRACE_MISCDRV_SECRET_DEF_ONCE
+enum { SECRET_OP_READ, SECRET_OP_WRITE, SECRET_OP_IOCTL };
+#endif
+
+TRACE_DEFINE_ENUM(SECRET_OP_READ);
+TRACE_DEFINE_ENUM(SECRET_OP_WRITE);
+TRACE_DEFINE_ENUM(SECRET_OP_IOCTL);
+
+#define show_secret_op(op)                                      \
+        __print_symbolic(op,                                    \
+                { SECRET_OP_READ,       "read" },               \
+                { SECRET_OP_WRITE,      "write" },              \
+                { SECRET_OP_IOCTL,      "ioctl" })
+
+TRACE_EVENT(secret_open,
+
+        TP_PROTO(unsigned int f_flags),
+
+        TP_ARGS(f_flags),
+
+        TP_STRUCT__entry(
+                __array(char,           comm,   TASK_COMM_LEN)
+                __field(pid_t,          pid)
+                __field(unsigned int,   f_flags)
+        ),
+
+        TP_fast_assign(
+                memcpy(__entry->comm, current->comm, TASK_COMM_LEN);
+                __entry->pid = current->pid;
+                __entry->f_flags = f_flags;
+        ),
+
+        TP_printk("comm=%s pid=%d f_flags=0x%x",
+                  __entry->comm, __entry->pid, __entry->f_flags)
+);
+
+/* 'ret' is the byte count or a negative errno, 'ns' the time spent */
+DECLARE_EVENT_CLASS(secret_io,
+
+        TP_PROTO(loff_t pos, size_t count, ssize_t ret, u64 ns),
+
+        TP_ARGS(pos, count, ret, ns),
+
+        TP_STRUCT__entry(
+                __array(char,           comm,   TASK_COMM_LEN)
+                __field(pid_t,          pid)
+                __field(loff_t,         pos)
+                __field(size_t,         count)
+                __field(ssize_t,        ret)
+                __field(u64,            ns)
+        ),
+
+        TP_fast_assign(
+                memcpy(__entry->comm, current->comm, TASK_COMM_LEN);
+                __entry->pid = current->pid;
+                __entry->pos = pos;
+                __entry->count = count;
+                __entry->ret = ret;
+                __entry->ns = ns;
+        ),
+
+        TP_printk("comm=%s pid=%d pos=%lld count=%zu ret=%zd ns=%llu",
+                  __entry->comm, __entry->pid, __entry->pos,
+                  __entry->count, __entry->ret, __entry->ns)
+);
+
+DEFINE_EVENT(secret_io, secret_read,
+        TP_PROTO(loff_t pos, size_t count, ssize_t ret, u64 ns),
+        TP_ARGS(pos, count, ret, ns)
+);
+
+DEFINE_EVENT(secret_io, secret_write,
+        TP_PROTO(loff_t pos, size_t count, ssize_t ret, u64 ns),
+        TP_ARGS(pos, count, ret, ns)
+);
+
+/* any read, write or ioctl that failed, in addition to the events above */
+TRACE_EVENT(secret_error,
+
+        TP_PROTO(int op, int err, u64 ns),
+
+        TP_ARGS(op, err, ns),
+
+        TP_STRUCT__entry(
+                __array(char,           comm,   TASK_COMM_LEN)
+                __field(pid_t,          pid)
+                __field(int,            op)
+                __field(int,            err)
+                __field(u64,            ns)
+        ),
+
+        TP_fast_assign(
+                memcpy(__entry->comm, current->comm, TASK_COMM_LEN);
+                __entry->pid = current->pid;
+                __entry->op = op;
+                __entry->err = err;
+                __entry->ns = ns;
+        ),
+
+        TP_printk("comm=%s pid=%d op=%s err=%d ns=%llu",
+                  __entry->comm, __entry->pid, show_secret_op(__entry->op),
+                  __entry->err, __entry->ns)
+);
+
+#endif /* _TRACE_MISCDRV_SECRET_H */
+
+/* found through -I$(src), see Kbuild */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH trace/events
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE miscdrv_secret
+
+#include <trace/define_trace.h>